@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+// Huge page size, the granule of chunk sizes and alignment
+#define ARENA_PAGE ((size_t)2 << 20)
+
+// Default chunk size: the buffers of a typical conversion fit in one
+#define ARENA_CHUNK ((size_t)8 << 20)
+
+// Chunks kept over a reset when the arena was not sized larger
+#define ARENA_RETAIN ((size_t)64 << 20)
+
+#define ARENA_ALIGN 64
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t size;      // mapped bytes, including this header
+} Chunk;
+
+#define CHUNK_HEADER ((sizeof(Chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct Arena {
+    Chunk *chunks;    // in allocation order
+    Chunk *current;   // chunk being allocated from
+    uint8_t *top;     // next free byte in current
+    uint8_t *end;     // end of current
+    uint8_t *last;    // start of the most recent allocation
+    size_t allocated; // bytes handed out since the reset
+    size_t peak;
+    size_t retain;
+    Arena *next_idle; // pool link
+};
+
+static __thread Arena *active_arena;
+
+static size_t round_up(size_t n, size_t granule) {
+    return (n + granule - 1) / granule * granule;
+}
+
+// Map a 2 MB aligned chunk of at least size bytes
+static Chunk* map_chunk(size_t size) {
+    size = round_up(size, ARENA_PAGE);
+    size_t span = size + ARENA_PAGE;
+    uint8_t *raw = (uint8_t*)mmap(NULL, span, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    // Trim to the alignment so the whole chunk can be backed by huge pages
+    uint8_t *base = (uint8_t*)round_up((uintptr_t)raw, ARENA_PAGE);
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    if (raw + span > base + size) {
+        munmap(base + size, raw + span - (base + size));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    Chunk *chunk = (Chunk*)base;
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
+
+static void use_chunk(Arena *arena, Chunk *chunk) {
+    arena->current = chunk;
+    arena->top = (uint8_t*)chunk + CHUNK_HEADER;
+    arena->end = (uint8_t*)chunk + chunk->size;
+}
+
+Arena* arena_create(size_t initial_bytes) {
+    Arena *arena = (Arena*)calloc(1, sizeof(Arena));
+    if (!arena) {
+        return NULL;
+    }
+    Chunk *chunk = map_chunk((initial_bytes > ARENA_CHUNK ? initial_bytes : ARENA_CHUNK) + CHUNK_HEADER);
+    if (!chunk) {
+        free(arena);
+        return NULL;
+    }
+    arena->retain = chunk->size > ARENA_RETAIN ? chunk->size : ARENA_RETAIN;
+    arena->chunks = chunk;
+    use_chunk(arena, chunk);
+    return arena;
+}
+
+void arena_destroy(Arena *arena) {
+    if (!arena) {
+        return;
+    }
+    Chunk *chunk = arena->chunks;
+    while (chunk) {
+        Chunk *next = chunk->next;
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+    free(arena);
+}
+
+void* arena_alloc(Arena *arena, size_t size) {
+    size = round_up(size ? size : 1, ARENA_ALIGN);
+    if ((size_t)(arena->end - arena->top) < size) {
+        // Move on to the next kept chunk if it fits, else map one after the
+        // current chunk; the rest of the current chunk stays unused
+        Chunk *next = arena->current->next;
+        if (!next || next->size - CHUNK_HEADER < size) {
+            Chunk *chunk = map_chunk((size > ARENA_CHUNK ? size : ARENA_CHUNK) + CHUNK_HEADER);
+            if (!chunk) {
+                return NULL;
+            }
+            chunk->next = next;
+            arena->current->next = chunk;
+            next = chunk;
+        }
+        use_chunk(arena, next);
+    }
+    void *ptr = arena->top;
+    arena->last = arena->top;
+    arena->top += size;
+    arena->allocated += size;
+    if (arena->allocated > arena->peak) {
+        arena->peak = arena->allocated;
+    }
+    return ptr;
+}
+
+void arena_reset(Arena *arena) {
+    // Keep the leading chunks that fit in the retained size
+    size_t kept = 0;
+    Chunk **link = &arena->chunks;
+    while (*link && kept + (*link)->size <= arena->retain) {
+        kept += (*link)->size;
+        link = &(*link)->next;
+    }
+    Chunk *chunk = *link;
+    *link = NULL;
+    while (chunk) {
+        Chunk *next = chunk->next;
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+    if (!arena->chunks) {
+        arena->chunks = map_chunk(ARENA_CHUNK + CHUNK_HEADER);
+    }
+    arena->current = NULL;
+    arena->top = arena->end = arena->last = NULL;
+    if (arena->chunks) {
+        use_chunk(arena, arena->chunks);
+    }
+    arena->allocated = 0;
+    arena->peak = 0;
+}
+
+size_t arena_high_water(const Arena *arena) {
+    return arena->peak;
+}
+
+Arena* arena_activate(Arena *arena) {
+    Arena *previous = active_arena;
+    active_arena = arena;
+    return previous;
+}
+
+void* job_malloc(size_t size) {
+    Arena *arena = active_arena;
+    if (arena && arena->current) {
+        void *ptr = arena_alloc(arena, size);
+        if (ptr) {
+            return ptr;
+        }
+    }
+    return malloc(size);
+}
+
+void* job_calloc(size_t count, size_t size) {
+    Arena *arena = active_arena;
+    if (arena && arena->current) {
+        if (size && count > SIZE_MAX / size) {
+            return NULL;
+        }
+        // Chunks are reused after a reset, so they are not known to be zero
+        void *ptr = arena_alloc(arena, count * size);
+        if (ptr) {
+            memset(ptr, 0, count * size);
+            return ptr;
+        }
+    }
+    return calloc(count, size);
+}
+
+void job_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    Arena *arena = active_arena;
+    if (arena) {
+        for (Chunk *chunk = arena->chunks; chunk; chunk = chunk->next) {
+            if ((uint8_t*)ptr >= (uint8_t*)chunk && (uint8_t*)ptr < (uint8_t*)chunk + chunk->size) {
+                if (ptr == arena->last) {
+                    arena->allocated -= arena->top - arena->last;
+                    arena->top = arena->last;
+                    arena->last = NULL;
+                }
+                return;
+            }
+        }
+    }
+    free(ptr);
+}
+
+// Idle arenas, at most one per job that ran concurrently
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Arena *idle_arenas;
+static size_t pool_initial_bytes;
+
+void arena_pool_configure(size_t initial_bytes) {
+    pthread_mutex_lock(&pool_mutex);
+    pool_initial_bytes = initial_bytes;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+Arena* arena_acquire(void) {
+    pthread_mutex_lock(&pool_mutex);
+    Arena *arena = idle_arenas;
+    if (arena) {
+        idle_arenas = arena->next_idle;
+    }
+    size_t initial_bytes = pool_initial_bytes;
+    pthread_mutex_unlock(&pool_mutex);
+    return arena ? arena : arena_create(initial_bytes);
+}
+
+void arena_release(Arena *arena) {
+    if (!arena) {
+        return;
+    }
+    arena_reset(arena);
+    pthread_mutex_lock(&pool_mutex);
+    arena->next_idle = idle_arenas;
+    idle_arenas = arena;
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,54 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for the buffers of one conversion. A job takes an arena
+// from the process-wide pool and activates it on its thread; job_malloc and
+// friends then allocate from it, and the whole arena is reset when the job
+// ends, so a batch or the daemon reuses the same (already faulted-in) pages
+// for every image instead of going through malloc and free for each
+// buffer. Chunks are mmap'ed in multiples of 2 MB, 2 MB aligned and marked
+// for transparent huge pages. An arena is used by one thread at a time;
+// without an active arena job_malloc is plain malloc.
+typedef struct Arena Arena;
+
+// Create an arena with initial_bytes mapped up front (0: grow on demand).
+// Returns NULL on error.
+Arena* arena_create(size_t initial_bytes);
+
+void arena_destroy(Arena *arena);
+
+// size bytes aligned to 64, NULL when no chunk can be mapped
+void* arena_alloc(Arena *arena, size_t size);
+
+// Release every allocation. Chunks up to the retained size (the larger of
+// initial_bytes and a default) are kept for the next job, others unmapped.
+void arena_reset(Arena *arena);
+
+// Most bytes allocated at once since the last reset
+size_t arena_high_water(const Arena *arena);
+
+// Make arena the one job_malloc uses on this thread (NULL: the heap).
+// Returns the previously active arena.
+Arena* arena_activate(Arena *arena);
+
+void* job_malloc(size_t size);
+void* job_calloc(size_t count, size_t size);
+
+// Free memory from job_malloc or job_calloc. Arena memory is only given
+// back when it is the most recent allocation, the rest waits for the reset;
+// heap memory is freed.
+void job_free(void *ptr);
+
+// Size new pool arenas to initial_bytes, set before the first job
+void arena_pool_configure(size_t initial_bytes);
+
+// Take an arena for one job from the pool, creating one if none is idle.
+// Returns NULL if none can be created; the job then uses the heap.
+Arena* arena_acquire(void);
+
+// Reset an arena and return it to the pool
+void arena_release(Arena *arena);
+
+#endif // ARENA_H
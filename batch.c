@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "batch.h"
+#include "threadpool.h"
+#include "cache.h"
+#include "median_cut.h"
+#include "palette_map.h"
+#include "dither.h"
+
+// One file of a batch
+typedef struct {
+    const char *input;
+    char *output;
+    const ConvertOptions *opts;
+    int result;
+} BatchJob;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read a list of input files
+char** read_file_list(const char *list_file, int *count) {
+    FILE *fp = stdin;
+    if (strcmp(list_file, "-") != 0) {
+        fp = fopen(list_file, "r");
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot open file list %s\n", list_file);
+            return NULL;
+        }
+    }
+    
+    int capacity = 256;
+    int n = 0;
+    char **files = (char**)malloc(sizeof(char*) * capacity);
+    char line[4096];
+    while (files && fgets(line, sizeof(line), fp)) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0) {
+            continue;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            char **new_files = (char**)realloc(files, sizeof(char*) * capacity);
+            if (!new_files) {
+                free_file_list(files, n);
+                files = NULL;
+                break;
+            }
+            files = new_files;
+        }
+        files[n] = strdup(line);
+        if (!files[n]) {
+            free_file_list(files, n);
+            files = NULL;
+            break;
+        }
+        n++;
+    }
+    
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (!files) {
+        fprintf(stderr, "Error: Memory allocation failed for file list\n");
+        return NULL;
+    }
+    *count = n;
+    return files;
+}
+
+void free_file_list(char **files, int count) {
+    if (files) {
+        for (int i = 0; i < count; i++) {
+            free(files[i]);
+        }
+        free(files);
+    }
+}
+
+char* batch_output_path(const char *input, const char *output_dir) {
+    const char *base = input;
+    const char *slash = strrchr(input, '/');
+    if (output_dir && slash) {
+        base = slash + 1;
+    }
+    
+    size_t base_len = strlen(base);
+    const char *dot = strrchr(base, '.');
+    if (dot && (!slash || dot > slash) && dot != base) {
+        base_len = dot - base;
+    }
+    
+    size_t dir_len = output_dir ? strlen(output_dir) : 0;
+    char *path = (char*)malloc(dir_len + 1 + base_len + 5);
+    if (!path) {
+        return NULL;
+    }
+    
+    size_t pos = 0;
+    if (output_dir) {
+        memcpy(path, output_dir, dir_len);
+        pos = dir_len;
+        if (dir_len > 0 && output_dir[dir_len - 1] != '/') {
+            path[pos++] = '/';
+        }
+    }
+    memcpy(path + pos, base, base_len);
+    strcpy(path + pos + base_len, ".bmp");
+    return path;
+}
+
+static void run_job(void *arg) {
+    BatchJob *job = (BatchJob*)arg;
+    job->result = convert_image(job->input, job->output, job->opts);
+    if (job->result != 0) {
+        fprintf(stderr, "Error: %s: conversion failed\n", job->input);
+    }
+}
+
+// Convert many files on a thread pool
+int run_batch(char **inputs, int count, const char *output_dir,
+              int num_threads, const ConvertOptions *opts) {
+    BatchJob *jobs = (BatchJob*)calloc(count > 0 ? count : 1, sizeof(BatchJob));
+    if (!jobs) {
+        fprintf(stderr, "Error: Memory allocation failed for batch jobs\n");
+        return count;
+    }
+    
+    if (num_threads > count) {
+        num_threads = count > 0 ? count : 1;
+    }
+    ThreadPool *pool = pool_create(num_threads);
+    if (!pool) {
+        fprintf(stderr, "Error: Cannot create worker threads\n");
+        free(jobs);
+        return count;
+    }
+    
+    double start = now_seconds();
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        jobs[i].input = inputs[i];
+        jobs[i].output = batch_output_path(inputs[i], output_dir);
+        jobs[i].opts = opts;
+        jobs[i].result = 1;
+        if (!jobs[i].output || pool_submit(pool, run_job, &jobs[i]) != 0) {
+            fprintf(stderr, "Error: %s: cannot queue conversion\n", inputs[i]);
+            jobs[i].result = -1;
+        }
+    }
+    pool_wait(pool);
+    pool_destroy(pool);
+    double elapsed = now_seconds() - start;
+    
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].result != 0) {
+            failed++;
+        }
+        free(jobs[i].output);
+    }
+    free(jobs);
+    
+    fprintf(stderr, "Batch: %d images in %.2f s (%.1f images/sec) on %d threads, %d failed\n",
+            count - failed, elapsed, elapsed > 0 ? (count - failed) / elapsed : 0.0,
+            num_threads, failed);
+    if (opts->cache) {
+        CacheCounters counters;
+        cache_get_counters(opts->cache, &counters);
+        fprintf(stderr, "Cache: %lu hits, %lu misses; palettes %lu hits, %lu misses\n",
+                counters.result_hits, counters.result_misses,
+                counters.palette_hits, counters.palette_misses);
+    }
+    return failed;
+}
+
+// One image of the shared palette pass
+typedef struct {
+    const char *input;
+    const ConvertOptions *opts;
+    ColorHistogram *hist;  // shared by all jobs
+    pthread_mutex_t *lock; // guards hist
+    int ok;
+} SampleJob;
+
+static void run_sample(void *arg) {
+    SampleJob *job = (SampleJob*)arg;
+    Image *resized = read_resized_image(job->input, job->opts);
+    if (!resized) {
+        return;
+    }
+    pthread_mutex_lock(job->lock);
+    for (int y = 0; y < resized->height; y++) {
+        histogram_add_pixels(job->hist, image_row(resized, y), resized->width);
+    }
+    pthread_mutex_unlock(job->lock);
+    free_image(resized);
+    job->ok = 1;
+}
+
+// Build one palette from a merged histogram of the inputs
+int build_shared_palette(char **inputs, int count, int max_samples, int num_threads,
+                         const ConvertOptions *opts, Color *palette) {
+    int samples = max_samples > 0 && max_samples < count ? max_samples : count;
+    SampleJob *jobs = (SampleJob*)calloc(samples > 0 ? samples : 1, sizeof(SampleJob));
+    ColorHistogram *hist = histogram_create(HISTOGRAM_BITS);
+    if (num_threads > samples) {
+        num_threads = samples > 0 ? samples : 1;
+    }
+    ThreadPool *pool = pool_create(num_threads);
+    if (!jobs || !hist || !pool) {
+        fprintf(stderr, "Error: Cannot set up the shared palette pass\n");
+        pool_destroy(pool);
+        histogram_free(hist);
+        free(jobs);
+        return -1;
+    }
+    
+    double start = now_seconds();
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    for (int i = 0; i < samples; i++) {
+        // Evenly spaced over the list, so sequences are sampled throughout
+        jobs[i].input = inputs[(long long)i * count / samples];
+        jobs[i].opts = opts;
+        jobs[i].hist = hist;
+        jobs[i].lock = &lock;
+        if (pool_submit(pool, run_sample, &jobs[i]) != 0) {
+            run_sample(&jobs[i]);
+        }
+    }
+    pool_wait(pool);
+    pool_destroy(pool);
+    
+    int sampled = 0;
+    for (int i = 0; i < samples; i++) {
+        sampled += jobs[i].ok;
+    }
+    int result = -1;
+    if (sampled > 0) {
+        median_cut_histogram(hist, palette, NUM_COLORS);
+        fprintf(stderr, "Palette: %d of %d images sampled in %.2f s\n",
+                sampled, count, now_seconds() - start);
+        result = 0;
+    } else {
+        fprintf(stderr, "Error: No image could be read for the shared palette\n");
+    }
+    pthread_mutex_destroy(&lock);
+    histogram_free(hist);
+    free(jobs);
+    return result;
+}
+
+// State carried from one frame of a sequence to the next
+typedef struct {
+    const ConvertOptions *opts;
+    double max_drift;
+    int method;              // PaletteMethod used when the palette is regenerated
+    ColorHistogram *ref;     // histogram of the frame the palette came from
+    ColorHistogram *cur;     // histogram of the current frame
+    Image *prev;             // previous resized frame, NULL before the first
+    IndexedImage *packed;    // output of the previous frame, updated in place
+    PaletteMap *map;         // inverse colormap of packed->palette
+    Ditherer dither;         // maps rows through map
+    uint8_t *indices;
+    int have_palette;
+    // Counters for the summary
+    int recomputed;
+    long long rows_skipped;
+    long long rows_total;
+} Sequence;
+
+// Regenerate the palette from the current frame when its colors drifted
+// away from the palette's frame. Returns 1 if the palette changed.
+static int update_sequence_palette(Sequence *seq, Image *img, double *drift) {
+    ColorHistogram *cur = seq->cur;
+    histogram_clear(cur);
+    for (int y = 0; y < img->height; y++) {
+        histogram_add_pixels(cur, image_row(img, y), img->width);
+    }
+    *drift = seq->have_palette ? histogram_distance(seq->ref, cur) : 1.0;
+    if (seq->have_palette && *drift <= seq->max_drift) {
+        return 0;
+    }
+    
+    Color *palette = seq->packed->palette;
+    if (seq->method == PALETTE_HISTOGRAM) {
+        // The frame's histogram is the input of the histogram median cut
+        median_cut_histogram(cur, palette, NUM_COLORS);
+    } else {
+        Image *sample = NULL;
+        if (seq->opts->palette_samples > 0) {
+            sample = sample_pixels(img, seq->opts->palette_samples);
+        }
+        generate_palette(sample ? sample : img, palette, NUM_COLORS, seq->method);
+        free_image(sample);
+    }
+    palette_map_init(seq->map, palette, NUM_COLORS);
+    seq->cur = seq->ref;
+    seq->ref = cur;
+    seq->have_palette = 1;
+    seq->recomputed++;
+    return 1;
+}
+
+// Convert one resized frame into seq->packed. Returns 0 on success.
+static int convert_frame(Sequence *seq, Image *img, const char *input) {
+    double drift = 0.0;
+    int changed = !seq->opts->palette && update_sequence_palette(seq, img, &drift);
+    int remap_all = changed || seq->prev == NULL;
+    
+    IndexedImage *packed = seq->packed;
+    int skipped = 0;
+    if (seq->opts->dither == DITHER_FS) {
+        // Diffused error makes every row depend on the rows above it
+        if (dither_fs_image(seq->map, img, packed, NULL, 1) != 0) {
+            return -1;
+        }
+    } else {
+        for (int y = 0; y < img->height; y++) {
+            const uint8_t *row = image_row(img, y);
+            if (!remap_all && memcmp(row, image_row(seq->prev, y), img->width * 3) == 0) {
+                skipped++; // still holds the same indices
+                continue;
+            }
+            dither_row(&seq->dither, row, y, seq->indices);
+            pack_row_4bpp(seq->indices, img->width, packed->indices + y * packed->stride, packed->stride);
+        }
+    }
+    seq->rows_skipped += skipped;
+    seq->rows_total += img->height;
+    if (seq->opts->verbose) {
+        fprintf(stderr, "%s: drift %.4f, palette %s, %d of %d rows unchanged\n", input, drift,
+                changed ? "generated" : "kept", skipped, img->height);
+    }
+    return 0;
+}
+
+// Convert a frame sequence in order
+int run_sequence(char **inputs, int count, const char *output_dir, double max_drift,
+                 const ConvertOptions *opts) {
+    Sequence seq;
+    memset(&seq, 0, sizeof(seq));
+    seq.opts = opts;
+    seq.max_drift = max_drift;
+    seq.method = opts->optimize_palette ? opts->optimize_palette : PALETTE_HISTOGRAM;
+    seq.ref = histogram_create(HISTOGRAM_BITS);
+    seq.cur = histogram_create(HISTOGRAM_BITS);
+    seq.packed = create_indexed_image(TARGET_WIDTH, TARGET_HEIGHT, 4);
+    seq.map = (PaletteMap*)malloc(sizeof(PaletteMap));
+    seq.indices = (uint8_t*)malloc(TARGET_WIDTH);
+    int failed = count;
+    if (!seq.ref || !seq.cur || !seq.packed || !seq.map || !seq.indices) {
+        fprintf(stderr, "Error: Memory allocation failed for frame sequence\n");
+        goto done;
+    }
+    if (ditherer_init(&seq.dither, seq.map, opts->dither, TARGET_WIDTH) != 0) {
+        goto done;
+    }
+    seq.packed->num_colors = NUM_COLORS;
+    if (opts->palette) {
+        memcpy(seq.packed->palette, opts->palette, sizeof(Color) * NUM_COLORS);
+        palette_map_init(seq.map, seq.packed->palette, NUM_COLORS);
+        seq.have_palette = 1;
+    }
+    
+    double start = now_seconds();
+    failed = 0;
+    for (int i = 0; i < count; i++) {
+        char *output = batch_output_path(inputs[i], output_dir);
+        Image *img = output ? read_resized_image(inputs[i], opts) : NULL;
+        if (!img) {
+            // The next frame is compared with the last good one
+            fprintf(stderr, "Error: %s: conversion failed\n", inputs[i]);
+            free(output);
+            failed++;
+            continue;
+        }
+        if (convert_frame(&seq, img, inputs[i]) != 0) {
+            // Only Floyd-Steinberg can fail, and it maps every row of the
+            // next frame again, so the stale indices are never written
+            fprintf(stderr, "Error: %s: conversion failed\n", inputs[i]);
+            free_image(img);
+            free(output);
+            failed++;
+            continue;
+        }
+        free_image(seq.prev);
+        seq.prev = img;
+        
+        FILE *out = fopen(output, "wb");
+        if (out && opts->rle) {
+            write_bmp_rle4(seq.packed, out);
+        } else if (out) {
+            write_bmp(seq.packed, out);
+        }
+        if (!out || fclose(out) != 0) {
+            fprintf(stderr, "Error: Cannot write output file %s\n", output);
+            failed++;
+        }
+        free(output);
+    }
+    double elapsed = now_seconds() - start;
+    
+    int frames = count - failed;
+    fprintf(stderr, "Sequence: %d frames in %.2f s (%.1f frames/sec), %d failed\n",
+            frames, elapsed, elapsed > 0 ? frames / elapsed : 0.0, failed);
+    if (seq.rows_total > 0) {
+        int converted = (int)(seq.rows_total / TARGET_HEIGHT);
+        fprintf(stderr, "Palette: generated for %d of %d frames (%.1f%%), "
+                "%.1f%% of rows unchanged and not remapped\n",
+                seq.recomputed, converted, seq.recomputed * 100.0 / converted,
+                seq.rows_skipped * 100.0 / seq.rows_total);
+    }
+    
+done:
+    histogram_free(seq.ref);
+    histogram_free(seq.cur);
+    free_image(seq.prev);
+    free_indexed_image(seq.packed);
+    free(seq.map);
+    free(seq.indices);
+    ditherer_free(&seq.dither);
+    return failed;
+}
@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "transform.h"
+
+// Read a list of input files, one path per line ("-" reads the list from
+// stdin). Blank lines are skipped. Returns NULL on error.
+char** read_file_list(const char *list_file, int *count);
+
+void free_file_list(char **files, int count);
+
+// Output path for an input: output_dir (or the input's directory when
+// output_dir is NULL) plus the input's base name with a .bmp extension.
+// Returns a malloc'ed string, NULL on allocation failure.
+char* batch_output_path(const char *input, const char *output_dir);
+
+// Convert many files on a work-stealing pool of num_threads workers. Each
+// output goes to output_dir (or next to its input when output_dir is NULL)
+// with the extension replaced by .bmp. A failing file does not affect the
+// others. Prints a summary to stderr and returns the number of failures.
+int run_batch(char **inputs, int count, const char *output_dir,
+              int num_threads, const ConvertOptions *opts);
+
+// Build one palette for a set of images: every input (or max_samples evenly
+// spaced inputs when max_samples > 0) is decoded, cropped and resized as the
+// conversion would, the pixels of all of them are merged into one color
+// histogram, and median cut runs once over it. Inputs that fail to decode
+// are skipped. Returns 0 on success.
+int build_shared_palette(char **inputs, int count, int max_samples, int num_threads,
+                         const ConvertOptions *opts, Color *palette);
+
+// Convert the inputs as the frames of one sequence, in order. The palette of
+// a frame is reused for the next ones until the color histogram drifts more
+// than max_drift (a histogram_distance) from the frame it was generated from;
+// only then is it generated again, from the histogram with the VGA or
+// histogram method and from the pixels with median cut. With opts->palette
+// the palette never changes. Rows whose pixels are unchanged from the previous
+// frame keep their packed indices without being mapped again. Outputs are
+// named as in run_batch. Prints a summary to stderr and returns the number
+// of failures.
+int run_sequence(char **inputs, int count, const char *output_dir, double max_drift,
+                 const ConvertOptions *opts);
+
+#endif // BATCH_H
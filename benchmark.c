@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <jpeglib.h>
+#include <png.h>
+#include "transform.h"
+#include "resample.h"
+#include "palette_map.h"
+#include "dither.h"
+#include "threadpool.h"
+#include "png_reader.h"
+#include "jpeg_reader.h"
+#include "stats.h"
+
+// Two benchmarks in one binary:
+//
+// Without input files, the kernel suite generates synthetic photographic and
+// flat-color images at several sizes and times every pipeline stage on its
+// own. Results are printed as CSV, one line per stage and image, with the
+// best run's ns/pixel, MP/s, heap allocations (counted by the --stats hooks,
+// empty unless built with STATS_ALLOCS=1) and, where perf_event_open is permitted,
+// cycles, instructions and cache misses (empty fields otherwise).
+// Pixels are always those of the stage's input image.
+//
+// With input files, every input is upscaled, re-encoded into a temporary
+// file in its own format and then decoded repeatedly through stdio and
+// through the memory-mapped path of read_image_auto. The best time of each
+// path is reported, one line per input.
+//
+// With -p, every JPEG input is upscaled and re-encoded as a progressive JPEG
+// instead, and decoded with each --progressive-stop level. Each level reports
+// the best decode time, the scans decoded, and how far its 720x576 output is
+// from that of the full decode: the PSNR of the resized RGB image and the
+// share of pixels whose VGA palette index changed.
+
+// Hardware counters, read as one group so they cover the same interval
+#define NUM_COUNTERS 3
+
+static const char *counter_names[NUM_COUNTERS] = {"cycles", "instructions", "cache_misses"};
+static int perf_fds[NUM_COUNTERS] = {-1, -1, -1};
+
+static void perf_close(void) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (perf_fds[i] >= 0) {
+            close(perf_fds[i]);
+            perf_fds[i] = -1;
+        }
+    }
+}
+
+// Returns 0 when every counter could be opened for this process
+static int perf_open(void) {
+    static const uint64_t events[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : perf_fds[0], 0);
+        if (perf_fds[i] < 0) {
+            perf_close();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void perf_start(void) {
+    if (perf_fds[0] >= 0) {
+        ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+// Returns 0 and fills values when the counters are available
+static int perf_stop(uint64_t *values) {
+    if (perf_fds[0] < 0) {
+        return -1;
+    }
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t group[1 + NUM_COUNTERS];
+    if (read(perf_fds[0], group, sizeof(group)) != (ssize_t)sizeof(group) || group[0] != NUM_COUNTERS) {
+        return -1;
+    }
+    memcpy(values, &group[1], sizeof(uint64_t) * NUM_COUNTERS);
+    return 0;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int encode_jpeg(const Image *img, FILE *fp, int progressive) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+
+    cinfo.image_width = img->width;
+    cinfo.image_height = img->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 90, TRUE);
+    if (progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = image_row(img, cinfo.next_scanline);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+static int write_jpeg(const Image *img, FILE *fp) {
+    return encode_jpeg(img, fp, 0);
+}
+
+static int write_png(const Image *img, FILE *fp) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        return -1;
+    }
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, NULL);
+        return -1;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return -1;
+    }
+
+    png_init_io(png, fp);
+    // Encoding the fixtures quickly matters more than their size
+    png_set_compression_level(png, 1);
+    png_set_IHDR(png, info, img->width, img->height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (int y = 0; y < img->height; y++) {
+        png_write_row(png, image_row(img, y));
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    return 0;
+}
+
+// Decode through plain stdio, as read_image_auto did before the mmap path
+static Image* read_stdio(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    Image *img = NULL;
+    switch (detect_image_format(fp)) {
+        case FORMAT_PNG:
+            img = read_png_from_fp(fp);
+            break;
+        case FORMAT_JPEG:
+            img = read_jpeg_from_fp(fp);
+            break;
+        default:
+            break;
+    }
+    fclose(fp);
+    return img;
+}
+
+static Image* read_mmap(const char *path) {
+    return read_image_auto(path, NULL, NULL);
+}
+
+// Best of runs decodes, in milliseconds, or -1 on failure
+static double time_decode(Image* (*decode)(const char*), const char *path, int runs) {
+    double best = -1;
+    for (int i = 0; i < runs; i++) {
+        double start = now_ms();
+        Image *img = decode(path);
+        double ms = now_ms() - start;
+        if (!img) {
+            return -1;
+        }
+        free_image(img);
+        if (best < 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Progressive early-out levels, {coefficients, bits}; the last decodes every scan
+static const int stop_levels[][2] = {{1, 1}, {1, 0}, {6, 2}, {64, 1}, {0, 0}};
+#define NUM_STOP_LEVELS (int)(sizeof(stop_levels) / sizeof(stop_levels[0]))
+
+// Best of runs decodes of path with the early out of hints, in milliseconds,
+// or -1 on failure. The last decode is resized to the target size into
+// *resized and its scan count stored in *scans.
+static double time_progressive(const char *path, const DecodeHints *hints, int runs,
+                               Image **resized, int *scans) {
+    double best = -1;
+    for (int i = 0; i < runs; i++) {
+        DecodeInfo info = {0, 0, 1, 1, 0, 0};
+        double start = now_ms();
+        Image *img = read_image_auto(path, hints, &info);
+        double ms = now_ms() - start;
+        if (!img) {
+            return -1;
+        }
+        if (i == runs - 1) {
+            *resized = resize_image(img, TARGET_WIDTH, TARGET_HEIGHT);
+            *scans = info.scans;
+        }
+        free_image(img);
+        if (best < 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return *resized ? best : -1;
+}
+
+static double psnr(const Image *a, const Image *b) {
+    double sum = 0;
+    for (int y = 0; y < a->height; y++) {
+        const uint8_t *pa = image_row(a, y);
+        const uint8_t *pb = image_row(b, y);
+        for (int x = 0; x < a->width * 3; x++) {
+            double d = (double)pa[x] - pb[x];
+            sum += d * d;
+        }
+    }
+    double mse = sum / ((double)a->width * a->height * 3);
+    return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+// Percentage of pixels with a different index in two 4-bit images
+static double changed_percent(const IndexedImage *a, const IndexedImage *b) {
+    size_t changed = 0;
+    for (int y = 0; y < a->height; y++) {
+        const uint8_t *ra = a->indices + (size_t)y * a->stride;
+        const uint8_t *rb = b->indices + (size_t)y * b->stride;
+        for (int x = 0; x < a->width; x++) {
+            int shift = (x & 1) ? 0 : 4;
+            changed += ((ra[x / 2] >> shift) & 0xF) != ((rb[x / 2] >> shift) & 0xF);
+        }
+    }
+    return 100.0 * changed / ((double)a->width * a->height);
+}
+
+// Re-encode big as a progressive JPEG and time every early-out level against
+// the full decode. Returns 0 on success.
+static int run_progressive(const char *name, Image *big, int runs) {
+    char path[] = "/tmp/benchmark-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create temporary file\n");
+        return -1;
+    }
+    int ok = encode_jpeg(big, out, 1) == 0;
+    fclose(out);
+
+    double ms[NUM_STOP_LEVELS];
+    int scans[NUM_STOP_LEVELS];
+    Image *resized[NUM_STOP_LEVELS] = {NULL};
+    IndexedImage *mapped[NUM_STOP_LEVELS] = {NULL};
+    for (int l = 0; ok && l < NUM_STOP_LEVELS; l++) {
+        DecodeHints hints = {0, 0, 0, 0, 0, stop_levels[l][0], stop_levels[l][1]};
+        ms[l] = time_progressive(path, &hints, runs, &resized[l], &scans[l]);
+        mapped[l] = ms[l] >= 0 ? quantize_colors(resized[l], NUM_COLORS, PALETTE_VGA) : NULL;
+        ok = mapped[l] != NULL;
+    }
+    unlink(path);
+
+    if (ok) {
+        const int full = NUM_STOP_LEVELS - 1;
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", big->width, big->height);
+        for (int l = 0; l < NUM_STOP_LEVELS; l++) {
+            char level[16], scan_count[16];
+            if (l == full) {
+                snprintf(level, sizeof(level), "full");
+                snprintf(scan_count, sizeof(scan_count), "all");
+            } else {
+                snprintf(level, sizeof(level), "%d,%d", stop_levels[l][0], stop_levels[l][1]);
+                snprintf(scan_count, sizeof(scan_count), "%d", scans[l]);
+            }
+            printf("%-24s %12s %6s %5s %10.2f %7.2fx %8.2f %9.2f%%\n", name, size, level,
+                   scan_count, ms[l], ms[full] / ms[l], psnr(resized[l], resized[full]),
+                   changed_percent(mapped[l], mapped[full]));
+        }
+    } else {
+        fprintf(stderr, "Error: Decoding failed for %s\n", name);
+    }
+    for (int l = 0; l < NUM_STOP_LEVELS; l++) {
+        free_image(resized[l]);
+        free_indexed_image(mapped[l]);
+    }
+    return ok ? 0 : -1;
+}
+
+// Inputs shared by the kernels of one synthetic image
+typedef struct {
+    const char *pattern;
+    Image *img;
+    IndexedImage *indexed; // img mapped to the VGA palette, for write_bmp
+    IndexedImage *mapped;  // 8-bit output of the mapping kernels
+    PaletteMap *map;       // inverse colormap of the VGA palette
+    ThreadPool *pool;      // one worker per CPU, for the wavefront kernel
+    char *png;
+    size_t png_size;
+    char *jpeg;
+    size_t jpeg_size;
+    FILE *null_out;
+} Fixture;
+
+// Smooth gradients with sensor-like noise, or a few large flat regions
+static Image* make_synthetic(int width, int height, int flat) {
+    static const uint8_t flat_colors[8][3] = {
+        {230, 230, 230}, {30, 60, 140}, {200, 40, 40}, {40, 160, 60},
+        {250, 200, 0}, {20, 20, 20}, {120, 120, 120}, {150, 90, 40}
+    };
+    Image *img = create_image(width, height);
+    if (!img) {
+        return NULL;
+    }
+    uint32_t seed = 12345;
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = image_row(img, y);
+        for (int x = 0; x < width; x++) {
+            if (flat) {
+                const uint8_t *c = flat_colors[(x * 5 / width + y * 3 / height * 5) % 8];
+                memcpy(&row[x * 3], c, 3);
+                continue;
+            }
+            int base[3] = {
+                x * 255 / width,
+                y * 255 / height,
+                128 + (int)(100 * sin(x * 0.004) * cos(y * 0.003))
+            };
+            for (int c = 0; c < 3; c++) {
+                seed = seed * 1103515245 + 12345;
+                int v = base[c] + (int)((seed >> 16) % 25) - 12;
+                row[x * 3 + c] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+    }
+    return img;
+}
+
+static int encode_to_memory(const Image *img, int (*encode)(const Image*, FILE*), char **buf, size_t *size) {
+    FILE *fp = open_memstream(buf, size);
+    if (!fp) {
+        return -1;
+    }
+    int result = encode(img, fp);
+    fclose(fp);
+    return result;
+}
+
+static int fixture_init(Fixture *f, int width, int height, int flat) {
+    memset(f, 0, sizeof(*f));
+    f->pattern = flat ? "flat" : "photo";
+    f->img = make_synthetic(width, height, flat);
+    f->indexed = f->img ? quantize_colors(f->img, NUM_COLORS, PALETTE_VGA) : NULL;
+    f->null_out = fopen("/dev/null", "wb");
+    f->mapped = f->img ? create_indexed_image(width, height, 8) : NULL;
+    f->map = (PaletteMap*)malloc(sizeof(PaletteMap));
+    f->pool = pool_create(pool_default_threads());
+    if (!f->indexed || !f->null_out || !f->mapped || !f->map || !f->pool ||
+        encode_to_memory(f->img, write_png, &f->png, &f->png_size) != 0 ||
+        encode_to_memory(f->img, write_jpeg, &f->jpeg, &f->jpeg_size) != 0) {
+        return -1;
+    }
+    palette_map_init(f->map, f->indexed->palette, f->indexed->num_colors);
+    return 0;
+}
+
+static void fixture_free(Fixture *f) {
+    free_image(f->img);
+    free_indexed_image(f->indexed);
+    free_indexed_image(f->mapped);
+    free(f->map);
+    if (f->pool) {
+        pool_destroy(f->pool);
+    }
+    free(f->png);
+    free(f->jpeg);
+    if (f->null_out) {
+        fclose(f->null_out);
+    }
+}
+
+static int decode_memory(char *buf, size_t size, Image* (*decode)(FILE*)) {
+    FILE *fp = fmemopen(buf, size, "rb");
+    if (!fp) {
+        return -1;
+    }
+    Image *img = decode(fp);
+    fclose(fp);
+    free_image(img);
+    return img ? 0 : -1;
+}
+
+static int kernel_read_png(Fixture *f) {
+    return decode_memory(f->png, f->png_size, read_png_from_fp);
+}
+
+static int kernel_read_jpeg(Fixture *f) {
+    return decode_memory(f->jpeg, f->jpeg_size, read_jpeg_from_fp);
+}
+
+static int kernel_crop(Fixture *f) {
+    Image *view = crop_to_aspect_ratio(f->img, TARGET_WIDTH, TARGET_HEIGHT);
+    free_image(view);
+    return 0;
+}
+
+static int kernel_resize(Fixture *f) {
+    Image *img = resize_image(f->img, TARGET_WIDTH, TARGET_HEIGHT);
+    free_image(img);
+    return img ? 0 : -1;
+}
+
+static int kernel_resample_area(Fixture *f) {
+    Image *img = resample_image(f->img, TARGET_WIDTH, TARGET_HEIGHT, RESAMPLE_AREA);
+    free_image(img);
+    return img ? 0 : -1;
+}
+
+static int kernel_median_cut(Fixture *f) {
+    Color palette[NUM_COLORS];
+    generate_optimized_palette(f->img, palette, NUM_COLORS);
+    return 0;
+}
+
+// Median cut over a stratified sample, as --palette-samples 32768 does
+static int kernel_sampled_palette(Fixture *f) {
+    Color palette[NUM_COLORS];
+    Image *sample = sample_pixels(f->img, 32768);
+    if (!sample) {
+        return -1;
+    }
+    generate_optimized_palette(sample, palette, NUM_COLORS);
+    free_image(sample);
+    return 0;
+}
+
+static int kernel_histogram_palette(Fixture *f) {
+    Color palette[NUM_COLORS];
+    generate_palette(f->img, palette, NUM_COLORS, PALETTE_HISTOGRAM);
+    return 0;
+}
+
+static int kernel_quantize(Fixture *f) {
+    IndexedImage *indexed = quantize_colors(f->img, NUM_COLORS, PALETTE_VGA);
+    free_indexed_image(indexed);
+    return indexed ? 0 : -1;
+}
+
+// Map every row to the VGA palette with a dither mode, one thread
+static int map_rows(Fixture *f, DitherMode mode) {
+    Ditherer dither;
+    if (ditherer_init(&dither, f->map, mode, f->img->width) != 0) {
+        return -1;
+    }
+    for (int y = 0; y < f->img->height; y++) {
+        dither_row(&dither, image_row(f->img, y), y, f->mapped->indices + (size_t)y * f->mapped->stride);
+    }
+    ditherer_free(&dither);
+    return 0;
+}
+
+static int kernel_map(Fixture *f) {
+    return map_rows(f, DITHER_NONE);
+}
+
+static int kernel_map_ordered(Fixture *f) {
+    return map_rows(f, DITHER_ORDERED);
+}
+
+static int kernel_map_fs(Fixture *f) {
+    return map_rows(f, DITHER_FS);
+}
+
+// Floyd-Steinberg as a wavefront on every CPU
+static int kernel_map_fs_wavefront(Fixture *f) {
+    return dither_fs_image(f->map, f->img, f->mapped, f->pool, pool_default_threads());
+}
+
+static int kernel_write_bmp(Fixture *f) {
+    write_bmp(f->indexed, f->null_out);
+    return fflush(f->null_out) == 0 ? 0 : -1;
+}
+
+typedef struct {
+    const char *name;
+    int (*run)(Fixture *f);
+} Kernel;
+
+static const Kernel kernels[] = {
+    {"read_png_from_fp", kernel_read_png},
+    {"read_jpeg_from_fp", kernel_read_jpeg},
+    {"crop_to_aspect_ratio", kernel_crop},
+    {"resize_image", kernel_resize},
+    {"resample_image_area", kernel_resample_area},
+    {"generate_optimized_palette", kernel_median_cut},
+    {"generate_palette_sampled", kernel_sampled_palette},
+    {"generate_palette_histogram", kernel_histogram_palette},
+    {"quantize_colors", kernel_quantize},
+    {"map_palette", kernel_map},
+    {"map_dither_ordered", kernel_map_ordered},
+    {"map_dither_fs", kernel_map_fs},
+    {"map_dither_fs_wavefront", kernel_map_fs_wavefront},
+    {"write_bmp", kernel_write_bmp},
+};
+
+// Measurements of one run
+typedef struct {
+    double ms;
+    ConvertStats stats;
+    int have_counters;
+    uint64_t counters[NUM_COUNTERS];
+} Sample;
+
+// Run a kernel until min_ms have passed or max_runs are done, keeping the
+// fastest run. Returns the number of runs, -1 on failure.
+static int time_kernel(const Kernel *k, Fixture *f, double min_ms, int max_runs, Sample *best) {
+    double total = 0;
+    int runs = 0;
+    while (runs == 0 || (runs < max_runs && total < min_ms)) {
+        Sample s;
+#if STATS_ENABLED
+        stats_begin(&s.stats, NULL);
+#endif
+        perf_start();
+        double start = now_ms();
+        int result = k->run(f);
+        s.ms = now_ms() - start;
+        s.have_counters = perf_stop(s.counters) == 0;
+#if STATS_ENABLED
+        stats_end(&s.stats);
+#endif
+        if (result != 0) {
+            return -1;
+        }
+        if (runs == 0 || s.ms < best->ms) {
+            *best = s;
+        }
+        total += s.ms;
+        runs++;
+    }
+    return runs;
+}
+
+static int run_kernel_suite(const char *sizes, double min_ms, int max_runs) {
+    int failed = 0;
+    if (perf_open() != 0) {
+        fprintf(stderr, "Note: perf_event_open unavailable, hardware counters are left empty\n");
+    }
+    printf("kernel,pattern,width,height,megapixels,runs,best_ms,ns_per_pixel,mp_per_s,allocs,alloc_bytes");
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        printf(",%s", counter_names[i]);
+    }
+    printf("\n");
+
+    char *list = strdup(sizes);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        double mp = atof(tok);
+        if (mp <= 0) {
+            fprintf(stderr, "Error: Invalid size %s\n", tok);
+            failed++;
+            continue;
+        }
+        // 3:2 like most camera sensors, so cropping to 5:4 has work to do
+        int width = (int)(sqrt(mp * 1e6 * 3 / 2) + 0.5);
+        int height = width * 2 / 3;
+        for (int flat = 0; flat <= 1; flat++) {
+            Fixture f;
+            if (fixture_init(&f, width, height, flat) != 0) {
+                fprintf(stderr, "Error: Cannot create %dx%d test image\n", width, height);
+                fixture_free(&f);
+                failed++;
+                continue;
+            }
+            double pixels = (double)width * height;
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                Sample best;
+                int runs = time_kernel(&kernels[k], &f, min_ms, max_runs, &best);
+                if (runs < 0) {
+                    fprintf(stderr, "Error: %s failed on %dx%d\n", kernels[k].name, width, height);
+                    failed++;
+                    continue;
+                }
+                double ms = best.ms > 0 ? best.ms : 1e-6;
+                printf("%s,%s,%d,%d,%.2f,%d,%.3f,%.3f,%.1f", kernels[k].name, f.pattern,
+                       width, height, pixels / 1e6, runs, best.ms, ms * 1e6 / pixels,
+                       pixels / 1e3 / ms);
+#if STATS_ENABLED && STATS_COUNT_ALLOCS
+                printf(",%lu,%llu", best.stats.allocs, best.stats.alloc_bytes);
+#else
+                printf(",,");
+#endif
+                for (int i = 0; i < NUM_COUNTERS; i++) {
+                    if (best.have_counters) {
+                        printf(",%llu", (unsigned long long)best.counters[i]);
+                    } else {
+                        printf(",");
+                    }
+                }
+                printf("\n");
+                fflush(stdout);
+            }
+            fixture_free(&f);
+        }
+    }
+    free(list);
+    perf_close();
+    return failed ? 1 : 0;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m sizes] [-t ms] [-n runs]\n", prog);
+    fprintf(stderr, "       %s [-p] [-s scale] [-n runs] input...\n", prog);
+    fprintf(stderr, "Without inputs, benchmarks every pipeline stage on synthetic images (CSV).\n");
+    fprintf(stderr, "With inputs, compares stdio and memory-mapped decoding of each input.\n");
+    fprintf(stderr, "  -p           Instead time progressive JPEG early-out levels of JPEG inputs\n");
+    fprintf(stderr, "  -m <sizes>   Synthetic image sizes in megapixels (default: 1,12,50)\n");
+    fprintf(stderr, "  -t <ms>      Keep repeating a stage for this long (default: 200)\n");
+    fprintf(stderr, "  -s <scale>   Upscale each input by this factor first (default: 4)\n");
+    fprintf(stderr, "  -n <runs>    Maximum runs per stage or path, the best time is reported (default: 5)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int scale = 4;
+    int runs = 5;
+    const char *sizes = "1,12,50";
+    double min_ms = 200;
+    int progressive = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:m:t:ph")) != -1) {
+        switch (opt) {
+            case 'p':
+                progressive = 1;
+                break;
+            case 'm':
+                sizes = optarg;
+                break;
+            case 't':
+                min_ms = atof(optarg);
+                break;
+            case 's':
+                scale = atoi(optarg);
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (scale < 1 || runs < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (optind >= argc) {
+        return run_kernel_suite(sizes, min_ms, runs);
+    }
+
+    if (progressive) {
+        printf("%-24s %12s %6s %5s %10s %8s %8s %10s\n", "input", "size", "stop", "scans",
+               "decode_ms", "speedup", "psnr_db", "changed");
+    } else {
+        printf("%-24s %12s %10s %10s %10s %8s\n", "input", "size", "bytes", "stdio_ms", "mmap_ms", "speedup");
+    }
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        ImageFormat format = fp ? detect_image_format(fp) : FORMAT_UNKNOWN;
+        if (fp) {
+            fclose(fp);
+        }
+        if (progressive && format != FORMAT_JPEG) {
+            continue;
+        }
+        Image *src = format != FORMAT_UNKNOWN ? read_image_auto(argv[i], NULL, NULL) : NULL;
+        if (!src) {
+            fprintf(stderr, "Error: Cannot read %s\n", argv[i]);
+            failed++;
+            continue;
+        }
+        Image *big = resize_image(src, src->width * scale, src->height * scale);
+        free_image(src);
+        if (!big) {
+            failed++;
+            continue;
+        }
+        if (progressive) {
+            const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+            failed += run_progressive(name, big, runs) != 0;
+            free_image(big);
+            continue;
+        }
+
+        char path[] = "/tmp/benchmark-XXXXXX";
+        int fd = mkstemp(path);
+        FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (!out) {
+            fprintf(stderr, "Error: Cannot create temporary file\n");
+            free_image(big);
+            return 1;
+        }
+        int ok = (format == FORMAT_PNG ? write_png(big, out) : write_jpeg(big, out)) == 0;
+        long bytes = ftell(out);
+        fclose(out);
+
+        double stdio_ms = ok ? time_decode(read_stdio, path, runs) : -1;
+        double mmap_ms = ok ? time_decode(read_mmap, path, runs) : -1;
+        unlink(path);
+
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        if (stdio_ms < 0 || mmap_ms < 0) {
+            fprintf(stderr, "Error: Decoding failed for %s\n", name);
+            failed++;
+        } else {
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d", big->width, big->height);
+            printf("%-24s %12s %10ld %10.2f %10.2f %7.2fx\n", name, size, bytes,
+                   stdio_ms, mmap_ms, stdio_ms / mmap_ms);
+        }
+        free_image(big);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+// Entries live in <dir>/results/<key>.bmp and <dir>/palettes/<key>.pal
+#define RESULT_DIR "results"
+#define PALETTE_DIR "palettes"
+#define TEMP_PREFIX ".tmp-"
+
+// Eviction goes down to this fraction of the cap, so that a full cache does
+// not rescan the directories on every store
+#define EVICT_TARGET 0.9
+
+struct ResultCache {
+    char *dir;
+    size_t max_bytes;
+    size_t total_bytes;    // estimate, corrected by every eviction scan
+    unsigned long temp_counter;
+    pthread_mutex_t lock;
+    CacheCounters counters;
+};
+
+// XXH64, run with two seeds for a 128-bit key
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t*)data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        const uint8_t *limit = end - 32;
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl64(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME5;
+        h = rotl64(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+void cache_key(const void *data, size_t size, const void *salt, size_t salt_size, CacheKey *key) {
+    uint64_t seed = xxh64(salt, salt_size, 0);
+    key->h[0] = xxh64(data, size, seed);
+    key->h[1] = xxh64(data, size, ~seed);
+}
+
+static void entry_path(const ResultCache *cache, const char *subdir, const CacheKey *key,
+                       const char *ext, char *path, size_t size) {
+    snprintf(path, size, "%s/%s/%016llx%016llx.%s", cache->dir, subdir,
+             (unsigned long long)key->h[0], (unsigned long long)key->h[1], ext);
+}
+
+typedef struct {
+    char *path;
+    long long mtime_ns;
+    size_t size;
+} CacheEntry;
+
+static int compare_entries(const void *a, const void *b) {
+    const CacheEntry *ea = (const CacheEntry*)a;
+    const CacheEntry *eb = (const CacheEntry*)b;
+    return (ea->mtime_ns > eb->mtime_ns) - (ea->mtime_ns < eb->mtime_ns);
+}
+
+// Append the entries of one subdirectory, returns -1 on allocation failure
+static int scan_dir(const ResultCache *cache, const char *subdir,
+                    CacheEntry **entries, size_t *count, size_t *capacity) {
+    char dir_path[4096];
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", cache->dir, subdir);
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return 0;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue; // also skips temporary files being written
+        }
+        char path[sizeof(dir_path) + 256];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (*count == *capacity) {
+            size_t new_capacity = *capacity ? *capacity * 2 : 256;
+            CacheEntry *grown = (CacheEntry*)realloc(*entries, sizeof(CacheEntry) * new_capacity);
+            if (!grown) {
+                closedir(dir);
+                return -1;
+            }
+            *entries = grown;
+            *capacity = new_capacity;
+        }
+        (*entries)[*count].path = strdup(path);
+        (*entries)[*count].mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        (*entries)[*count].size = st.st_size;
+        if ((*entries)[*count].path) {
+            (*count)++;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Recount the cache and, above the cap, delete the least recently used
+// entries. Called with the lock held.
+static void evict(ResultCache *cache) {
+    CacheEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    if (scan_dir(cache, RESULT_DIR, &entries, &count, &capacity) != 0 ||
+        scan_dir(cache, PALETTE_DIR, &entries, &count, &capacity) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed for cache eviction\n");
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += entries[i].size;
+    }
+    if (total > cache->max_bytes) {
+        size_t target = (size_t)(cache->max_bytes * EVICT_TARGET);
+        qsort(entries, count, sizeof(CacheEntry), compare_entries);
+        for (size_t i = 0; i < count && total > target; i++) {
+            if (unlink(entries[i].path) == 0 || errno == ENOENT) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+    cache->total_bytes = total;
+}
+
+ResultCache* cache_open(const char *dir, size_t max_bytes) {
+    char path[4096];
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    const char *subdirs[] = {RESULT_DIR, PALETTE_DIR};
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, subdirs[i]);
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Cannot create cache directory %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+    }
+
+    ResultCache *cache = (ResultCache*)calloc(1, sizeof(ResultCache));
+    if (!cache || !(cache->dir = strdup(dir))) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    pthread_mutex_init(&cache->lock, NULL);
+    evict(cache);
+    return cache;
+}
+
+void cache_close(ResultCache *cache) {
+    if (cache) {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->dir);
+        free(cache);
+    }
+}
+
+// Read a whole entry and mark it as recently used. Returns a malloc'ed
+// buffer, or NULL when the entry does not exist.
+static uint8_t* read_entry(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = (uint8_t*)malloc(st.st_size);
+        size_t got = 0;
+        while (data && got < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + got, st.st_size - got);
+            if (n <= 0) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            got += n;
+        }
+        *size = got;
+    }
+    if (data) {
+        futimens(fd, NULL);
+    }
+    close(fd);
+    return data;
+}
+
+// Write an entry to a temporary file and rename it into place
+static int write_entry(ResultCache *cache, const char *subdir, const char *path,
+                       const void *data, size_t size) {
+    char temp[4096];
+    pthread_mutex_lock(&cache->lock);
+    unsigned long serial = cache->temp_counter++;
+    pthread_mutex_unlock(&cache->lock);
+    snprintf(temp, sizeof(temp), "%s/%s/" TEMP_PREFIX "%ld-%lu", cache->dir, subdir,
+             (long)getpid(), serial);
+
+    FILE *fp = fopen(temp, "wb");
+    if (!fp) {
+        return -1;
+    }
+    int ok = fwrite(data, 1, size, fp) == size;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->total_bytes += size;
+    if (cache->total_bytes > cache->max_bytes) {
+        evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+static void count(unsigned long *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+uint8_t* cache_get_result(ResultCache *cache, const CacheKey *key, size_t *size) {
+    char path[4096];
+    entry_path(cache, RESULT_DIR, key, "bmp", path, sizeof(path));
+    uint8_t *data = read_entry(path, size);
+    // Anything that is not a BMP is treated as a miss
+    if (data && (*size < 2 || data[0] != 'B' || data[1] != 'M')) {
+        free(data);
+        data = NULL;
+    }
+    count(data ? &cache->counters.result_hits : &cache->counters.result_misses);
+    return data;
+}
+
+int cache_put_result(ResultCache *cache, const CacheKey *key, const void *data, size_t size) {
+    char path[4096];
+    entry_path(cache, RESULT_DIR, key, "bmp", path, sizeof(path));
+    return write_entry(cache, RESULT_DIR, path, data, size);
+}
+
+int cache_get_palette(ResultCache *cache, const CacheKey *key, Color *palette, int num_colors) {
+    char path[4096];
+    size_t size = 0;
+    entry_path(cache, PALETTE_DIR, key, "pal", path, sizeof(path));
+    uint8_t *data = read_entry(path, &size);
+    int hit = data && size == (size_t)num_colors * 3;
+    if (hit) {
+        for (int i = 0; i < num_colors; i++) {
+            palette[i].r = data[i * 3 + 0];
+            palette[i].g = data[i * 3 + 1];
+            palette[i].b = data[i * 3 + 2];
+        }
+    }
+    free(data);
+    count(hit ? &cache->counters.palette_hits : &cache->counters.palette_misses);
+    return hit ? 0 : -1;
+}
+
+int cache_put_palette(ResultCache *cache, const CacheKey *key, const Color *palette, int num_colors) {
+    char path[4096];
+    uint8_t data[MAX_INDEXED_COLORS * 3];
+    if (num_colors > MAX_INDEXED_COLORS) {
+        return -1;
+    }
+    for (int i = 0; i < num_colors; i++) {
+        data[i * 3 + 0] = palette[i].r;
+        data[i * 3 + 1] = palette[i].g;
+        data[i * 3 + 2] = palette[i].b;
+    }
+    entry_path(cache, PALETTE_DIR, key, "pal", path, sizeof(path));
+    return write_entry(cache, PALETTE_DIR, path, data, (size_t)num_colors * 3);
+}
+
+void cache_get_counters(ResultCache *cache, CacheCounters *counters) {
+    counters->result_hits = __atomic_load_n(&cache->counters.result_hits, __ATOMIC_RELAXED);
+    counters->result_misses = __atomic_load_n(&cache->counters.result_misses, __ATOMIC_RELAXED);
+    counters->palette_hits = __atomic_load_n(&cache->counters.palette_hits, __ATOMIC_RELAXED);
+    counters->palette_misses = __atomic_load_n(&cache->counters.palette_misses, __ATOMIC_RELAXED);
+}
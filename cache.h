@@ -0,0 +1,53 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// Content-addressed on-disk cache with two layers: finished BMPs keyed by
+// the input bytes and conversion options, and generated palettes keyed by
+// the pixels they were generated from. Entries are written to a temporary
+// file and renamed into place, so concurrent workers and processes only
+// ever see complete entries. Recency is the file modification time, which a
+// hit refreshes; when the cache grows past its cap the least recently used
+// entries are deleted. Safe to use from several threads.
+typedef struct ResultCache ResultCache;
+
+// 128-bit content hash
+typedef struct {
+    uint64_t h[2];
+} CacheKey;
+
+// Process-wide hit and miss counts
+typedef struct {
+    unsigned long result_hits;
+    unsigned long result_misses;
+    unsigned long palette_hits;
+    unsigned long palette_misses;
+} CacheCounters;
+
+// Open (creating if needed) a cache in dir, capped at max_bytes.
+// Returns NULL on error.
+ResultCache* cache_open(const char *dir, size_t max_bytes);
+
+void cache_close(ResultCache *cache);
+
+// Hash size bytes of data together with salt_size bytes of salt (options)
+void cache_key(const void *data, size_t size, const void *salt, size_t salt_size, CacheKey *key);
+
+// Look up a stored result. Returns a malloc'ed copy and its size, or NULL
+// on a miss.
+uint8_t* cache_get_result(ResultCache *cache, const CacheKey *key, size_t *size);
+
+// Store a result, returns 0 on success
+int cache_put_result(ResultCache *cache, const CacheKey *key, const void *data, size_t size);
+
+// Look up a palette of num_colors colors, returns 0 on a hit
+int cache_get_palette(ResultCache *cache, const CacheKey *key, Color *palette, int num_colors);
+
+int cache_put_palette(ResultCache *cache, const CacheKey *key, const Color *palette, int num_colors);
+
+void cache_get_counters(ResultCache *cache, CacheCounters *counters);
+
+#endif // CACHE_H
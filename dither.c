@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "dither.h"
+#include "arena.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define HAVE_SSE2_DITHER 1
+#endif
+
+// Total range of the ordered threshold offsets, about the spacing of the
+// levels of a 16-color palette
+#define ORDERED_SPREAD 64
+
+// The 8-pixel Bayer period times 3 channels repeats every 48 bytes, three
+// SSE2 vectors
+#define ORDERED_PERIOD 16
+
+// Pixels per Floyd-Steinberg wavefront step, and rows a worker maps together
+#define FS_CHUNK 32
+#define FS_ROWS 4
+
+static const uint8_t bayer8[8][8] = {
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+// Per row phase: the positive and negative part of the offset of every byte
+// in one period, so a saturating subtract and add apply it
+static uint8_t ordered_add[8][ORDERED_PERIOD * 3] __attribute__((aligned(16)));
+static uint8_t ordered_sub[8][ORDERED_PERIOD * 3] __attribute__((aligned(16)));
+static pthread_once_t ordered_once = PTHREAD_ONCE_INIT;
+
+static void build_ordered_tables(void) {
+    for (int phase = 0; phase < 8; phase++) {
+        for (int x = 0; x < ORDERED_PERIOD; x++) {
+            int offset = (2 * bayer8[phase][x & 7] + 1) * ORDERED_SPREAD / 128 - ORDERED_SPREAD / 2;
+            for (int c = 0; c < 3; c++) {
+                ordered_add[phase][x * 3 + c] = offset > 0 ? offset : 0;
+                ordered_sub[phase][x * 3 + c] = offset < 0 ? -offset : 0;
+            }
+        }
+    }
+}
+
+// Add the threshold of row y to count pixels (count a multiple of the period
+// except at the end of the row)
+static void apply_threshold(const uint8_t *rgb, int y, uint8_t *out, int count) {
+    const uint8_t *add = ordered_add[y & 7];
+    const uint8_t *sub = ordered_sub[y & 7];
+    int bytes = count * 3;
+    int i = 0;
+#ifdef HAVE_SSE2_DITHER
+    const __m128i add0 = _mm_load_si128((const __m128i*)add);
+    const __m128i add1 = _mm_load_si128((const __m128i*)(add + 16));
+    const __m128i add2 = _mm_load_si128((const __m128i*)(add + 32));
+    const __m128i sub0 = _mm_load_si128((const __m128i*)sub);
+    const __m128i sub1 = _mm_load_si128((const __m128i*)(sub + 16));
+    const __m128i sub2 = _mm_load_si128((const __m128i*)(sub + 32));
+    for (; i + ORDERED_PERIOD * 3 <= bytes; i += ORDERED_PERIOD * 3) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(rgb + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(rgb + i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(rgb + i + 32));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_adds_epu8(_mm_subs_epu8(v0, sub0), add0));
+        _mm_storeu_si128((__m128i*)(out + i + 16), _mm_adds_epu8(_mm_subs_epu8(v1, sub1), add1));
+        _mm_storeu_si128((__m128i*)(out + i + 32), _mm_adds_epu8(_mm_subs_epu8(v2, sub2), add2));
+    }
+#endif
+    for (; i < bytes; i++) {
+        int k = i % (ORDERED_PERIOD * 3);
+        int v = rgb[i] - sub[k];
+        v = (v < 0 ? 0 : v) + add[k];
+        out[i] = v > 255 ? 255 : v;
+    }
+}
+
+void dither_ordered_pixels(const PaletteMap *map, const uint8_t *rgb, int y,
+                           uint8_t *indices, int count) {
+    enum { BLOCK = ORDERED_PERIOD * 16 };
+    uint8_t block[BLOCK * 3];
+    pthread_once(&ordered_once, build_ordered_tables);
+    // Blocks start on a period boundary so the pattern stays aligned
+    for (int x = 0; x < count; x += BLOCK) {
+        int n = count - x < BLOCK ? count - x : BLOCK;
+        apply_threshold(rgb + x * 3, y, block, n);
+        palette_map_pixels(map, block, indices + x, n);
+    }
+}
+
+// Floyd-Steinberg state of one row. in holds the error diffused into the
+// row and next receives the error for the row below, both as 3 values per
+// pixel offset by one pixel so x - 1 stays in bounds. next is assigned (not
+// added) at x + 1, so only its first two entries need clearing.
+typedef struct {
+    const uint8_t *rgb;
+    const int16_t *in;
+    int16_t *next;
+    uint8_t *indices;
+    int carry[3]; // error diffused to the right
+} FsRow;
+
+static void fs_row_start(FsRow *row, const uint8_t *rgb, const int16_t *in, int16_t *next,
+                         uint8_t *indices) {
+    row->rgb = rgb;
+    row->in = in;
+    row->next = next;
+    row->indices = indices;
+    memset(row->carry, 0, sizeof(row->carry));
+    memset(next, 0, 2 * 3 * sizeof(int16_t));
+}
+
+#ifdef HAVE_SSE2_DITHER
+// Palette in the lane layout of the nearest-color kernels, four entries per
+// vector: (r | g << 16) and b, and each entry's index in the low bits of its
+// key. Unused entries get a key no distance can beat.
+typedef struct {
+    __m128i rg[NUM_COLORS / 4];
+    __m128i b[NUM_COLORS / 4];
+    __m128i key[NUM_COLORS / 4];
+} FsPalette;
+
+static void fs_palette_init(FsPalette *fp, const PaletteMap *map) {
+    for (int j = 0; j < NUM_COLORS / 4; j++) {
+        uint32_t rg[4], b[4], key[4];
+        for (int i = 0; i < 4; i++) {
+            int c = j * 4 + i;
+            const Color *p = &map->palette[c < map->num_colors ? c : 0];
+            rg[i] = p->r | ((uint32_t)p->g << 16);
+            b[i] = p->b;
+            key[i] = c < map->num_colors ? (uint32_t)c : 0x7FFFFFF0u | c;
+        }
+        fp->rg[j] = _mm_loadu_si128((const __m128i*)rg);
+        fp->b[j] = _mm_loadu_si128((const __m128i*)b);
+        fp->key[j] = _mm_loadu_si128((const __m128i*)key);
+    }
+}
+
+static inline __m128i min_epi32(__m128i a, __m128i b) {
+    __m128i lt = _mm_cmplt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(lt, a), _mm_andnot_si128(lt, b));
+}
+
+// Exact nearest entry without branches: the minimum of distance << 4 | index
+// over all entries, so ties go to the lowest index as in nearest_color
+static inline int fs_nearest(const FsPalette *fp, int r, int g, int b) {
+    __m128i px_rg = _mm_set1_epi32(r | (g << 16));
+    __m128i px_b = _mm_set1_epi32(b);
+    __m128i best = _mm_set1_epi32(0x7FFFFFFF);
+    for (int j = 0; j < NUM_COLORS / 4; j++) {
+        __m128i d_rg = _mm_sub_epi16(px_rg, fp->rg[j]);
+        __m128i d_b = _mm_sub_epi16(px_b, fp->b[j]);
+        __m128i dist = _mm_add_epi32(_mm_madd_epi16(d_rg, d_rg), _mm_madd_epi16(d_b, d_b));
+        best = min_epi32(best, _mm_or_si128(_mm_slli_epi32(dist, 4), fp->key[j]));
+    }
+    best = min_epi32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+    best = min_epi32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(best) & 0x0F;
+}
+#else
+// Scalar fallback: the palette itself, searched with nearest_color
+typedef struct {
+    const Color *palette;
+    int num_colors;
+} FsPalette;
+
+static void fs_palette_init(FsPalette *fp, const PaletteMap *map) {
+    fp->palette = map->palette;
+    fp->num_colors = map->num_colors;
+}
+
+static inline int fs_nearest(const FsPalette *fp, int r, int g, int b) {
+    return nearest_color(fp->palette, fp->num_colors, (uint8_t)r, (uint8_t)g, (uint8_t)b);
+}
+#endif
+
+static inline void fs_pixel(const PaletteMap *map, const FsPalette *fp, FsRow *row, int x) {
+    const int16_t *e = &row->in[(x + 1) * 3];
+    int r = row->rgb[x * 3 + 0] + row->carry[0] + e[0];
+    int g = row->rgb[x * 3 + 1] + row->carry[1] + e[1];
+    int b = row->rgb[x * 3 + 2] + row->carry[2] + e[2];
+    r = r < 0 ? 0 : r > 255 ? 255 : r;
+    g = g < 0 ? 0 : g > 255 ? 255 : g;
+    b = b < 0 ? 0 : b > 255 ? 255 : b;
+    int index = fs_nearest(fp, r, g, b);
+    row->indices[x] = index;
+    const Color *p = &map->palette[index];
+    int err[3] = {r - p->r, g - p->g, b - p->b};
+    // 3/16 below left, 5/16 below, 1/16 below right, the rest (7/16) right
+    int16_t *n = &row->next[x * 3];
+    for (int c = 0; c < 3; c++) {
+        int e1 = err[c] >> 4;
+        int e3 = (err[c] * 3) >> 4;
+        int e5 = (err[c] * 5) >> 4;
+        n[c] += e3;
+        n[3 + c] += e5;
+        n[6 + c] = e1;
+        row->carry[c] = err[c] - e1 - e3 - e5;
+    }
+}
+
+int ditherer_init(Ditherer *d, const PaletteMap *map, DitherMode mode, int width) {
+    memset(d, 0, sizeof(*d));
+    d->map = map;
+    d->mode = mode;
+    d->width = width;
+    if (mode == DITHER_FS) {
+        d->errors = (int16_t*)job_calloc((size_t)(width + 2) * 3 * 2, sizeof(int16_t));
+        if (!d->errors) {
+            fprintf(stderr, "Error: Memory allocation failed for dither buffers\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void ditherer_free(Ditherer *d) {
+    job_free(d->errors);
+    d->errors = NULL;
+}
+
+void dither_row(Ditherer *d, const uint8_t *rgb, int y, uint8_t *indices) {
+    if (d->mode == DITHER_ORDERED) {
+        dither_ordered_pixels(d->map, rgb, y, indices, d->width);
+        return;
+    }
+    if (d->mode != DITHER_FS) {
+        palette_map_pixels(d->map, rgb, indices, d->width);
+        return;
+    }
+    size_t len = (size_t)(d->width + 2) * 3;
+    int16_t *in = d->errors + (y & 1) * len;
+    if (y == 0) {
+        memset(in, 0, len * sizeof(int16_t));
+    }
+    FsRow row;
+    FsPalette fp;
+    fs_palette_init(&fp, d->map);
+    fs_row_start(&row, rgb, in, d->errors + ((y + 1) & 1) * len, indices);
+    for (int x = 0; x < d->width; x++) {
+        fs_pixel(d->map, &fp, &row, x);
+    }
+}
+
+// Shared state of a wavefront. Workers take groups of FS_ROWS rows and map
+// them together, each row two pixels behind the one above, which is as close
+// as the error diffusion allows: pixel x of a row needs pixels up to x + 1
+// of the row above. This keeps several independent error chains in flight
+// on one core. A group's first row waits on progress[] of the row above,
+// the number of its pixels that are done. Error rows are a ring: a row only
+// overwrites entries that the rows ahead of it have already read.
+typedef struct {
+    const PaletteMap *map;
+    const Image *img;
+    IndexedImage *out;
+    int16_t *errors;
+    int ring;
+    int *progress;
+    int next_row;
+    int failed;
+} FsWavefront;
+
+static void wait_for_row(const int *progress, int need) {
+    while (__atomic_load_n(progress, __ATOMIC_ACQUIRE) < need) {
+        sched_yield();
+    }
+}
+
+// Map rows [y0, y0 + count) of the wavefront into indices (count rows of
+// width bytes)
+static void fs_group(FsWavefront *wf, int y0, int count, uint8_t *indices) {
+    int width = wf->img->width;
+    size_t len = (size_t)(width + 2) * 3;
+    FsRow rows[FS_ROWS];
+    FsPalette fp;
+    fs_palette_init(&fp, wf->map);
+    for (int k = 0; k < count; k++) {
+        int y = y0 + k;
+        fs_row_start(&rows[k], image_row(wf->img, y),
+                     wf->errors + (size_t)(y % wf->ring) * len,
+                     wf->errors + (size_t)((y + 1) % wf->ring) * len,
+                     indices + (size_t)k * width);
+    }
+    int skew = 2 * (count - 1);
+    for (int t0 = 0; t0 < width + skew; t0 += FS_CHUNK) {
+        int t1 = t0 + FS_CHUNK < width + skew ? t0 + FS_CHUNK : width + skew;
+        if (y0 > 0) {
+            wait_for_row(&wf->progress[y0 - 1], t1 + 1 < width ? t1 + 1 : width);
+        }
+        for (int t = t0; t < t1; t++) {
+            for (int k = 0; k < count; k++) {
+                int x = t - 2 * k;
+                if (x >= 0 && x < width) {
+                    fs_pixel(wf->map, &fp, &rows[k], x);
+                }
+            }
+        }
+        int done = t1 - skew;
+        done = done < 0 ? 0 : done > width ? width : done;
+        __atomic_store_n(&wf->progress[y0 + count - 1], done, __ATOMIC_RELEASE);
+    }
+}
+
+// Take groups in order until none are left. A group is only taken after
+// every row above it was taken by a running worker, so the waits always
+// finish.
+static void fs_worker(void *arg) {
+    FsWavefront *wf = (FsWavefront*)arg;
+    int width = wf->img->width;
+    int height = wf->img->height;
+    IndexedImage *out = wf->out;
+    uint8_t *indices = (uint8_t*)job_malloc((size_t)width * FS_ROWS);
+    if (!indices) {
+        __atomic_store_n(&wf->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (;;) {
+        int y0 = __atomic_fetch_add(&wf->next_row, FS_ROWS, __ATOMIC_RELAXED);
+        if (y0 >= height) {
+            break;
+        }
+        int count = height - y0 < FS_ROWS ? height - y0 : FS_ROWS;
+        fs_group(wf, y0, count, indices);
+        for (int k = 0; k < count; k++) {
+            uint8_t *dst = out->indices + (size_t)(y0 + k) * out->stride;
+            if (out->bits == 4) {
+                pack_row_4bpp(indices + (size_t)k * width, width, dst, out->stride);
+            } else {
+                memcpy(dst, indices + (size_t)k * width, width);
+            }
+        }
+    }
+    job_free(indices);
+}
+
+int dither_fs_image(const PaletteMap *map, const Image *img, IndexedImage *out,
+                    ThreadPool *pool, int num_workers) {
+    if (num_workers < 1 || !pool) {
+        num_workers = 1;
+    }
+    int groups = (img->height + FS_ROWS - 1) / FS_ROWS;
+    if (num_workers > groups) {
+        num_workers = groups > 0 ? groups : 1;
+    }
+    FsWavefront wf;
+    memset(&wf, 0, sizeof(wf));
+    wf.map = map;
+    wf.img = img;
+    wf.out = out;
+    wf.ring = num_workers * FS_ROWS + 2;
+    wf.errors = (int16_t*)job_calloc((size_t)(img->width + 2) * 3 * wf.ring, sizeof(int16_t));
+    wf.progress = (int*)job_calloc(img->height > 0 ? img->height : 1, sizeof(int));
+    if (!wf.errors || !wf.progress) {
+        fprintf(stderr, "Error: Memory allocation failed for dither buffers\n");
+        job_free(wf.errors);
+        job_free(wf.progress);
+        return -1;
+    }
+
+    int submitted = 0;
+    for (int i = 1; i < num_workers; i++) {
+        if (pool_submit(pool, fs_worker, &wf) == 0) {
+            submitted++;
+        }
+    }
+    fs_worker(&wf);
+    if (submitted > 0) {
+        pool_wait(pool);
+    }
+    job_free(wf.errors);
+    job_free(wf.progress);
+    return wf.failed ? -1 : 0;
+}
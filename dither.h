@@ -0,0 +1,46 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdint.h>
+#include "palette_map.h"
+#include "threadpool.h"
+
+// Dithering applied when mapping pixels to the palette
+typedef enum {
+    DITHER_NONE,
+    DITHER_ORDERED, // 8x8 Bayer threshold, every pixel independent
+    DITHER_FS       // Floyd-Steinberg error diffusion
+} DitherMode;
+
+// Maps rows to palette indices with a dither mode. Floyd-Steinberg carries
+// the error from one row into the next, so rows must be mapped in order from
+// the top; ordered dithering only needs the row number.
+typedef struct {
+    const PaletteMap *map;
+    DitherMode mode;
+    int width;
+    int16_t *errors; // Floyd-Steinberg: error into this row and the next
+} Ditherer;
+
+// Returns 0 on success
+int ditherer_init(Ditherer *d, const PaletteMap *map, DitherMode mode, int width);
+
+void ditherer_free(Ditherer *d);
+
+// Map row y of rgb (d->width pixels) to palette indices
+void dither_row(Ditherer *d, const uint8_t *rgb, int y, uint8_t *indices);
+
+// Map count pixels of row y with the ordered threshold
+void dither_ordered_pixels(const PaletteMap *map, const uint8_t *rgb, int y,
+                           uint8_t *indices, int count);
+
+// Floyd-Steinberg over a whole image into out (same size, 4 or 8 bits). Rows
+// run as a skewed wavefront: num_workers workers take rows in order, and each
+// row only trails the row above by a few pixels, which is all the error
+// diffusion needs. Workers beyond the calling thread run on pool (may be NULL
+// for one worker). The result does not depend on num_workers. Returns 0 on
+// success.
+int dither_fs_image(const PaletteMap *map, const Image *img, IndexedImage *out,
+                    ThreadPool *pool, int num_workers);
+
+#endif // DITHER_H
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "image.h"
+#include "arena.h"
+
+Image* create_image(int width, int height) {
+    if (width < 0 || height < 0 || width > INT_MAX / 3) {
+        return NULL;
+    }
+    Image *img = (Image*)job_malloc(sizeof(Image));
+    if (!img) {
+        return NULL;
+    }
+    img->width = width;
+    img->height = height;
+    img->stride = width * 3;
+    img->buffer = (uint8_t*)job_malloc((size_t)img->stride * height);
+    if (!img->buffer) {
+        job_free(img);
+        return NULL;
+    }
+    img->data = img->buffer;
+    return img;
+}
+
+Image* image_view(Image *src, int x, int y, int width, int height) {
+    Image *view = (Image*)job_malloc(sizeof(Image));
+    if (!view) {
+        return NULL;
+    }
+    view->width = width;
+    view->height = height;
+    view->stride = src->stride;
+    view->data = image_row(src, y) + (size_t)x * 3;
+    view->buffer = NULL;
+    return view;
+}
+
+void free_image(Image *img) {
+    if (img) {
+        job_free(img->buffer);
+        job_free(img);
+    }
+}
+
+int crop_window(int width, int height, int target_width, int target_height,
+                int *crop_x, int *crop_y, int *crop_width, int *crop_height) {
+    float src_aspect = (float)width / height;
+    float target_aspect = (float)target_width / target_height;
+    
+    *crop_width = width;
+    *crop_height = height;
+    *crop_x = 0;
+    *crop_y = 0;
+    
+    if (src_aspect > target_aspect) {
+        // Source is too wide, crop left and right
+        *crop_width = (int)(height * target_aspect + 0.5);
+        *crop_x = (width - *crop_width) / 2;
+    } else if (src_aspect < target_aspect) {
+        // Source is too tall, crop top and bottom
+        *crop_height = (int)(width / target_aspect + 0.5);
+        *crop_y = (height - *crop_height) / 2;
+    } else {
+        // Aspect ratios match, no cropping needed
+        return 0;
+    }
+    return 1;
+}
+
+int check_mem_limit(const DecodeHints *hints, size_t bytes) {
+    if (!hints || !hints->mem_limit || bytes <= hints->mem_limit) {
+        return 0;
+    }
+    fprintf(stderr, "Error: Decoding needs %zu MB, more than the memory limit of %zu MB\n",
+            (bytes + (1 << 20) - 1) >> 20, hints->mem_limit >> 20);
+    return -1;
+}
@@ -1,15 +1,45 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <stdio.h>
 #include <stdint.h>
 
-// Image structure
+// Image structure. An image either owns its pixels (buffer != NULL) or is a
+// view into another image's pixels, such as a crop window; a view must not
+// outlive the image it was taken from.
 typedef struct {
     int width;
     int height;
-    uint8_t *data; // RGB data
+    int stride;       // bytes between the starts of two rows, >= width * 3
+    uint8_t *data;    // RGB data of the first pixel
+    uint8_t *buffer;  // allocation freed by free_image, NULL for a view
 } Image;
 
+// Start of row y
+static inline uint8_t* image_row(const Image *img, int y) {
+    return img->data + (size_t)y * img->stride;
+}
+
+// Color structure for quantization
+typedef struct {
+    uint8_t r, g, b;
+} Color;
+
+#define MAX_INDEXED_COLORS 16
+
+// Palette-indexed image, rows stored top to bottom. With bits == 8 each pixel
+// is one byte; with bits == 4 two pixels share a byte, high nibble first, and
+// rows are padded to 4 bytes so they match the BMP row layout.
+typedef struct {
+    int width;
+    int height;
+    int stride;       // bytes per row
+    int bits;         // 8 or 4
+    uint8_t *indices;
+    Color palette[MAX_INDEXED_COLORS];
+    int num_colors;
+} IndexedImage;
+
 // Image format types
 typedef enum {
     FORMAT_UNKNOWN,
@@ -17,4 +47,88 @@ typedef enum {
     FORMAT_JPEG
 } ImageFormat;
 
+// Compressed input for the readers: bytes that were already consumed (such
+// as a sniffed header) followed by the rest of a stream. fp == NULL means
+// prefix holds the whole input. prefix must stay valid while decoding.
+typedef struct {
+    const uint8_t *prefix;
+    size_t prefix_size;
+    FILE *fp;
+} InputSource;
+
+// Hints passed to the readers. With scale != 0 a reader may return a smaller
+// image than the source as long as it still covers target_width x
+// target_height, either fully (crop == 0) or after cropping to the target
+// aspect ratio (crop != 0). With crop != 0 a reader may also return only the
+// crop window, see DecodeInfo.cropped. A zero target size requests a full
+// resolution decode. With mem_limit != 0 decoding fails instead of holding
+// more than mem_limit bytes for the whole image. With progressive_coefs != 0
+// a progressive JPEG is decoded only until the first progressive_coefs
+// coefficients (zigzag order, 1 = DC) of every component are known to within
+// progressive_bits low bits; the rest of the input is not read.
+typedef struct {
+    int target_width;
+    int target_height;
+    int crop;
+    int scale;
+    size_t mem_limit;
+    int progressive_coefs;
+    int progressive_bits;
+} DecodeHints;
+
+// Filled in by the readers to describe what was actually decoded
+typedef struct {
+    int source_width;
+    int source_height;
+    int scale_num;   // decoded size = source size * scale_num / scale_denom
+    int scale_denom;
+    int cropped;     // the image is already cropped to the target aspect ratio
+    int scans;       // scans decoded when a progressive decode stopped early, else 0
+} DecodeInfo;
+
+// Header facts a conversion's memory is planned from, filled in by the
+// readers' probe functions
+typedef struct {
+    int source_width;
+    int source_height;
+    int width;             // decoded size with the scale the hints allow
+    int height;
+    int whole_image;       // every row is decoded before the first is returned
+                           // (interlaced PNG)
+    size_t decoder_bytes;  // image-sized buffers of the decoder itself
+                           // (coefficients of progressive JPEG), else 0
+} ImageProbe;
+
+// Row-by-row decoder, used by the streaming pipeline. Each reader embeds this
+// as the first member of its own state.
+typedef struct RowReader {
+    int width;
+    int height;
+    // Decode the next row as RGB into rgb (width * 3 bytes), returns 0 on success
+    int (*read_row)(struct RowReader *reader, uint8_t *rgb);
+    // Decode and discard the next count rows, returns 0 on success
+    int (*skip_rows)(struct RowReader *reader, int count);
+    // Release the decoder (the underlying FILE is not closed)
+    void (*close)(struct RowReader *reader);
+} RowReader;
+
+// Allocate an image with contiguous rows (stride == width * 3). Returns NULL
+// on allocation failure or a size whose rows do not fit an int.
+Image* create_image(int width, int height);
+
+// A view of the width x height window at (x, y) of src, sharing its pixels
+Image* image_view(Image *src, int x, int y, int width, int height);
+
+// Free an image or a view (a view leaves the pixels alone)
+void free_image(Image *img);
+
+// Compute the window that crops a width x height image to the target aspect
+// ratio (crop on long side only). Returns 0 if the aspect ratios already match.
+int crop_window(int width, int height, int target_width, int target_height,
+                int *crop_x, int *crop_y, int *crop_width, int *crop_height);
+
+// Check that a decode holding bytes for the whole image stays within
+// hints->mem_limit. Returns 0 if it does, else prints an error and returns -1.
+int check_mem_limit(const DecodeHints *hints, size_t bytes);
+
 #endif // IMAGE_H
@@ -1,596 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
 #include <string.h>
-#include <limits.h>
 #include <unistd.h>
 #include <getopt.h>
-#include "image.h"
-#include "png_reader.h"
-#include "jpeg_reader.h"
+#include "transform.h"
+#include "resample.h"
+#include "dither.h"
+#include "batch.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "server.h"
+#include "cache.h"
+#include "arena.h"
 
-#define TARGET_WIDTH 720
-#define TARGET_HEIGHT 576
-#define NUM_COLORS 16
-
-// BMP file structures
-#pragma pack(push, 1)
-typedef struct {
-    uint16_t bfType;
-    uint32_t bfSize;
-    uint16_t bfReserved1;
-    uint16_t bfReserved2;
-    uint32_t bfOffBits;
-} BMPFileHeader;
-
-typedef struct {
-    uint32_t biSize;
-    int32_t biWidth;
-    int32_t biHeight;
-    uint16_t biPlanes;
-    uint16_t biBitCount;
-    uint32_t biCompression;
-    uint32_t biSizeImage;
-    int32_t biXPelsPerMeter;
-    int32_t biYPelsPerMeter;
-    uint32_t biClrUsed;
-    uint32_t biClrImportant;
-} BMPInfoHeader;
-
-typedef struct {
-    uint8_t rgbBlue;
-    uint8_t rgbGreen;
-    uint8_t rgbRed;
-    uint8_t rgbReserved;
-} RGBQuad;
-#pragma pack(pop)
-
-// Color structure for quantization
-typedef struct {
-    uint8_t r, g, b;
-} Color;
-
-// Detect image format from magic bytes
-ImageFormat detect_image_format(FILE *fp) {
-    unsigned char header[8];
-    
-    // Read the first 8 bytes for format detection
-    size_t bytes_read = fread(header, 1, 8, fp);
-    if (bytes_read < 3 || ferror(fp)) {
-        // Need at least 3 bytes for JPEG signature, 8 for PNG
-        // If there's a read error, don't seek back
-        return FORMAT_UNKNOWN;
-    }
-    
-    // Seek back to the beginning
-    fseek(fp, 0, SEEK_SET);
-    
-    // Check for PNG signature: 0x89 0x50 0x4E 0x47 0x0D 0x0A 0x1A 0x0A
-    if (bytes_read >= 8 &&
-        header[0] == 0x89 && header[1] == 0x50 && header[2] == 0x4E && header[3] == 0x47 &&
-        header[4] == 0x0D && header[5] == 0x0A && header[6] == 0x1A && header[7] == 0x0A) {
-        return FORMAT_PNG;
-    }
-    
-    // Check for JPEG signature: 0xFF 0xD8 0xFF
-    if (header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
-        return FORMAT_JPEG;
-    }
-    
-    return FORMAT_UNKNOWN;
-}
-
-// Read image with automatic format detection
-Image* read_image_auto(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open file %s\n", filename);
-        return NULL;
-    }
-    
-    ImageFormat format = detect_image_format(fp);
-    Image *img = NULL;
-    
-    switch (format) {
-        case FORMAT_PNG:
-            img = read_png_from_fp(fp);
-            break;
-        case FORMAT_JPEG:
-            img = read_jpeg_from_fp(fp);
-            break;
-        default:
-            fprintf(stderr, "Error: Unknown or unsupported image format\n");
-            break;
-    }
-    
-    fclose(fp);
-    return img;
-}
-
-// Read image from stdin with automatic format detection
-Image* read_image_from_stdin(void) {
-    // Read the header first to detect the format
-    unsigned char header[8];
-    if (fread(header, 1, 8, stdin) != 8) {
-        fprintf(stderr, "Error: Failed to read image header from stdin\n");
-        return NULL;
-    }
-    
-    ImageFormat format = FORMAT_UNKNOWN;
-    
-    // Check for PNG signature
-    if (header[0] == 0x89 && header[1] == 0x50 && header[2] == 0x4E && header[3] == 0x47 &&
-        header[4] == 0x0D && header[5] == 0x0A && header[6] == 0x1A && header[7] == 0x0A) {
-        format = FORMAT_PNG;
-    }
-    // Check for JPEG signature
-    else if (header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
-        format = FORMAT_JPEG;
-    }
-    
-    if (format == FORMAT_UNKNOWN) {
-        fprintf(stderr, "Error: Unknown or unsupported image format from stdin\n");
-        return NULL;
-    }
-    
-    // We can't seek stdin, so we need to read the whole input into memory
-    // Start with the header we already read
-    size_t capacity = 10 * 1024 * 1024; // 10MB initial capacity
-    size_t size = 8;
-    unsigned char *buffer = (unsigned char*)malloc(capacity);
-    if (!buffer) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        return NULL;
-    }
-    memcpy(buffer, header, 8);
-    
-    // Read the rest from stdin with a read chunk size
-    #define READ_CHUNK_SIZE 65536
-    size_t bytes_read;
-    while (1) {
-        // Ensure we have space for at least one chunk
-        if (capacity - size < READ_CHUNK_SIZE) {
-            size_t new_capacity = capacity + (capacity / 2); // Grow by 50%
-            unsigned char *new_buffer = (unsigned char*)realloc(buffer, new_capacity);
-            if (!new_buffer) {
-                free(buffer);
-                fprintf(stderr, "Error: Memory reallocation failed\n");
-                return NULL;
-            }
-            buffer = new_buffer;
-            capacity = new_capacity;
-        }
-        
-        bytes_read = fread(buffer + size, 1, READ_CHUNK_SIZE, stdin);
-        if (bytes_read == 0) {
-            break; // EOF or error
-        }
-        size += bytes_read;
-    }
-    
-    // Create a temporary file to hold the data (needed for libjpeg/libpng)
-    FILE *tmp = tmpfile();
-    if (!tmp) {
-        free(buffer);
-        fprintf(stderr, "Error: Cannot create temporary file\n");
-        return NULL;
-    }
-    
-    fwrite(buffer, 1, size, tmp);
-    free(buffer);
-    fseek(tmp, 0, SEEK_SET);
-    
-    Image *img = NULL;
-    switch (format) {
-        case FORMAT_PNG:
-            img = read_png_from_fp(tmp);
-            break;
-        case FORMAT_JPEG:
-            img = read_jpeg_from_fp(tmp);
-            break;
-        default:
-            break;
-    }
-    
-    fclose(tmp);
-    return img;
-}
-
-// Resize image using simple nearest neighbor interpolation
-Image* resize_image(Image *src, int new_width, int new_height) {
-    Image *dst = (Image*)malloc(sizeof(Image));
-    if (!dst) {
-        return NULL;
-    }
-    
-    dst->width = new_width;
-    dst->height = new_height;
-    dst->data = (uint8_t*)malloc(new_width * new_height * 3);
-    if (!dst->data) {
-        free(dst);
-        return NULL;
-    }
-
-    float x_ratio = (float)src->width / new_width;
-    float y_ratio = (float)src->height / new_height;
-
-    for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-            int src_x = (int)(x * x_ratio);
-            int src_y = (int)(y * y_ratio);
-            
-            int src_idx = (src_y * src->width + src_x) * 3;
-            int dst_idx = (y * new_width + x) * 3;
-            
-            dst->data[dst_idx + 0] = src->data[src_idx + 0];
-            dst->data[dst_idx + 1] = src->data[src_idx + 1];
-            dst->data[dst_idx + 2] = src->data[src_idx + 2];
-        }
-    }
-
-    return dst;
-}
-
-// Crop image to match target aspect ratio (crop on long side only)
-Image* crop_to_aspect_ratio(Image *src, int target_width, int target_height) {
-    float src_aspect = (float)src->width / src->height;
-    float target_aspect = (float)target_width / target_height;
-    
-    int new_width = src->width;
-    int new_height = src->height;
-    int crop_x = 0;
-    int crop_y = 0;
-    
-    if (src_aspect > target_aspect) {
-        // Source is too wide, crop left and right
-        new_width = (int)(src->height * target_aspect + 0.5);
-        crop_x = (src->width - new_width) / 2;
-    } else if (src_aspect < target_aspect) {
-        // Source is too tall, crop top and bottom
-        new_height = (int)(src->width / target_aspect + 0.5);
-        crop_y = (src->height - new_height) / 2;
-    } else {
-        // Aspect ratios match, no cropping needed
-        return NULL;
-    }
-    
-    Image *dst = (Image*)malloc(sizeof(Image));
-    if (!dst) {
-        return NULL;
-    }
-    
-    dst->width = new_width;
-    dst->height = new_height;
-    dst->data = (uint8_t*)malloc(new_width * new_height * 3);
-    if (!dst->data) {
-        free(dst);
-        return NULL;
-    }
-    
-    for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-            int src_idx = ((y + crop_y) * src->width + (x + crop_x)) * 3;
-            int dst_idx = (y * new_width + x) * 3;
-            
-            dst->data[dst_idx + 0] = src->data[src_idx + 0];
-            dst->data[dst_idx + 1] = src->data[src_idx + 1];
-            dst->data[dst_idx + 2] = src->data[src_idx + 2];
-        }
-    }
-    
-    return dst;
-}
-
-// Structure for median-cut color box
-typedef struct {
-    int r_min, r_max;
-    int g_min, g_max;
-    int b_min, b_max;
-    Color *colors;
-    int count;
-} ColorBox;
-
-// Find the range of each color channel in a box
-void find_box_range(ColorBox *box) {
-    box->r_min = box->g_min = box->b_min = 255;
-    box->r_max = box->g_max = box->b_max = 0;
-    
-    for (int i = 0; i < box->count; i++) {
-        if (box->colors[i].r < box->r_min) box->r_min = box->colors[i].r;
-        if (box->colors[i].r > box->r_max) box->r_max = box->colors[i].r;
-        if (box->colors[i].g < box->g_min) box->g_min = box->colors[i].g;
-        if (box->colors[i].g > box->g_max) box->g_max = box->colors[i].g;
-        if (box->colors[i].b < box->b_min) box->b_min = box->colors[i].b;
-        if (box->colors[i].b > box->b_max) box->b_max = box->colors[i].b;
-    }
-}
-
-// Comparison functions for qsort
-static int compare_r(const void *a, const void *b) {
-    return ((Color*)a)->r - ((Color*)b)->r;
-}
-
-static int compare_g(const void *a, const void *b) {
-    return ((Color*)a)->g - ((Color*)b)->g;
-}
-
-static int compare_b(const void *a, const void *b) {
-    return ((Color*)a)->b - ((Color*)b)->b;
-}
-
-// Calculate average color of a box
-Color box_average(ColorBox *box) {
-    long r_sum = 0, g_sum = 0, b_sum = 0;
-    for (int i = 0; i < box->count; i++) {
-        r_sum += box->colors[i].r;
-        g_sum += box->colors[i].g;
-        b_sum += box->colors[i].b;
-    }
-    Color avg;
-    avg.r = (uint8_t)(r_sum / box->count);
-    avg.g = (uint8_t)(g_sum / box->count);
-    avg.b = (uint8_t)(b_sum / box->count);
-    return avg;
-}
-
-// Generate optimized palette using median-cut algorithm
-void generate_optimized_palette(Image *img, Color *palette, int num_colors) {
-    int pixel_count = img->width * img->height;
-    
-    // Initialize palette to black as fallback in case of early return
-    for (int i = 0; i < num_colors; i++) {
-        palette[i].r = palette[i].g = palette[i].b = 0;
-    }
-    
-    // Create array of all colors in image
-    Color *all_colors = (Color*)malloc(sizeof(Color) * pixel_count);
-    if (!all_colors) {
-        fprintf(stderr, "Error: Memory allocation failed for color array\n");
-        return;
-    }
-    
-    for (int i = 0; i < pixel_count; i++) {
-        int idx = i * 3;
-        all_colors[i].r = img->data[idx + 0];
-        all_colors[i].g = img->data[idx + 1];
-        all_colors[i].b = img->data[idx + 2];
-    }
-    
-    // Create initial box containing all colors
-    ColorBox *boxes = (ColorBox*)malloc(sizeof(ColorBox) * num_colors);
-    if (!boxes) {
-        fprintf(stderr, "Error: Memory allocation failed for color boxes\n");
-        free(all_colors);
-        return;
-    }
-    
-    boxes[0].colors = all_colors;
-    boxes[0].count = pixel_count;
-    find_box_range(&boxes[0]);
-    int num_boxes = 1;
-    
-    // Split boxes until we have enough
-    while (num_boxes < num_colors) {
-        // Find box with largest range to split
-        int best_box = -1;
-        int best_range = 0;
-        
-        for (int i = 0; i < num_boxes; i++) {
-            if (boxes[i].count < 2) continue; // Can't split a box with fewer than 2 colors
-            
-            int r_range = boxes[i].r_max - boxes[i].r_min;
-            int g_range = boxes[i].g_max - boxes[i].g_min;
-            int b_range = boxes[i].b_max - boxes[i].b_min;
-            int max_range = r_range > g_range ? r_range : g_range;
-            max_range = max_range > b_range ? max_range : b_range;
-            
-            if (max_range > best_range) {
-                best_range = max_range;
-                best_box = i;
-            }
-        }
-        
-        if (best_box == -1) break; // No more boxes can be split
-        
-        // Determine which channel to split on
-        int r_range = boxes[best_box].r_max - boxes[best_box].r_min;
-        int g_range = boxes[best_box].g_max - boxes[best_box].g_min;
-        int b_range = boxes[best_box].b_max - boxes[best_box].b_min;
-        
-        if (r_range >= g_range && r_range >= b_range) {
-            qsort(boxes[best_box].colors, boxes[best_box].count, sizeof(Color), compare_r);
-        } else if (g_range >= r_range && g_range >= b_range) {
-            qsort(boxes[best_box].colors, boxes[best_box].count, sizeof(Color), compare_g);
-        } else {
-            qsort(boxes[best_box].colors, boxes[best_box].count, sizeof(Color), compare_b);
-        }
-        
-        // Split at median
-        int median = boxes[best_box].count / 2;
-        
-        // Create new box from second half
-        boxes[num_boxes].colors = boxes[best_box].colors + median;
-        boxes[num_boxes].count = boxes[best_box].count - median;
-        find_box_range(&boxes[num_boxes]);
-        
-        // Shrink original box to first half
-        boxes[best_box].count = median;
-        find_box_range(&boxes[best_box]);
-        
-        num_boxes++;
-    }
-    
-    // Calculate average color for each box
-    for (int i = 0; i < num_boxes; i++) {
-        palette[i] = box_average(&boxes[i]);
-    }
-    
-    // If we have fewer boxes than colors needed, fill remaining with black
-    for (int i = num_boxes; i < num_colors; i++) {
-        palette[i].r = palette[i].g = palette[i].b = 0;
-    }
-    
-    free(boxes);
-    free(all_colors);
-}
-
-// Color quantization to 16-color VGA palette or optimized palette
-void quantize_colors(Image *img, Color *palette, int num_colors, int optimize_palette) {
-    if (optimize_palette) {
-        // Generate optimized palette from image colors
-        generate_optimized_palette(img, palette, num_colors);
-    } else {
-        // Use a standard 16-color palette (similar to VGA palette)
-        Color vga_palette[16] = {
-            {0, 0, 0},       // Black
-            {0, 0, 170},     // Blue
-            {0, 170, 0},     // Green
-            {0, 170, 170},   // Cyan
-            {170, 0, 0},     // Red
-            {170, 0, 170},   // Magenta
-            {170, 85, 0},    // Brown
-            {170, 170, 170}, // Light Gray
-            {85, 85, 85},    // Dark Gray
-            {85, 85, 255},   // Light Blue
-            {85, 255, 85},   // Light Green
-            {85, 255, 255},  // Light Cyan
-            {255, 85, 85},   // Light Red
-            {255, 85, 255},  // Light Magenta
-            {255, 255, 85},  // Yellow
-            {255, 255, 255}  // White
-        };
-        
-        memcpy(palette, vga_palette, sizeof(Color) * 16);
-    }
-    
-    // Map each pixel to nearest color in palette
-    for (int i = 0; i < img->width * img->height; i++) {
-        int idx = i * 3;
-        uint8_t r = img->data[idx + 0];
-        uint8_t g = img->data[idx + 1];
-        uint8_t b = img->data[idx + 2];
-        
-        int min_dist = INT_MAX;
-        int best_color = 0;
-        
-        for (int c = 0; c < num_colors; c++) {
-            int dr = (int)r - palette[c].r;
-            int dg = (int)g - palette[c].g;
-            int db = (int)b - palette[c].b;
-            int dist = dr*dr + dg*dg + db*db;
-            
-            if (dist < min_dist) {
-                min_dist = dist;
-                best_color = c;
-            }
-        }
-        
-        img->data[idx + 0] = palette[best_color].r;
-        img->data[idx + 1] = palette[best_color].g;
-        img->data[idx + 2] = palette[best_color].b;
-    }
-}
-
-// Write BMP to file pointer
-void write_bmp(Image *img, Color *palette, int num_colors, FILE *out) {
-    // BMP rows must be padded to 4-byte boundary
-    int row_size = ((img->width * 4 + 31) / 32) * 4; // 4 bits per pixel
-    int pixel_data_size = row_size * img->height;
-    
-    BMPFileHeader file_header;
-    file_header.bfType = 0x4D42; // "BM"
-    file_header.bfSize = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 
-                         sizeof(RGBQuad) * num_colors + pixel_data_size;
-    file_header.bfReserved1 = 0;
-    file_header.bfReserved2 = 0;
-    file_header.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 
-                            sizeof(RGBQuad) * num_colors;
-    
-    BMPInfoHeader info_header;
-    info_header.biSize = sizeof(BMPInfoHeader);
-    info_header.biWidth = img->width;
-    info_header.biHeight = img->height;
-    info_header.biPlanes = 1;
-    info_header.biBitCount = 4; // 4 bits per pixel for 16 colors
-    info_header.biCompression = 0; // BI_RGB
-    info_header.biSizeImage = pixel_data_size;
-    info_header.biXPelsPerMeter = 0;
-    info_header.biYPelsPerMeter = 0;
-    info_header.biClrUsed = num_colors;
-    info_header.biClrImportant = num_colors;
-    
-    // Write headers
-    fwrite(&file_header, sizeof(BMPFileHeader), 1, out);
-    fwrite(&info_header, sizeof(BMPInfoHeader), 1, out);
-    
-    // Write palette
-    for (int i = 0; i < num_colors; i++) {
-        RGBQuad quad;
-        quad.rgbBlue = palette[i].b;
-        quad.rgbGreen = palette[i].g;
-        quad.rgbRed = palette[i].r;
-        quad.rgbReserved = 0;
-        fwrite(&quad, sizeof(RGBQuad), 1, out);
-    }
-    
-    // Create index map for quick color lookup
-    uint8_t *indices = (uint8_t*)malloc(img->width * img->height);
-    if (!indices) {
-        fprintf(stderr, "Error: Memory allocation failed for color indices\n");
-        return;
-    }
-    for (int i = 0; i < img->width * img->height; i++) {
-        int idx = i * 3;
-        uint8_t r = img->data[idx + 0];
-        uint8_t g = img->data[idx + 1];
-        uint8_t b = img->data[idx + 2];
-        
-        for (int c = 0; c < num_colors; c++) {
-            if (r == palette[c].r && g == palette[c].g && b == palette[c].b) {
-                indices[i] = c;
-                break;
-            }
-        }
-    }
-    
-    // Write pixel data (bottom to top, 4 bits per pixel, padded)
-    uint8_t *row_buffer = (uint8_t*)calloc(row_size, 1);
-    if (!row_buffer) {
-        fprintf(stderr, "Error: Memory allocation failed for row buffer\n");
-        free(indices);
-        return;
-    }
-    for (int y = img->height - 1; y >= 0; y--) {
-        memset(row_buffer, 0, row_size);
-        for (int x = 0; x < img->width; x++) {
-            int pixel_idx = y * img->width + x;
-            uint8_t color_idx = indices[pixel_idx];
-            
-            int byte_idx = x / 2;
-            if (x % 2 == 0) {
-                row_buffer[byte_idx] |= (color_idx << 4);
-            } else {
-                row_buffer[byte_idx] |= color_idx;
-            }
-        }
-        fwrite(row_buffer, row_size, 1, out);
-    }
-    
-    free(row_buffer);
-    free(indices);
-}
-
-void free_image(Image *img) {
-    if (img) {
-        if (img->data) {
-            free(img->data);
-        }
-        free(img);
-    }
-}
+#define DEFAULT_CACHE_MB 256
+#define DEFAULT_DRIFT 0.05
 
 void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s [OPTIONS] [input_image]\n\n", program_name);
+    fprintf(stderr, "Usage: %s [OPTIONS] [input_image]\n", program_name);
+    fprintf(stderr, "       %s [OPTIONS] [-O <dir>] [-B <list>] [input_image...]\n\n", program_name);
     fprintf(stderr, "Image transformation utility that converts PNG or JPEG images to BMP format.\n");
     fprintf(stderr, "Reads an image file (PNG or JPEG/JPG), resizes it to 720x576 resolution,\n");
     fprintf(stderr, "reduces the color palette to 16 colors (VGA palette), and outputs the result\n");
@@ -603,7 +31,87 @@ void print_usage(const char *program_name) {
     fprintf(stderr, "               If the source is too wide, crop left and right sides equally.\n");
     fprintf(stderr, "               If the source is too tall, crop top and bottom equally.\n");
     fprintf(stderr, "  -C           Optimize the colour palette so that output colours best\n");
-    fprintf(stderr, "               match the input colours, instead of using the VGA palette.\n\n");
+    fprintf(stderr, "               match the input colours, instead of using the VGA palette.\n");
+    fprintf(stderr, "  -m <method>  Palette method, implies -C:\n");
+    fprintf(stderr, "                 exact  median cut over every pixel (default)\n");
+    fprintf(stderr, "                 hist   faster median cut over a 5-bit color histogram\n");
+    fprintf(stderr, "  --palette-samples <n>\n");
+    fprintf(stderr, "               Generate the -C palette from <n> pixels sampled on a grid\n");
+    fprintf(stderr, "               instead of from every pixel. With -v, the palette error\n");
+    fprintf(stderr, "               against the full palette is printed.\n");
+    fprintf(stderr, "  -r <filter>  Resampling filter for the resize to 720x576:\n");
+    fprintf(stderr, "                 nearest   nearest neighbor (default)\n");
+    fprintf(stderr, "                 area      average of the covered source pixels\n");
+    fprintf(stderr, "                 bilinear  triangle filter, widened when downscaling\n");
+    fprintf(stderr, "  -d <mode>    Dithering when mapping to the palette:\n");
+    fprintf(stderr, "                 none     nearest color only (default)\n");
+    fprintf(stderr, "                 ordered  8x8 Bayer threshold\n");
+    fprintf(stderr, "                 fs       Floyd-Steinberg error diffusion\n");
+    fprintf(stderr, "  -s           Decode JPEG input at the smallest DCT scale (1/8 steps) that\n");
+    fprintf(stderr, "               still covers 720x576, instead of at full resolution.\n");
+    fprintf(stderr, "  -S           Streaming mode: decode, crop, resize and map the image row by\n");
+    fprintf(stderr, "               row without holding the full decoded image in memory.\n");
+    fprintf(stderr, "  -j <n>       Resize, map and pack the image in <n> parallel bands\n");
+    fprintf(stderr, "               (ignored with -S).\n");
+    fprintf(stderr, "  --rle        Write RLE4 compressed BMPs (much smaller for flat graphics).\n");
+    fprintf(stderr, "  --mem-limit <MB>\n");
+    fprintf(stderr, "               Keep each conversion within about <MB>: images too large to\n");
+    fprintf(stderr, "               decode whole are streamed (same output), JPEGs that still do\n");
+    fprintf(stderr, "               not fit are decoded at a reduced scale, and an image that\n");
+    fprintf(stderr, "               cannot fit fails with an error instead of running out of memory.\n");
+    fprintf(stderr, "  --progressive-stop <n>[,<bits>]\n");
+    fprintf(stderr, "               Stop decoding a progressive JPEG once the first <n> of its\n");
+    fprintf(stderr, "               64 coefficients (1: DC only) are known to within <bits> low\n");
+    fprintf(stderr, "               bits (default 1), skipping the remaining scans. Faster, at\n");
+    fprintf(stderr, "               the cost of slightly softer output.\n");
+    fprintf(stderr, "  -v           Print decode statistics to stderr.\n");
+    fprintf(stderr, "  --arena-size <MB>\n");
+    fprintf(stderr, "               Map <MB> up front for each job's buffer arena, for inputs\n");
+    fprintf(stderr, "               whose buffers outgrow the default 8 MB chunks.\n");
+    fprintf(stderr, "  --stats[=<file>]\n");
+    fprintf(stderr, "               Write one JSON line per image with stage timings, bytes,\n");
+    fprintf(stderr, "               peak RSS, allocations and median-cut splits to stderr,\n");
+    fprintf(stderr, "               or append it to <file>.\n");
+    fprintf(stderr, "  --cache <dir>\n");
+    fprintf(stderr, "               Keep finished BMPs and generated palettes in <dir>, keyed by\n");
+    fprintf(stderr, "               the input content and options; a repeated input is served\n");
+    fprintf(stderr, "               from the cache without decoding. stdin is not cached.\n");
+    fprintf(stderr, "  --cache-size <MB>\n");
+    fprintf(stderr, "               Evict least recently used entries above <MB> (default: %d).\n\n",
+            DEFAULT_CACHE_MB);
+    fprintf(stderr, "Daemon options:\n");
+    fprintf(stderr, "  --serve <socket>\n");
+    fprintf(stderr, "               Serve conversions on a Unix domain socket until SIGINT or\n");
+    fprintf(stderr, "               SIGTERM, with -j <n> request worker threads.\n");
+    fprintf(stderr, "  --client <socket>\n");
+    fprintf(stderr, "               Send the conversion to a server instead of running it here.\n");
+    fprintf(stderr, "               -c, -C, -m, -r, -d, -s, -S and --rle are passed along.\n");
+    fprintf(stderr, "               --palette-in, --palette-samples and --progressive-stop are\n");
+    fprintf(stderr, "               not sent; they come from the server's own command line.\n");
+    fprintf(stderr, "  --by-path    With --client, send file names instead of the image data;\n");
+    fprintf(stderr, "               the server reads the input and writes the output itself.\n\n");
+    fprintf(stderr, "Batch options (used when -B or more than one input is given):\n");
+    fprintf(stderr, "  -B <list>    Read input file names from <list>, one per line (- for stdin)\n");
+    fprintf(stderr, "  -O <dir>     Write <name>.bmp files to <dir> instead of next to each input\n");
+    fprintf(stderr, "  -j <n>       Number of worker threads (default: number of CPUs)\n\n");
+    fprintf(stderr, "Sequence options:\n");
+    fprintf(stderr, "  --sequence   Convert the inputs in order as frames of one video: the\n");
+    fprintf(stderr, "               palette is kept while the colors stay close, and rows that\n");
+    fprintf(stderr, "               did not change are not mapped again. Uses -m hist unless\n");
+    fprintf(stderr, "               -C or -m exact is given.\n");
+    fprintf(stderr, "  --drift <d>  Regenerate the palette when the color histogram differs from\n");
+    fprintf(stderr, "               the palette's frame by more than the fraction <d> of pixels\n");
+    fprintf(stderr, "               (default: %.2f).\n\n", DEFAULT_DRIFT);
+    fprintf(stderr, "Shared palette options:\n");
+    fprintf(stderr, "  --shared-palette\n");
+    fprintf(stderr, "               Generate one palette for all inputs from their merged color\n");
+    fprintf(stderr, "               histogram in a first pass, and map every image to it.\n");
+    fprintf(stderr, "  --shared-sample <n>\n");
+    fprintf(stderr, "               Build the shared palette from <n> evenly spaced inputs only.\n");
+    fprintf(stderr, "  --palette-out <file>\n");
+    fprintf(stderr, "               Save the shared palette to <file> (JASC-PAL text format).\n");
+    fprintf(stderr, "  --palette-in <file>\n");
+    fprintf(stderr, "               Map every image to the palette in <file> (up to 16 colors).\n\n");
     fprintf(stderr, "Supported input formats:\n");
     fprintf(stderr, "  - PNG (Portable Network Graphics)\n");
     fprintf(stderr, "  - JPEG/JPG (Joint Photographic Experts Group)\n\n");
@@ -611,13 +119,52 @@ void print_usage(const char *program_name) {
 }
 
 int main(int argc, char *argv[]) {
-    const char *input_file = NULL;
     const char *output_file = NULL;
-    int crop_mode = 0;
-    int optimize_palette = 0;
+    const char *list_file = NULL;
+    const char *output_dir = NULL;
+    int num_threads = 0;
+    const char *serve_socket = NULL;
+    const char *client_socket = NULL;
+    int by_path = 0;
+    const char *cache_dir = NULL;
+    long cache_mb = DEFAULT_CACHE_MB;
+    int shared_palette = 0;
+    int shared_samples = 0;
+    const char *palette_out = NULL;
+    const char *palette_in = NULL;
+    int sequence = 0;
+    double max_drift = DEFAULT_DRIFT;
+    Color palette[NUM_COLORS];
+    ConvertOptions opts = {.resample = RESAMPLE_NEAREST, .dither = DITHER_NONE};
     int opt;
     
-    while ((opt = getopt(argc, argv, "hcCo:")) != -1) {
+    enum { OPT_STATS = 256, OPT_SERVE, OPT_CLIENT, OPT_BY_PATH, OPT_CACHE, OPT_CACHE_SIZE,
+           OPT_SHARED_PALETTE, OPT_SHARED_SAMPLE, OPT_PALETTE_OUT, OPT_PALETTE_IN,
+           OPT_PALETTE_SAMPLES, OPT_SEQUENCE, OPT_DRIFT, OPT_RLE, OPT_ARENA_SIZE, OPT_MEM_LIMIT,
+           OPT_PROGRESSIVE_STOP };
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"client", required_argument, NULL, OPT_CLIENT},
+        {"by-path", no_argument, NULL, OPT_BY_PATH},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"shared-palette", no_argument, NULL, OPT_SHARED_PALETTE},
+        {"shared-sample", required_argument, NULL, OPT_SHARED_SAMPLE},
+        {"palette-out", required_argument, NULL, OPT_PALETTE_OUT},
+        {"palette-in", required_argument, NULL, OPT_PALETTE_IN},
+        {"palette-samples", required_argument, NULL, OPT_PALETTE_SAMPLES},
+        {"sequence", no_argument, NULL, OPT_SEQUENCE},
+        {"rle", no_argument, NULL, OPT_RLE},
+        {"drift", required_argument, NULL, OPT_DRIFT},
+        {"arena-size", required_argument, NULL, OPT_ARENA_SIZE},
+        {"mem-limit", required_argument, NULL, OPT_MEM_LIMIT},
+        {"progressive-stop", required_argument, NULL, OPT_PROGRESSIVE_STOP},
+        {NULL, 0, NULL, 0}
+    };
+    
+    while ((opt = getopt_long(argc, argv, "hcCm:r:d:o:sSvB:O:j:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -626,10 +173,167 @@ int main(int argc, char *argv[]) {
                 output_file = optarg;
                 break;
             case 'c':
-                crop_mode = 1;
+                opts.crop_mode = 1;
                 break;
             case 'C':
-                optimize_palette = 1;
+                if (opts.optimize_palette == PALETTE_VGA) {
+                    opts.optimize_palette = PALETTE_MEDIAN_CUT;
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "exact") == 0) {
+                    opts.optimize_palette = PALETTE_MEDIAN_CUT;
+                } else if (strcmp(optarg, "hist") == 0) {
+                    opts.optimize_palette = PALETTE_HISTOGRAM;
+                } else {
+                    fprintf(stderr, "Error: Unknown palette method %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (strcmp(optarg, "nearest") == 0) {
+                    opts.resample = RESAMPLE_NEAREST;
+                } else if (strcmp(optarg, "area") == 0) {
+                    opts.resample = RESAMPLE_AREA;
+                } else if (strcmp(optarg, "bilinear") == 0) {
+                    opts.resample = RESAMPLE_BILINEAR;
+                } else {
+                    fprintf(stderr, "Error: Unknown resampling filter %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                if (strcmp(optarg, "none") == 0) {
+                    opts.dither = DITHER_NONE;
+                } else if (strcmp(optarg, "ordered") == 0) {
+                    opts.dither = DITHER_ORDERED;
+                } else if (strcmp(optarg, "fs") == 0) {
+                    opts.dither = DITHER_FS;
+                } else {
+                    fprintf(stderr, "Error: Unknown dither mode %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                opts.scaled_decode = 1;
+                break;
+            case 'S':
+                opts.streaming = 1;
+                break;
+            case 'v':
+                opts.verbose = 1;
+                break;
+            case 'B':
+                list_file = optarg;
+                break;
+            case 'O':
+                output_dir = optarg;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    fprintf(stderr, "Error: Invalid thread count %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_STATS:
+#if STATS_ENABLED
+                if (opts.stats_out && opts.stats_out != stderr) {
+                    fclose(opts.stats_out);
+                }
+                opts.stats_out = optarg ? fopen(optarg, "a") : stderr;
+                if (!opts.stats_out) {
+                    fprintf(stderr, "Error: Cannot open stats file %s\n", optarg);
+                    return 1;
+                }
+                break;
+#else
+                fprintf(stderr, "Error: --stats is not available in this build (STATS=0)\n");
+                return 1;
+#endif
+            case OPT_SERVE:
+                serve_socket = optarg;
+                break;
+            case OPT_CLIENT:
+                client_socket = optarg;
+                break;
+            case OPT_BY_PATH:
+                by_path = 1;
+                break;
+            case OPT_CACHE:
+                cache_dir = optarg;
+                break;
+            case OPT_CACHE_SIZE:
+                cache_mb = atol(optarg);
+                if (cache_mb < 1) {
+                    fprintf(stderr, "Error: Invalid cache size %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_SHARED_PALETTE:
+                shared_palette = 1;
+                break;
+            case OPT_SHARED_SAMPLE:
+                shared_samples = atoi(optarg);
+                if (shared_samples < 1) {
+                    fprintf(stderr, "Error: Invalid sample count %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PALETTE_OUT:
+                palette_out = optarg;
+                break;
+            case OPT_PALETTE_IN:
+                palette_in = optarg;
+                break;
+            case OPT_RLE:
+                opts.rle = 1;
+                break;
+            case OPT_ARENA_SIZE: {
+                long arena_mb = atol(optarg);
+                if (arena_mb < 1) {
+                    fprintf(stderr, "Error: Invalid arena size %s\n", optarg);
+                    return 1;
+                }
+                arena_pool_configure((size_t)arena_mb << 20);
+                break;
+            }
+            case OPT_MEM_LIMIT: {
+                long limit_mb = atol(optarg);
+                if (limit_mb < 1) {
+                    fprintf(stderr, "Error: Invalid memory limit %s\n", optarg);
+                    return 1;
+                }
+                opts.mem_limit = (size_t)limit_mb << 20;
+                break;
+            }
+            case OPT_PROGRESSIVE_STOP: {
+                int coefs = 0, bits = 1;
+                if (sscanf(optarg, "%d,%d", &coefs, &bits) < 1 ||
+                    coefs < 1 || coefs > 64 || bits < 0 || bits > 13) {
+                    fprintf(stderr, "Error: Invalid progressive stop %s\n", optarg);
+                    return 1;
+                }
+                opts.progressive_coefs = coefs;
+                opts.progressive_bits = bits;
+                break;
+            }
+            case OPT_SEQUENCE:
+                sequence = 1;
+                break;
+            case OPT_DRIFT:
+                max_drift = atof(optarg);
+                if (max_drift < 0 || max_drift > 1) {
+                    fprintf(stderr, "Error: Invalid drift threshold %s (0 to 1)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PALETTE_SAMPLES:
+                opts.palette_samples = atoi(optarg);
+                if (opts.palette_samples < 1) {
+                    fprintf(stderr, "Error: Invalid sample count %s\n", optarg);
+                    return 1;
+                }
                 break;
             default:
                 print_usage(argv[0]);
@@ -637,67 +341,109 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    // Get optional input filename from remaining arguments
-    if (optind < argc) {
-        input_file = argv[optind];
+    if (client_socket) {
+        if (list_file || argc - optind > 1) {
+            fprintf(stderr, "Error: --client converts a single input\n");
+            return 1;
+        }
+        if (shared_palette || palette_in || opts.palette_samples || sequence) {
+            fprintf(stderr, "Error: palette options are not sent to a server, give them to --serve\n");
+            return 1;
+        }
+        return client_convert(client_socket, optind < argc ? argv[optind] : NULL,
+                              output_file, by_path, &opts);
     }
     
-    // Read image (auto-detects format)
-    Image *img;
-    if (input_file) {
-        img = read_image_auto(input_file);
-    } else {
-        img = read_image_from_stdin();
+    if (serve_socket && (list_file || optind < argc)) {
+        fprintf(stderr, "Error: --serve takes no inputs\n");
+        return 1;
     }
-    
-    if (!img) {
-        fprintf(stderr, "Error: Failed to read image file\n");
+    if (shared_palette && (palette_in || serve_socket || (!list_file && optind == argc))) {
+        fprintf(stderr, "Error: --shared-palette needs input files and no --palette-in\n");
         return 1;
     }
-    
-    // Optionally crop to target aspect ratio
-    Image *source = img;
-    if (crop_mode) {
-        Image *cropped = crop_to_aspect_ratio(img, TARGET_WIDTH, TARGET_HEIGHT);
-        if (cropped) {
-            free_image(img);
-            source = cropped;
-        }
-        // If cropped is NULL, aspect ratios already match, use original
+    if ((palette_out || shared_samples) && !shared_palette) {
+        fprintf(stderr, "Error: --palette-out and --shared-sample need --shared-palette\n");
+        return 1;
     }
     
-    // Resize to 720x576
-    Image *resized = resize_image(source, TARGET_WIDTH, TARGET_HEIGHT);
-    free_image(source);
+    if (sequence && (serve_socket || output_file || (!list_file && optind == argc))) {
+        fprintf(stderr, "Error: --sequence needs input files and writes next to them or to -O <dir>\n");
+        return 1;
+    }
     
-    if (!resized) {
-        fprintf(stderr, "Error: Failed to resize image\n");
+    if (list_file && optind < argc) {
+        fprintf(stderr, "Error: -B cannot be combined with input files on the command line\n");
+        return 1;
+    }
+    if (output_dir && (serve_socket || (!list_file && optind == argc))) {
+        fprintf(stderr, "Error: -O needs input files\n");
         return 1;
     }
     
-    // Quantize to 16 colors
-    Color palette[NUM_COLORS];
-    quantize_colors(resized, palette, NUM_COLORS, optimize_palette);
+    // Batch mode: a file list or several inputs
+    int batch = list_file || argc - optind > 1;
+    if ((batch || output_dir) && output_file) {
+        fprintf(stderr, "Error: -o cannot be used with -O or several inputs\n");
+        return 1;
+    }
     
-    // Determine output destination
-    FILE *out = stdout;
-    if (output_file) {
-        out = fopen(output_file, "wb");
-        if (!out) {
-            fprintf(stderr, "Error: Cannot open output file %s\n", output_file);
-            free_image(resized);
+    if (palette_in) {
+        if (load_palette(palette_in, palette, NUM_COLORS) != 0) {
             return 1;
         }
+        opts.palette = palette;
     }
     
-    // Write BMP
-    write_bmp(resized, palette, NUM_COLORS, out);
+    char **inputs = argv + optind;
+    int count = argc - optind;
+    if (list_file) {
+        inputs = read_file_list(list_file, &count);
+        if (!inputs) {
+            return 1;
+        }
+    }
+    int pool_threads = num_threads ? num_threads : pool_default_threads();
     
-    if (output_file) {
-        fclose(out);
+    int result = 0;
+    // The cache lives on this side; a client uses the server's
+    if (cache_dir) {
+        opts.cache = cache_open(cache_dir, (size_t)cache_mb << 20);
+        result = opts.cache ? 0 : 1;
     }
     
-    free_image(resized);
+    // First pass over the inputs for the shared palette
+    if (result == 0 && shared_palette) {
+        result = build_shared_palette(inputs, count, shared_samples, pool_threads, &opts, palette);
+        if (result == 0 && palette_out) {
+            result = save_palette(palette_out, palette, NUM_COLORS);
+        }
+        result = result == 0 ? 0 : 1;
+        opts.palette = palette;
+    }
+    
+    if (result == 0 && serve_socket) {
+        result = serve(serve_socket, pool_threads, &opts);
+    } else if (result == 0 && sequence) {
+        result = run_sequence(inputs, count, output_dir, max_drift, &opts) > 0 ? 1 : 0;
+    } else if (result == 0 && batch) {
+        result = run_batch(inputs, count, output_dir, pool_threads, &opts) > 0 ? 1 : 0;
+    } else if (result == 0) {
+        // A single image uses the threads for band-parallel processing
+        opts.threads = num_threads;
+        char *dir_output = output_dir ? batch_output_path(inputs[0], output_dir) : NULL;
+        if (output_dir && !dir_output) {
+            result = 1;
+        } else {
+            result = convert_image(count > 0 ? inputs[0] : NULL,
+                                   dir_output ? dir_output : output_file, &opts);
+        }
+        free(dir_output);
+    }
     
-    return 0;
+    cache_close(opts.cache);
+    if (list_file) {
+        free_file_list(inputs, count);
+    }
+    return result;
 }
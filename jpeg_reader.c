@@ -2,17 +2,219 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <setjmp.h>
 #include <jpeglib.h>
+#include <jerror.h>
 #include "jpeg_reader.h"
+#include "stats.h"
+#include "arena.h"
+
+// Error manager that hands control back to the reader instead of calling
+// exit(), so a corrupt file only fails its own conversion
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} JpegErrorMgr;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorMgr *err = (JpegErrorMgr*)cinfo->err;
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jmp, 1);
+}
+
+// Source manager that replays the already consumed prefix and then reads
+// the rest of the stream in chunks, so a pipe can be decoded as it arrives
+#define SOURCE_CHUNK_SIZE 65536
+
+typedef struct {
+    struct jpeg_source_mgr pub;
+    InputSource src;
+    int prefix_done;
+    JOCTET buffer[SOURCE_CHUNK_SIZE];
+} PrefixSourceMgr;
+
+static void prefix_init_source(j_decompress_ptr cinfo) {
+    (void)cinfo;
+}
+
+static boolean prefix_fill_input_buffer(j_decompress_ptr cinfo) {
+    PrefixSourceMgr *mgr = (PrefixSourceMgr*)cinfo->src;
+    static const JOCTET fake_eoi[2] = { 0xFF, JPEG_EOI };
+    
+    if (!mgr->prefix_done) {
+        mgr->prefix_done = 1;
+        if (mgr->src.prefix_size > 0) {
+            mgr->pub.next_input_byte = mgr->src.prefix;
+            mgr->pub.bytes_in_buffer = mgr->src.prefix_size;
+            return TRUE;
+        }
+    }
+    
+    size_t n = mgr->src.fp ? fread(mgr->buffer, 1, SOURCE_CHUNK_SIZE, mgr->src.fp) : 0;
+    STATS_ADD(bytes_read, n);
+    if (n == 0) {
+        // Truncated input: insert an EOI like jpeg_stdio_src does
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        mgr->pub.next_input_byte = fake_eoi;
+        mgr->pub.bytes_in_buffer = 2;
+        return TRUE;
+    }
+    mgr->pub.next_input_byte = mgr->buffer;
+    mgr->pub.bytes_in_buffer = n;
+    return TRUE;
+}
+
+static void prefix_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    struct jpeg_source_mgr *src = cinfo->src;
+    if (num_bytes <= 0) {
+        return;
+    }
+    while (num_bytes > (long)src->bytes_in_buffer) {
+        num_bytes -= (long)src->bytes_in_buffer;
+        (void)(*src->fill_input_buffer)(cinfo);
+    }
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+}
+
+static void prefix_term_source(j_decompress_ptr cinfo) {
+    (void)cinfo;
+}
+
+// Attach an InputSource to the decompressor. Plain files use the stdio
+// source and whole in-memory inputs the memory source.
+static void set_source(j_decompress_ptr cinfo, const InputSource *src) {
+    if (src->prefix_size == 0 && src->fp) {
+        jpeg_stdio_src(cinfo, src->fp);
+        return;
+    }
+    if (!src->fp) {
+        jpeg_mem_src(cinfo, (const unsigned char*)src->prefix, (unsigned long)src->prefix_size);
+        return;
+    }
+    // Allocated from the permanent pool, released by jpeg_destroy_decompress
+    PrefixSourceMgr *mgr = (PrefixSourceMgr*)(*cinfo->mem->alloc_large)(
+        (j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(PrefixSourceMgr));
+    mgr->pub.init_source = prefix_init_source;
+    mgr->pub.fill_input_buffer = prefix_fill_input_buffer;
+    mgr->pub.skip_input_data = prefix_skip_input_data;
+    mgr->pub.resync_to_restart = jpeg_resync_to_restart;
+    mgr->pub.term_source = prefix_term_source;
+    mgr->pub.bytes_in_buffer = 0;
+    mgr->pub.next_input_byte = NULL;
+    mgr->src = *src;
+    mgr->prefix_done = 0;
+    cinfo->src = &mgr->pub;
+}
+
+// Check whether a decoded size still covers the target size
+static int covers_target(int width, int height, const DecodeHints *hints) {
+    if (hints->crop) {
+        int x, y;
+        crop_window(width, height, hints->target_width, hints->target_height, &x, &y, &width, &height);
+    }
+    return width >= hints->target_width && height >= hints->target_height;
+}
+
+// Pick the smallest DCT scale whose output covers the target. Only 1/8, 1/4
+// and 1/2 are tried: those have fast reduced-size IDCTs in every libjpeg,
+// while the other M/8 factors are often slower than a full decode.
+static void choose_scale(struct jpeg_decompress_struct *cinfo, const DecodeHints *hints) {
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 1;
+    if (!hints || !hints->scale || hints->target_width <= 0 || hints->target_height <= 0) {
+        return;
+    }
+    for (int denom = 8; denom > 1; denom /= 2) {
+        cinfo->scale_denom = denom;
+        jpeg_calc_output_dimensions(cinfo);
+        if (covers_target(cinfo->output_width, cinfo->output_height, hints)) {
+            return;
+        }
+    }
+    cinfo->scale_denom = 1;
+}
+
+// Bytes of the whole-image coefficient buffer that libjpeg keeps for
+// progressive and other multi-scan files, 0 for single-scan files that are
+// decoded one iMCU row at a time. Valid once the header has been read.
+static size_t coefficient_bytes(const struct jpeg_decompress_struct *cinfo) {
+    if (!cinfo->progressive_mode && cinfo->comps_in_scan >= cinfo->num_components) {
+        return 0;
+    }
+    size_t bytes = 0;
+    for (int i = 0; i < cinfo->num_components; i++) {
+        const jpeg_component_info *comp = &cinfo->comp_info[i];
+        bytes += (size_t)comp->width_in_blocks * comp->height_in_blocks * sizeof(JBLOCK);
+    }
+    return bytes;
+}
+
+// Whether every component has its first coefs coefficients to within bits
+// low bits
+static int coefficients_known(const struct jpeg_decompress_struct *cinfo, int coefs, int bits) {
+    for (int c = 0; c < cinfo->num_components; c++) {
+        for (int k = 0; k < coefs && k < DCTSIZE2; k++) {
+            int missing = cinfo->coef_bits[c][k];
+            if (missing < 0 || missing > bits) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// jpeg_start_decompress, with the progressive early out of hints. A
+// progressive file is then decoded in buffered-image mode: whole scans are
+// absorbed until the requested coefficients are in, and a single output pass
+// starts from those, with libjpeg's block smoothing filling in the missing
+// detail. The remaining scans are never read, and the output pass stays
+// open, so the caller must end a buffered-image decode with
+// jpeg_abort_decompress, also when every scan was read (a truncated file
+// reaches EOI before the requested precision).
+static void start_decompress(j_decompress_ptr cinfo, const DecodeHints *hints, DecodeInfo *info) {
+    if (!hints || hints->progressive_coefs <= 0 || !cinfo->progressive_mode) {
+        jpeg_start_decompress(cinfo);
+        return;
+    }
+    cinfo->buffered_image = TRUE;
+    jpeg_start_decompress(cinfo);
+    int status;
+    do {
+        status = jpeg_consume_input(cinfo);
+    } while (status != JPEG_REACHED_EOI &&
+             !(status == JPEG_SCAN_COMPLETED &&
+               coefficients_known(cinfo, hints->progressive_coefs, hints->progressive_bits)));
+    jpeg_start_output(cinfo, cinfo->input_scan_number);
+    if (info && status != JPEG_REACHED_EOI) {
+        info->scans = cinfo->input_scan_number;
+    }
+}
 
 // Read JPEG from file pointer
 Image* read_jpeg_from_fp(FILE *fp) {
+    InputSource src = { NULL, 0, fp };
+    return read_jpeg_from_source(&src, NULL, NULL);
+}
+
+// Read JPEG from an input source at a reduced scale
+Image* read_jpeg_from_source(const InputSource *src, const DecodeHints *hints, DecodeInfo *info) {
     struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    JpegErrorMgr jerr;
+    Image *volatile img = NULL;
     
-    cinfo.err = jpeg_std_error(&jerr);
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
     jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, fp);
+    
+    if (setjmp(jerr.jmp)) {
+        // Corrupt or truncated data: drop whatever was decoded so far
+        free_image(img);
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
+    
+    set_source(&cinfo, src);
     
     if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
         jpeg_destroy_decompress(&cinfo);
@@ -22,53 +224,238 @@ Image* read_jpeg_from_fp(FILE *fp) {
     // Force RGB output
     cinfo.out_color_space = JCS_RGB;
     
-    jpeg_start_decompress(&cinfo);
+    // Let the IDCT do the bulk of the downscaling
+    choose_scale(&cinfo, hints);
+    if (info) {
+        info->source_width = cinfo.image_width;
+        info->source_height = cinfo.image_height;
+        info->scale_num = cinfo.scale_num;
+        info->scale_denom = cinfo.scale_denom;
+    }
+    
+    // Multi-scan files are buffered whole by jpeg_start_decompress, so the
+    // budget is checked before, with the rows that will be kept
+    if (hints && hints->mem_limit) {
+        jpeg_calc_output_dimensions(&cinfo);
+        int x, y, w = cinfo.output_width, h = cinfo.output_height;
+        if (hints->crop && hints->target_width > 0 && hints->target_height > 0) {
+            crop_window(cinfo.output_width, cinfo.output_height,
+                        hints->target_width, hints->target_height, &x, &y, &w, &h);
+        }
+        if (check_mem_limit(hints, coefficient_bytes(&cinfo) +
+                                   (size_t)cinfo.output_width * h * 3) != 0) {
+            jpeg_destroy_decompress(&cinfo);
+            return NULL;
+        }
+    }
     
+    start_decompress(&cinfo, hints, info);
+    
+    // Only the rows and columns inside the crop window are decoded
+    int crop_x = 0, crop_y = 0;
     int width = cinfo.output_width;
     int height = cinfo.output_height;
-    int row_stride = width * cinfo.output_components;
+    int cropped = hints && hints->crop && hints->target_width > 0 && hints->target_height > 0 &&
+        crop_window(width, height, hints->target_width, hints->target_height,
+                    &crop_x, &crop_y, &width, &height);
+    JDIMENSION x_offset = 0;
+    JDIMENSION x_width = cinfo.output_width;
+#ifdef LIBJPEG_TURBO_VERSION
+    if (cropped && width < (int)cinfo.output_width) {
+        // One iMCU of margin on each side keeps the chroma upsampling at the
+        // window edges identical to a full-width decode
+        int margin = cinfo.max_h_samp_factor * cinfo.min_DCT_scaled_size;
+        int left = crop_x > margin ? crop_x - margin : 0;
+        int right = crop_x + width + margin;
+        if (right > (int)cinfo.output_width) {
+            right = cinfo.output_width;
+        }
+        x_offset = left;
+        x_width = right - left;
+        jpeg_crop_scanline(&cinfo, &x_offset, &x_width);
+    }
+#endif
     
-    // Create image structure
-    Image *img = (Image*)malloc(sizeof(Image));
+    img = create_image(x_width, height);
     if (!img) {
-        jpeg_finish_decompress(&cinfo);
         jpeg_destroy_decompress(&cinfo);
         return NULL;
     }
     
-    img->width = width;
-    img->height = height;
-    img->data = (uint8_t*)malloc(width * height * 3);
-    if (!img->data) {
-        free(img);
+#ifdef LIBJPEG_TURBO_VERSION
+    if (crop_y > 0) {
+        jpeg_skip_scanlines(&cinfo, crop_y);
+    }
+#else
+    // Skipped rows land in the first row and are overwritten below
+    while ((int)cinfo.output_scanline < crop_y) {
+        JSAMPROW row = img->data;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+#endif
+    
+    // Read scanlines straight into the image, RGB rows have the same layout
+    for (int y = 0; y < height; y++) {
+        JSAMPROW row = image_row(img, y);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    
+    if (cropped || cinfo.buffered_image) {
+        // The rows below the window and the scans after an early out are
+        // never decoded
+        jpeg_abort_decompress(&cinfo);
+    } else {
         jpeg_finish_decompress(&cinfo);
-        jpeg_destroy_decompress(&cinfo);
+    }
+    if (cropped) {
+        img->data += (size_t)(crop_x - x_offset) * 3;
+        img->width = width;
+        if (info) {
+            info->cropped = 1;
+        }
+    }
+    jpeg_destroy_decompress(&cinfo);
+    
+    return img;
+}
+
+// Row-by-row decoder state
+typedef struct {
+    RowReader base;
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorMgr jerr;
+    JSAMPROW scratch; // used when skipping rows without jpeg_skip_scanlines
+} JpegRowReader;
+
+static int jpeg_row_reader_read(RowReader *reader, uint8_t *rgb) {
+    JpegRowReader *r = (JpegRowReader*)reader;
+    if (r->cinfo.output_scanline >= r->cinfo.output_height) {
+        return -1;
+    }
+    if (setjmp(r->jerr.jmp)) {
+        return -1;
+    }
+    JSAMPROW row = rgb;
+    return jpeg_read_scanlines(&r->cinfo, &row, 1) == 1 ? 0 : -1;
+}
+
+static int jpeg_row_reader_skip(RowReader *reader, int count) {
+    JpegRowReader *r = (JpegRowReader*)reader;
+    if (count <= 0) {
+        return 0;
+    }
+    if (r->cinfo.output_scanline + count > r->cinfo.output_height) {
+        return -1;
+    }
+    if (setjmp(r->jerr.jmp)) {
+        return -1;
+    }
+#ifdef LIBJPEG_TURBO_VERSION
+    // Skipped rows are entropy decoded but not run through the IDCT
+    return jpeg_skip_scanlines(&r->cinfo, count) == (JDIMENSION)count ? 0 : -1;
+#else
+    while (count-- > 0) {
+        if (jpeg_read_scanlines(&r->cinfo, &r->scratch, 1) != 1) {
+            return -1;
+        }
+    }
+    return 0;
+#endif
+}
+
+static void jpeg_row_reader_close(RowReader *reader) {
+    JpegRowReader *r = (JpegRowReader*)reader;
+    // Rows after the last one needed are never decoded
+    jpeg_destroy_decompress(&r->cinfo);
+    job_free(r->scratch);
+    job_free(r);
+}
+
+// Open a row-by-row JPEG decoder
+RowReader* jpeg_open_row_reader(const InputSource *src, const DecodeHints *hints, DecodeInfo *info) {
+    JpegRowReader *r = (JpegRowReader*)job_calloc(1, sizeof(JpegRowReader));
+    if (!r) {
         return NULL;
     }
     
-    // Allocate row buffer using standard allocation
-    JSAMPROW row_buffer = (JSAMPROW)malloc(row_stride);
-    if (!row_buffer) {
-        free(img->data);
-        free(img);
-        jpeg_finish_decompress(&cinfo);
-        jpeg_destroy_decompress(&cinfo);
+    r->cinfo.err = jpeg_std_error(&r->jerr.pub);
+    r->jerr.pub.error_exit = jpeg_error_exit;
+    jpeg_create_decompress(&r->cinfo);
+    
+    if (setjmp(r->jerr.jmp)) {
+        jpeg_destroy_decompress(&r->cinfo);
+        job_free(r);
         return NULL;
     }
     
-    // Read scanlines
-    int y = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, &row_buffer, 1);
-        memcpy(&img->data[y * width * 3], row_buffer, width * 3);
-        y++;
+    set_source(&r->cinfo, src);
+    
+    if (jpeg_read_header(&r->cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&r->cinfo);
+        job_free(r);
+        return NULL;
     }
     
-    free(row_buffer);
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    r->cinfo.out_color_space = JCS_RGB;
+    choose_scale(&r->cinfo, hints);
+    if (info) {
+        info->source_width = r->cinfo.image_width;
+        info->source_height = r->cinfo.image_height;
+        info->scale_num = r->cinfo.scale_num;
+        info->scale_denom = r->cinfo.scale_denom;
+    }
     
-    return img;
+    // Multi-scan files are buffered whole by jpeg_start_decompress
+    if (check_mem_limit(hints, coefficient_bytes(&r->cinfo)) != 0) {
+        jpeg_destroy_decompress(&r->cinfo);
+        job_free(r);
+        return NULL;
+    }
+    
+    start_decompress(&r->cinfo, hints, info);
+    
+    r->scratch = (JSAMPROW)job_malloc((size_t)r->cinfo.output_width * r->cinfo.output_components);
+    if (!r->scratch) {
+        jpeg_destroy_decompress(&r->cinfo);
+        job_free(r);
+        return NULL;
+    }
+    
+    r->base.width = r->cinfo.output_width;
+    r->base.height = r->cinfo.output_height;
+    r->base.read_row = jpeg_row_reader_read;
+    r->base.skip_rows = jpeg_row_reader_skip;
+    r->base.close = jpeg_row_reader_close;
+    return &r->base;
+}
+
+int jpeg_probe(const InputSource *src, const DecodeHints *hints, ImageProbe *probe) {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorMgr jerr;
+    
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    set_source(&cinfo, src);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    choose_scale(&cinfo, hints);
+    jpeg_calc_output_dimensions(&cinfo);
+    probe->source_width = cinfo.image_width;
+    probe->source_height = cinfo.image_height;
+    probe->width = cinfo.output_width;
+    probe->height = cinfo.output_height;
+    probe->whole_image = 0;
+    probe->decoder_bytes = coefficient_bytes(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
 }
 
 // Read JPEG file
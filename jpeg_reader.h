@@ -7,6 +7,21 @@
 // Read JPEG from file pointer
 Image* read_jpeg_from_fp(FILE *fp);
 
+// Read JPEG from an input source. With hints->scale libjpeg DCT scaling
+// decodes at the smallest scale that still covers the target size, and with
+// hints->crop only the crop window is decoded and info->cropped is set.
+// hints and info may be NULL.
+Image* read_jpeg_from_source(const InputSource *src, const DecodeHints *hints, DecodeInfo *info);
+
+// Open a row-by-row JPEG decoder on an input source, with the same scaling
+// behaviour as read_jpeg_from_source. hints and info may be NULL.
+RowReader* jpeg_open_row_reader(const InputSource *src, const DecodeHints *hints, DecodeInfo *info);
+
+// Read the header of a JPEG and the decoded size with the scale hints allow.
+// A stream source is consumed, so this is meant for inputs that are entirely
+// in memory. hints may be NULL. Returns 0 on success.
+int jpeg_probe(const InputSource *src, const DecodeHints *hints, ImageProbe *probe);
+
 // Read JPEG file
 Image* read_jpeg(const char *filename);
 
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Latency of the --serve daemon against one imgtransform process per request.
+
+Starts a server on a temporary socket and sends the same requests three ways:
+
+  fork    run ./imgtransform for every request (the baseline)
+  client  run ./imgtransform --client for every request
+  socket  speak the framed protocol directly, as an in-process client would
+
+Each mode reports p50/p99/mean latency and throughput, and every response is
+checked against the baseline output.
+
+Usage: loadtest.py [-n requests] [-c concurrency] [--options="-c -C"] input...
+"""
+
+import argparse
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+REQUEST_MAGIC = 0x51525449
+RESPONSE_MAGIC = 0x53525449
+FLAGS = {"-c": 1, "-s": 2, "-S": 4, "--rle": 16}
+PALETTES = {"exact": 1, "hist": 2}
+FILTERS = {"nearest": 0, "area": 1, "bilinear": 2}
+DITHER = {"none": 0, "ordered": 32, "fs": 64}
+
+
+def encode_options(options):
+    """Request flags, palette and filter for an imgtransform option list."""
+    flags, palette, resample = 0, 0, 0
+    args = iter(options)
+    for arg in args:
+        if arg in FLAGS:
+            flags |= FLAGS[arg]
+        elif arg == "-C":
+            palette = palette or 1
+        elif arg == "-m":
+            palette = PALETTES[next(args)]
+        elif arg == "-r":
+            resample = FILTERS[next(args)]
+        elif arg == "-d":
+            flags |= DITHER[next(args)]
+        else:
+            sys.exit("unsupported option for the socket mode: " + arg)
+    return flags, palette, resample
+
+
+def read_exact(sock, n):
+    data = bytearray()
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise IOError("connection closed")
+        data += chunk
+    return bytes(data)
+
+
+def socket_request(path, header, data):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(path)
+        sock.sendall(header + struct.pack("<I", len(data)) + data + struct.pack("<I", 0))
+        magic, status, length = struct.unpack("<III", read_exact(sock, 12))
+        body = read_exact(sock, length)
+        if magic != RESPONSE_MAGIC or status != 0:
+            raise IOError("request failed: " + body.decode(errors="replace"))
+        return body
+
+
+def percentile(sorted_ms, p):
+    index = min(len(sorted_ms) - 1, int(round(p / 100.0 * (len(sorted_ms) - 1))))
+    return sorted_ms[index]
+
+
+def run_mode(name, jobs, concurrency):
+    def timed(job):
+        start = time.monotonic()
+        output = job()
+        return (time.monotonic() - start) * 1000.0, output
+
+    start = time.monotonic()
+    with ThreadPoolExecutor(max_workers=concurrency) as pool:
+        results = list(pool.map(timed, jobs))
+    elapsed = time.monotonic() - start
+    latencies = sorted(ms for ms, _ in results)
+    print("%-8s %8d %10.2f %10.2f %10.2f %10.1f" % (
+        name, len(latencies), percentile(latencies, 50), percentile(latencies, 99),
+        sum(latencies) / len(latencies), len(latencies) / elapsed))
+    return [output for _, output in results]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-n", type=int, default=200, help="requests per mode (default: 200)")
+    parser.add_argument("-c", type=int, default=1, help="concurrent requests (default: 1)")
+    parser.add_argument("--options", default="-C", help='conversion options, e.g. --options="-c -C" (default: "-C")')
+    parser.add_argument("--binary", default="./imgtransform")
+    parser.add_argument("inputs", nargs="+")
+    args = parser.parse_args()
+
+    options = args.options.split()
+    flags, palette, resample = encode_options(options)
+    header = struct.pack("<IIII", REQUEST_MAGIC, flags, palette, resample)
+    inputs = [(path, open(path, "rb").read()) for path in args.inputs]
+    requests = [inputs[i % len(inputs)] for i in range(args.n)]
+
+    workdir = tempfile.mkdtemp()
+    sock_path = os.path.join(workdir, "imgtransform.sock")
+    server = subprocess.Popen([args.binary, "--serve", sock_path, "-j", str(args.c)],
+                              stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            if os.path.exists(sock_path):
+                break
+            time.sleep(0.05)
+        else:
+            sys.exit("server did not start")
+
+        print("%d requests, concurrency %d, options %s" % (args.n, args.c, args.options))
+        print("%-8s %8s %10s %10s %10s %10s" % ("mode", "requests", "p50_ms", "p99_ms", "mean_ms", "req/s"))
+        fork_jobs = [lambda p=path: subprocess.run([args.binary] + options + [p],
+                                                   stdout=subprocess.PIPE, check=True).stdout
+                     for path, _ in requests]
+        client_jobs = [lambda p=path: subprocess.run([args.binary, "--client", sock_path] + options + [p],
+                                                     stdout=subprocess.PIPE, check=True).stdout
+                       for path, _ in requests]
+        socket_jobs = [lambda d=data: socket_request(sock_path, header, d) for _, data in requests]
+
+        expected = run_mode("fork", fork_jobs, args.c)
+        mismatches = 0
+        for name, jobs in (("client", client_jobs), ("socket", socket_jobs)):
+            outputs = run_mode(name, jobs, args.c)
+            mismatches += sum(a != b for a, b in zip(expected, outputs))
+        if mismatches:
+            sys.exit("%d responses differ from the baseline" % mismatches)
+    finally:
+        server.terminate()
+        server.wait()
+        os.rmdir(workdir)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "median_cut.h"
+#include "stats.h"
+#include "arena.h"
+
+// Box of histogram bins, bounds inclusive and in bin coordinates
+typedef struct {
+    int lo[3];
+    int hi[3];
+    uint64_t count;
+} HistBox;
+
+static inline size_t bin_index(int bits, int r, int g, int b) {
+    return ((size_t)r << (2 * bits)) | ((size_t)g << bits) | (size_t)b;
+}
+
+// Create an empty histogram
+ColorHistogram* histogram_create(int bits) {
+    if (bits < 1 || bits > 8) {
+        return NULL;
+    }
+    ColorHistogram *hist = (ColorHistogram*)job_malloc(sizeof(ColorHistogram));
+    if (!hist) {
+        return NULL;
+    }
+    hist->bits = bits;
+    hist->total = 0;
+    hist->bins = (HistogramBin*)job_calloc((size_t)1 << (3 * bits), sizeof(HistogramBin));
+    if (!hist->bins) {
+        job_free(hist);
+        return NULL;
+    }
+    return hist;
+}
+
+// Reset all bins
+void histogram_clear(ColorHistogram *hist) {
+    memset(hist->bins, 0, sizeof(HistogramBin) << (3 * hist->bits));
+    hist->total = 0;
+}
+
+// Add RGB pixels
+void histogram_add_pixels(ColorHistogram *hist, const uint8_t *rgb, size_t count) {
+    int shift = 8 - hist->bits;
+    for (size_t i = 0; i < count; i++) {
+        uint8_t r = rgb[i * 3 + 0];
+        uint8_t g = rgb[i * 3 + 1];
+        uint8_t b = rgb[i * 3 + 2];
+        HistogramBin *bin = &hist->bins[bin_index(hist->bits, r >> shift, g >> shift, b >> shift)];
+        bin->count++;
+        bin->sum_r += r;
+        bin->sum_g += g;
+        bin->sum_b += b;
+    }
+    hist->total += count;
+}
+
+// Add all bins of src into dst
+void histogram_merge(ColorHistogram *dst, const ColorHistogram *src) {
+    size_t num_bins = (size_t)1 << (3 * dst->bits);
+    for (size_t i = 0; i < num_bins; i++) {
+        dst->bins[i].count += src->bins[i].count;
+        dst->bins[i].sum_r += src->bins[i].sum_r;
+        dst->bins[i].sum_g += src->bins[i].sum_g;
+        dst->bins[i].sum_b += src->bins[i].sum_b;
+    }
+    dst->total += src->total;
+}
+
+// Distance between two color distributions
+double histogram_distance(const ColorHistogram *a, const ColorHistogram *b) {
+    if (a->total == 0 || b->total == 0) {
+        return a->total == b->total ? 0.0 : 1.0;
+    }
+    size_t num_bins = (size_t)1 << (3 * a->bits);
+    double scale_a = 1.0 / a->total;
+    double scale_b = 1.0 / b->total;
+    double sum = 0.0;
+    for (size_t i = 0; i < num_bins; i++) {
+        double d = a->bins[i].count * scale_a - b->bins[i].count * scale_b;
+        sum += d < 0 ? -d : d;
+    }
+    return sum / 2;
+}
+
+void histogram_free(ColorHistogram *hist) {
+    if (hist) {
+        job_free(hist->bins);
+        job_free(hist);
+    }
+}
+
+// Shrink a box to its occupied bins and recount it
+static void shrink_box(const ColorHistogram *hist, HistBox *box) {
+    int lo[3] = {255, 255, 255};
+    int hi[3] = {0, 0, 0};
+    uint64_t count = 0;
+    
+    for (int r = box->lo[0]; r <= box->hi[0]; r++) {
+        for (int g = box->lo[1]; g <= box->hi[1]; g++) {
+            const HistogramBin *row = &hist->bins[bin_index(hist->bits, r, g, 0)];
+            for (int b = box->lo[2]; b <= box->hi[2]; b++) {
+                if (row[b].count == 0) continue;
+                count += row[b].count;
+                if (r < lo[0]) lo[0] = r;
+                if (r > hi[0]) hi[0] = r;
+                if (g < lo[1]) lo[1] = g;
+                if (g > hi[1]) hi[1] = g;
+                if (b < lo[2]) lo[2] = b;
+                if (b > hi[2]) hi[2] = b;
+            }
+        }
+    }
+    
+    box->count = count;
+    if (count > 0) {
+        memcpy(box->lo, lo, sizeof(lo));
+        memcpy(box->hi, hi, sizeof(hi));
+    }
+}
+
+// Pixel count of the slice at coordinate c along axis within the box
+static uint64_t slice_count(const ColorHistogram *hist, const HistBox *box, int axis, int c) {
+    int lo[3], hi[3];
+    memcpy(lo, box->lo, sizeof(lo));
+    memcpy(hi, box->hi, sizeof(hi));
+    lo[axis] = hi[axis] = c;
+    
+    uint64_t count = 0;
+    for (int r = lo[0]; r <= hi[0]; r++) {
+        for (int g = lo[1]; g <= hi[1]; g++) {
+            const HistogramBin *row = &hist->bins[bin_index(hist->bits, r, g, 0)];
+            for (int b = lo[2]; b <= hi[2]; b++) {
+                count += row[b].count;
+            }
+        }
+    }
+    return count;
+}
+
+// Average color of a box from the bin moments
+static Color hist_box_average(const ColorHistogram *hist, const HistBox *box) {
+    uint64_t r_sum = 0, g_sum = 0, b_sum = 0;
+    for (int r = box->lo[0]; r <= box->hi[0]; r++) {
+        for (int g = box->lo[1]; g <= box->hi[1]; g++) {
+            const HistogramBin *row = &hist->bins[bin_index(hist->bits, r, g, 0)];
+            for (int b = box->lo[2]; b <= box->hi[2]; b++) {
+                r_sum += row[b].sum_r;
+                g_sum += row[b].sum_g;
+                b_sum += row[b].sum_b;
+            }
+        }
+    }
+    Color avg;
+    avg.r = (uint8_t)(r_sum / box->count);
+    avg.g = (uint8_t)(g_sum / box->count);
+    avg.b = (uint8_t)(b_sum / box->count);
+    return avg;
+}
+
+// Median cut over histogram bins
+int median_cut_histogram(const ColorHistogram *hist, Color *palette, int num_colors) {
+    for (int i = 0; i < num_colors; i++) {
+        palette[i].r = palette[i].g = palette[i].b = 0;
+    }
+    if (hist->total == 0 || num_colors < 1) {
+        return 0;
+    }
+    
+    HistBox *boxes = (HistBox*)job_malloc(sizeof(HistBox) * num_colors);
+    if (!boxes) {
+        fprintf(stderr, "Error: Memory allocation failed for color boxes\n");
+        return 0;
+    }
+    
+    int max_coord = (1 << hist->bits) - 1;
+    for (int c = 0; c < 3; c++) {
+        boxes[0].lo[c] = 0;
+        boxes[0].hi[c] = max_coord;
+    }
+    shrink_box(hist, &boxes[0]);
+    int num_boxes = 1;
+    
+    // Split boxes until we have enough
+    while (num_boxes < num_colors) {
+        // Find box with largest range to split, preferring r, then g, then b
+        int best_box = -1;
+        int best_range = 0;
+        int best_axis = 0;
+        
+        for (int i = 0; i < num_boxes; i++) {
+            for (int c = 0; c < 3; c++) {
+                int range = boxes[i].hi[c] - boxes[i].lo[c];
+                if (range > best_range) {
+                    best_range = range;
+                    best_box = i;
+                    best_axis = c;
+                }
+            }
+        }
+        
+        if (best_box == -1) break; // Every box is a single bin
+        
+        // Split after the slice where the cumulative count reaches half
+        HistBox *box = &boxes[best_box];
+        uint64_t half = (box->count + 1) / 2;
+        uint64_t cumulative = 0;
+        int split = box->lo[best_axis];
+        for (int c = box->lo[best_axis]; c < box->hi[best_axis]; c++) {
+            cumulative += slice_count(hist, box, best_axis, c);
+            split = c;
+            if (cumulative >= half) break;
+        }
+        
+        HistBox *upper = &boxes[num_boxes];
+        *upper = *box;
+        upper->lo[best_axis] = split + 1;
+        box->hi[best_axis] = split;
+        shrink_box(hist, box);
+        shrink_box(hist, upper);
+        
+        num_boxes++;
+    }
+    STATS_ADD(median_cut_splits, num_boxes - 1);
+    
+    for (int i = 0; i < num_boxes; i++) {
+        palette[i] = hist_box_average(hist, &boxes[i]);
+    }
+    
+    job_free(boxes);
+    return num_boxes;
+}
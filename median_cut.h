@@ -0,0 +1,50 @@
+#ifndef MEDIAN_CUT_H
+#define MEDIAN_CUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "transform.h"
+
+// Default histogram precision in bits per channel
+#define HISTOGRAM_BITS 5
+
+// One histogram bin: pixel count and channel sums, for box averages
+typedef struct {
+    uint64_t count;
+    uint64_t sum_r;
+    uint64_t sum_g;
+    uint64_t sum_b;
+} HistogramBin;
+
+// 3D color histogram with 2^(3*bits) bins
+typedef struct {
+    int bits;             // bits per channel, 1 to 8
+    HistogramBin *bins;
+    uint64_t total;       // pixels added so far
+} ColorHistogram;
+
+// Create an empty histogram, NULL on allocation failure
+ColorHistogram* histogram_create(int bits);
+
+// Reset all bins to zero
+void histogram_clear(ColorHistogram *hist);
+
+// Add count RGB pixels
+void histogram_add_pixels(ColorHistogram *hist, const uint8_t *rgb, size_t count);
+
+// Add all bins of src into dst (same precision)
+void histogram_merge(ColorHistogram *dst, const ColorHistogram *src);
+
+void histogram_free(ColorHistogram *hist);
+
+// Total variation distance between the normalized histograms a and b (same
+// precision): the fraction of pixels that would have to change bins, from 0
+// for the same color distribution to 1 for disjoint ones
+double histogram_distance(const ColorHistogram *a, const ColorHistogram *b);
+
+// Median cut over histogram bins: boxes are split at the count median of the
+// channel with the largest range, and palette colors are the box averages.
+// Unused entries are set to black. Returns the number of boxes produced.
+int median_cut_histogram(const ColorHistogram *hist, Color *palette, int num_colors);
+
+#endif // MEDIAN_CUT_H
@@ -0,0 +1,162 @@
+#include <string.h>
+#include <pthread.h>
+#include "nearest_kernel.h"
+#include "palette_map.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// Scalar reference
+static void nearest_scalar(const Color *palette, int num_colors,
+                           const uint8_t *rgb, uint8_t *indices, int count) {
+    for (int i = 0; i < count; i++) {
+        indices[i] = nearest_color(palette, num_colors, rgb[i * 3 + 0], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// The vector kernels keep one pixel per 32-bit lane as two words: (r | g << 16)
+// and b. A 16-bit subtract of the broadcast palette entry gives (dr, dg) and
+// (db, 0), and pmaddwd squares and adds the pairs, so the squared distance
+// needs only SSE2. The argmin walks the palette in ascending order and only
+// replaces on a strictly smaller distance, which keeps the lowest index on
+// ties, as nearest_color does.
+
+// Split up to n pixels into the lane layout, padding with zeros
+static void load_lanes(const uint8_t *rgb, int n, int lanes, uint32_t *rg, uint32_t *b) {
+    for (int i = 0; i < lanes; i++) {
+        if (i < n) {
+            rg[i] = rgb[i * 3 + 0] | ((uint32_t)rgb[i * 3 + 1] << 16);
+            b[i] = rgb[i * 3 + 2];
+        } else {
+            rg[i] = b[i] = 0;
+        }
+    }
+}
+
+// 8 pixels per iteration, as two 4-lane halves
+static void nearest_sse2(const Color *palette, int num_colors,
+                         const uint8_t *rgb, uint8_t *indices, int count) {
+    __m128i pal_rg[NUM_COLORS], pal_b[NUM_COLORS];
+    for (int c = 0; c < num_colors; c++) {
+        pal_rg[c] = _mm_set1_epi32(palette[c].r | (palette[c].g << 16));
+        pal_b[c] = _mm_set1_epi32(palette[c].b);
+    }
+    
+    for (int i = 0; i < count; i += 8) {
+        int n = count - i < 8 ? count - i : 8;
+        uint32_t rg_lanes[8], b_lanes[8];
+        load_lanes(&rgb[i * 3], n, 8, rg_lanes, b_lanes);
+        
+        uint32_t result[8];
+        for (int half = 0; half < 2; half++) {
+            __m128i px_rg = _mm_loadu_si128((const __m128i*)&rg_lanes[half * 4]);
+            __m128i px_b = _mm_loadu_si128((const __m128i*)&b_lanes[half * 4]);
+            __m128i best_dist = _mm_set1_epi32(0x7FFFFFFF);
+            __m128i best_idx = _mm_setzero_si128();
+            
+            for (int c = 0; c < num_colors; c++) {
+                __m128i d_rg = _mm_sub_epi16(px_rg, pal_rg[c]);
+                __m128i d_b = _mm_sub_epi16(px_b, pal_b[c]);
+                __m128i dist = _mm_add_epi32(_mm_madd_epi16(d_rg, d_rg), _mm_madd_epi16(d_b, d_b));
+                __m128i closer = _mm_cmplt_epi32(dist, best_dist);
+                best_dist = _mm_or_si128(_mm_and_si128(closer, dist), _mm_andnot_si128(closer, best_dist));
+                best_idx = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(c)),
+                                        _mm_andnot_si128(closer, best_idx));
+            }
+            _mm_storeu_si128((__m128i*)&result[half * 4], best_idx);
+        }
+        for (int k = 0; k < n; k++) {
+            indices[i + k] = (uint8_t)result[k];
+        }
+    }
+}
+
+// 16 pixels per iteration, as two 8-lane halves
+__attribute__((target("avx2")))
+static void nearest_avx2(const Color *palette, int num_colors,
+                         const uint8_t *rgb, uint8_t *indices, int count) {
+    __m256i pal_rg[NUM_COLORS], pal_b[NUM_COLORS];
+    for (int c = 0; c < num_colors; c++) {
+        pal_rg[c] = _mm256_set1_epi32(palette[c].r | (palette[c].g << 16));
+        pal_b[c] = _mm256_set1_epi32(palette[c].b);
+    }
+    
+    for (int i = 0; i < count; i += 16) {
+        int n = count - i < 16 ? count - i : 16;
+        uint32_t rg_lanes[16], b_lanes[16];
+        load_lanes(&rgb[i * 3], n, 16, rg_lanes, b_lanes);
+        
+        uint32_t result[16];
+        for (int half = 0; half < 2; half++) {
+            __m256i px_rg = _mm256_loadu_si256((const __m256i*)&rg_lanes[half * 8]);
+            __m256i px_b = _mm256_loadu_si256((const __m256i*)&b_lanes[half * 8]);
+            __m256i best_dist = _mm256_set1_epi32(0x7FFFFFFF);
+            __m256i best_idx = _mm256_setzero_si256();
+            
+            for (int c = 0; c < num_colors; c++) {
+                __m256i d_rg = _mm256_sub_epi16(px_rg, pal_rg[c]);
+                __m256i d_b = _mm256_sub_epi16(px_b, pal_b[c]);
+                __m256i dist = _mm256_add_epi32(_mm256_madd_epi16(d_rg, d_rg), _mm256_madd_epi16(d_b, d_b));
+                __m256i closer = _mm256_cmpgt_epi32(best_dist, dist);
+                best_dist = _mm256_min_epi32(best_dist, dist);
+                best_idx = _mm256_blendv_epi8(best_idx, _mm256_set1_epi32(c), closer);
+            }
+            _mm256_storeu_si256((__m256i*)&result[half * 8], best_idx);
+        }
+        for (int k = 0; k < n; k++) {
+            indices[i + k] = (uint8_t)result[k];
+        }
+    }
+}
+
+#endif // HAVE_X86_KERNELS
+
+static NearestKernel selected_kernel = nearest_scalar;
+static const char *selected_name = "scalar";
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        selected_kernel = nearest_avx2;
+        selected_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        selected_kernel = nearest_sse2;
+        selected_name = "sse2";
+    }
+#endif
+}
+
+// Map pixels with the best available kernel
+void nearest_colors(const Color *palette, int num_colors,
+                    const uint8_t *rgb, uint8_t *indices, int count) {
+    pthread_once(&select_once, select_kernel);
+    selected_kernel(palette, num_colors, rgb, indices, count);
+}
+
+const char* nearest_colors_kernel_name(void) {
+    pthread_once(&select_once, select_kernel);
+    return selected_name;
+}
+
+// Look up a kernel by name
+NearestKernel nearest_kernel_get(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return nearest_scalar;
+    }
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        return nearest_sse2;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return nearest_avx2;
+    }
+#endif
+    return NULL;
+}
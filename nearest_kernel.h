@@ -0,0 +1,23 @@
+#ifndef NEAREST_KERNEL_H
+#define NEAREST_KERNEL_H
+
+#include <stdint.h>
+#include "transform.h"
+
+// Map count RGB pixels to the index of their nearest palette entry (up to
+// NUM_COLORS entries). Every kernel returns exactly what nearest_color
+// returns, including its tie-breaking (lowest index wins).
+typedef void (*NearestKernel)(const Color *palette, int num_colors,
+                              const uint8_t *rgb, uint8_t *indices, int count);
+
+// Map pixels with the fastest kernel this CPU supports, chosen once via cpuid
+void nearest_colors(const Color *palette, int num_colors,
+                    const uint8_t *rgb, uint8_t *indices, int count);
+
+// Name of the kernel nearest_colors uses: "avx2", "sse2" or "scalar"
+const char* nearest_colors_kernel_name(void);
+
+// Look up a kernel by name, NULL if it is unknown or the CPU lacks support
+NearestKernel nearest_kernel_get(const char *name);
+
+#endif // NEAREST_KERNEL_H
@@ -0,0 +1,184 @@
+#include <limits.h>
+#include <string.h>
+#include "palette_map.h"
+#include "nearest_kernel.h"
+
+#define CELLS_PER_CHANNEL (1 << PALETTE_MAP_BITS)
+#define CELL_SIZE (1 << (8 - PALETTE_MAP_BITS))
+
+// Find the palette entry nearest to a color (lowest index wins ties)
+int nearest_color(const Color *palette, int num_colors, uint8_t r, uint8_t g, uint8_t b) {
+    int min_dist = INT_MAX;
+    int best_color = 0;
+    
+    for (int c = 0; c < num_colors; c++) {
+        int dr = (int)r - palette[c].r;
+        int dg = (int)g - palette[c].g;
+        int db = (int)b - palette[c].b;
+        int dist = dr*dr + dg*dg + db*db;
+        
+        if (dist < min_dist) {
+            min_dist = dist;
+            best_color = c;
+        }
+    }
+    return best_color;
+}
+
+// Check that entry i is nearer than every other candidate for every color in
+// the cell, with the same tie-breaking as nearest_color. dist_i - dist_j is
+// linear in the color, so its maximum over the cell is at the corner picked
+// per channel by the sign of (c_j - c_i).
+static int wins_whole_cell(const Color *palette, int num_colors, uint16_t candidates,
+                           int i, const int *lo) {
+    const Color *ci = &palette[i];
+    int norm_i = ci->r * ci->r + ci->g * ci->g + ci->b * ci->b;
+    
+    for (int j = 0; j < num_colors; j++) {
+        if (j == i || !(candidates & (1 << j))) continue;
+        const Color *cj = &palette[j];
+        int d[3] = {cj->r - ci->r, cj->g - ci->g, cj->b - ci->b};
+        
+        // max over the cell of dist_i - dist_j = 2 p.(c_j - c_i) + |c_i|^2 - |c_j|^2
+        int max_diff = norm_i - (cj->r * cj->r + cj->g * cj->g + cj->b * cj->b);
+        for (int k = 0; k < 3; k++) {
+            int p = d[k] > 0 ? lo[k] + CELL_SIZE - 1 : lo[k];
+            max_diff += 2 * p * d[k];
+        }
+        
+        // A lower index wins ties, so it must be strictly farther everywhere
+        if (j < i ? max_diff >= 0 : max_diff > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Build the inverse colormap. The squared distance from an entry to a cell
+// is separable per channel, so the per-channel nearest and farthest terms
+// are tabulated once and each cell only sums three values per entry. An
+// entry whose nearest point in the cell is farther than some other entry's
+// farthest point can never win there and is dropped from the candidates.
+void palette_map_init(PaletteMap *map, const Color *palette, int num_colors) {
+    int near_sq[3][CELLS_PER_CHANNEL][NUM_COLORS];
+    int far_sq[3][CELLS_PER_CHANNEL][NUM_COLORS];
+    
+    memcpy(map->palette, palette, sizeof(Color) * num_colors);
+    map->num_colors = num_colors;
+    
+    for (int c = 0; c < num_colors; c++) {
+        int value[3] = {palette[c].r, palette[c].g, palette[c].b};
+        for (int k = 0; k < 3; k++) {
+            for (int v = 0; v < CELLS_PER_CHANNEL; v++) {
+                int lo = v * CELL_SIZE;
+                int hi = lo + CELL_SIZE - 1;
+                int near = value[k] < lo ? lo - value[k] : (value[k] > hi ? value[k] - hi : 0);
+                int far = value[k] - lo > hi - value[k] ? value[k] - lo : hi - value[k];
+                near_sq[k][v][c] = near * near;
+                far_sq[k][v][c] = far * far;
+            }
+        }
+    }
+    
+    int cell = 0;
+    for (int r = 0; r < CELLS_PER_CHANNEL; r++) {
+        for (int g = 0; g < CELLS_PER_CHANNEL; g++) {
+            for (int b = 0; b < CELLS_PER_CHANNEL; b++, cell++) {
+                int near[NUM_COLORS];
+                int min_far = INT_MAX;
+                for (int c = 0; c < num_colors; c++) {
+                    near[c] = near_sq[0][r][c] + near_sq[1][g][c] + near_sq[2][b][c];
+                    int far = far_sq[0][r][c] + far_sq[1][g][c] + far_sq[2][b][c];
+                    if (far < min_far) min_far = far;
+                }
+                
+                uint16_t candidates = 0;
+                int count = 0;
+                int first = 0;
+                for (int c = 0; c < num_colors; c++) {
+                    if (near[c] <= min_far) {
+                        if (count++ == 0) first = c;
+                        candidates |= 1 << c;
+                    }
+                }
+                map->candidates[cell] = candidates;
+                
+                if (count == 1) {
+                    map->table[cell] = first;
+                    continue;
+                }
+                
+                // Several candidates: one may still win everywhere. Only the
+                // entry nearest to the cell center can.
+                int lo[3] = {r * CELL_SIZE, g * CELL_SIZE, b * CELL_SIZE};
+                int center = CELL_SIZE / 2;
+                int candidate = palette_map_refine(map, cell, lo[0] + center, lo[1] + center, lo[2] + center);
+                map->table[cell] = wins_whole_cell(palette, num_colors, candidates, candidate, lo)
+                                   ? candidate : PALETTE_MAP_AMBIGUOUS;
+            }
+        }
+    }
+}
+
+// Exact search over the candidate entries of a cell
+int palette_map_refine(const PaletteMap *map, int cell, uint8_t r, uint8_t g, uint8_t b) {
+    uint16_t candidates = map->candidates[cell];
+    int min_dist = INT_MAX;
+    int best_color = 0;
+    
+    // Ascending order keeps nearest_color's tie-breaking
+    while (candidates) {
+        int c = __builtin_ctz(candidates);
+        candidates &= candidates - 1;
+        int dr = (int)r - map->palette[c].r;
+        int dg = (int)g - map->palette[c].g;
+        int db = (int)b - map->palette[c].b;
+        int dist = dr*dr + dg*dg + db*db;
+        if (dist < min_dist) {
+            min_dist = dist;
+            best_color = c;
+        }
+    }
+    return best_color;
+}
+
+// Map RGB pixels to palette indices. Pixels in ambiguous cells are gathered
+// and resolved in batches by the vector nearest-color kernel.
+void palette_map_pixels(const PaletteMap *map, const uint8_t *rgb, uint8_t *indices, int count) {
+    enum { BATCH = 64 };
+    uint8_t pending_rgb[BATCH * 3];
+    uint8_t pending_idx[BATCH];
+    int pending_pos[BATCH];
+    int pending = 0;
+    int shift = 8 - PALETTE_MAP_BITS;
+    
+    for (int i = 0; i < count; i++) {
+        uint8_t r = rgb[i * 3 + 0];
+        uint8_t g = rgb[i * 3 + 1];
+        uint8_t b = rgb[i * 3 + 2];
+        int cell = ((r >> shift) << (2 * PALETTE_MAP_BITS)) | ((g >> shift) << PALETTE_MAP_BITS) | (b >> shift);
+        int index = map->table[cell];
+        if (index != PALETTE_MAP_AMBIGUOUS) {
+            indices[i] = index;
+            continue;
+        }
+        
+        pending_rgb[pending * 3 + 0] = r;
+        pending_rgb[pending * 3 + 1] = g;
+        pending_rgb[pending * 3 + 2] = b;
+        pending_pos[pending++] = i;
+        if (pending == BATCH) {
+            nearest_colors(map->palette, map->num_colors, pending_rgb, pending_idx, pending);
+            for (int k = 0; k < pending; k++) {
+                indices[pending_pos[k]] = pending_idx[k];
+            }
+            pending = 0;
+        }
+    }
+    if (pending > 0) {
+        nearest_colors(map->palette, map->num_colors, pending_rgb, pending_idx, pending);
+        for (int k = 0; k < pending; k++) {
+            indices[pending_pos[k]] = pending_idx[k];
+        }
+    }
+}
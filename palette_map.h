@@ -0,0 +1,49 @@
+#ifndef PALETTE_MAP_H
+#define PALETTE_MAP_H
+
+#include <stdint.h>
+#include "transform.h"
+
+// Inverse colormap precision in bits per channel
+#define PALETTE_MAP_BITS 5
+#define PALETTE_MAP_SIZE (1 << (3 * PALETTE_MAP_BITS))
+
+// Table entry for cells where more than one palette entry can be nearest
+#define PALETTE_MAP_AMBIGUOUS 0xFF
+
+// Inverse colormap: for each cell of quantized RGB, the palette index that is
+// nearest to every color in the cell, or PALETTE_MAP_AMBIGUOUS when the cell
+// straddles a boundary between palette entries. Ambiguous cells keep a mask
+// of the entries that can be nearest somewhere in the cell, and only those
+// are searched exactly.
+typedef struct {
+    Color palette[NUM_COLORS];
+    int num_colors;
+    uint8_t table[PALETTE_MAP_SIZE];
+    uint16_t candidates[PALETTE_MAP_SIZE];
+} PaletteMap;
+
+// Find the palette entry nearest to a color (lowest index wins ties)
+int nearest_color(const Color *palette, int num_colors, uint8_t r, uint8_t g, uint8_t b);
+
+// Build the inverse colormap for a palette of up to NUM_COLORS entries
+void palette_map_init(PaletteMap *map, const Color *palette, int num_colors);
+
+// Exact search over the candidate entries of an ambiguous cell
+int palette_map_refine(const PaletteMap *map, int cell, uint8_t r, uint8_t g, uint8_t b);
+
+// Map one color, same result as nearest_color
+static inline int palette_map_lookup(const PaletteMap *map, uint8_t r, uint8_t g, uint8_t b) {
+    int shift = 8 - PALETTE_MAP_BITS;
+    int cell = ((r >> shift) << (2 * PALETTE_MAP_BITS)) | ((g >> shift) << PALETTE_MAP_BITS) | (b >> shift);
+    int index = map->table[cell];
+    if (index == PALETTE_MAP_AMBIGUOUS) {
+        index = palette_map_refine(map, cell, r, g, b);
+    }
+    return index;
+}
+
+// Map count RGB pixels to palette indices
+void palette_map_pixels(const PaletteMap *map, const uint8_t *rgb, uint8_t *indices, int count);
+
+#endif // PALETTE_MAP_H
@@ -1,32 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <png.h>
 #include "png_reader.h"
+#include "stats.h"
+#include "arena.h"
 
-// Read PNG from file pointer
-Image* read_png_from_fp(FILE *fp) {
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        return NULL;
-    }
+// Read callback state: the prefix is replayed before reading from the stream
+typedef struct {
+    InputSource src;
+    size_t offset; // bytes of the prefix already returned
+} PngSourceState;
 
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_read_struct(&png, NULL, NULL);
-        return NULL;
+static void png_source_read(png_structp png, png_bytep data, png_size_t length) {
+    PngSourceState *state = (PngSourceState*)png_get_io_ptr(png);
+    if (state->offset < state->src.prefix_size) {
+        size_t n = state->src.prefix_size - state->offset;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(data, state->src.prefix + state->offset, n);
+        state->offset += n;
+        data += n;
+        length -= n;
     }
-
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_read_struct(&png, &info, NULL);
-        return NULL;
+    if (length > 0 && (!state->src.fp || fread(data, 1, length, state->src.fp) != length)) {
+        png_error(png, "Read Error");
     }
+    STATS_ADD(bytes_read, length);
+}
 
-    png_init_io(png, fp);
-    png_read_info(png, info);
+// Attach an InputSource, plain files go through libpng's stdio reader.
+// state must outlive the png struct.
+static void set_source(png_structp png, const InputSource *src, PngSourceState *state) {
+    if (src->prefix_size == 0 && src->fp) {
+        png_init_io(png, src->fp);
+        return;
+    }
+    state->src = *src;
+    state->offset = 0;
+    png_set_read_fn(png, state, png_source_read);
+}
 
-    int width = png_get_image_width(png, info);
-    int height = png_get_image_height(png, info);
+// Set up libpng transforms so that rows come out as 8-bit RGB, 3 bytes per
+// pixel, with the same layout as Image data. Returns the number of interlace
+// passes, or -1 if libpng would produce a different row size.
+static int setup_transforms(png_structp png, png_infop info) {
     png_byte color_type = png_get_color_type(png, info);
     png_byte bit_depth = png_get_bit_depth(png, info);
 
@@ -37,83 +57,260 @@ Image* read_png_from_fp(FILE *fp) {
         png_set_palette_to_rgb(png);
     if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
         png_set_expand_gray_1_2_4_to_8(png);
-    if (png_get_valid(png, info, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(png);
-    if (color_type == PNG_COLOR_TYPE_RGB ||
-        color_type == PNG_COLOR_TYPE_GRAY ||
-        color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    // Alpha (including tRNS expanded by palette_to_rgb) is dropped, not
+    // composited, as before
+    png_set_strip_alpha(png);
     if (color_type == PNG_COLOR_TYPE_GRAY ||
         color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
         png_set_gray_to_rgb(png);
+    int passes = png_set_interlace_handling(png);
 
     png_read_update_info(png, info);
+    if (png_get_rowbytes(png, info) != (png_size_t)png_get_image_width(png, info) * 3) {
+        return -1;
+    }
+    return passes;
+}
 
-    png_bytep *row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-    if (!row_pointers) {
-        png_destroy_read_struct(&png, &info, NULL);
+// Read PNG from file pointer
+Image* read_png_from_fp(FILE *fp) {
+    InputSource src = { NULL, 0, fp };
+    return read_png_from_source(&src, NULL, NULL);
+}
+
+// Read PNG from an input source. libpng writes straight into img->data.
+Image* read_png_from_source(const InputSource *src, const DecodeHints *hints, DecodeInfo *info) {
+    PngSourceState state;
+    Image *volatile img = NULL;
+    png_bytep *volatile row_pointers = NULL;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
         return NULL;
     }
-    
-    for (int y = 0; y < height; y++) {
-        row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
-        if (!row_pointers[y]) {
-            // Free previously allocated rows
-            for (int i = 0; i < y; i++) {
-                free(row_pointers[i]);
-            }
-            free(row_pointers);
-            png_destroy_read_struct(&png, &info, NULL);
-            return NULL;
-        }
+
+    png_infop png_info = png_create_info_struct(png);
+    if (!png_info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return NULL;
     }
 
-    png_read_image(png, row_pointers);
+    if (setjmp(png_jmpbuf(png))) {
+        job_free(row_pointers);
+        free_image(img);
+        png_destroy_read_struct(&png, &png_info, NULL);
+        return NULL;
+    }
 
-    // Create image structure
-    Image *img = (Image*)malloc(sizeof(Image));
-    if (!img) {
-        for (int y = 0; y < height; y++) {
-            free(row_pointers[y]);
-        }
-        free(row_pointers);
-        png_destroy_read_struct(&png, &info, NULL);
+    set_source(png, src, &state);
+    png_read_info(png, png_info);
+
+    int width = png_get_image_width(png, png_info);
+    int height = png_get_image_height(png, png_info);
+    int passes = setup_transforms(png, png_info);
+    if (passes < 0) {
+        png_destroy_read_struct(&png, &png_info, NULL);
         return NULL;
     }
-    
-    img->width = width;
-    img->height = height;
-    img->data = (uint8_t*)malloc(width * height * 3);
-    if (!img->data) {
-        free(img);
+
+    int crop_x = 0, crop_y = 0, crop_w = width, crop_h = height;
+    int cropped = hints && hints->crop && hints->target_width > 0 && hints->target_height > 0 &&
+        crop_window(width, height, hints->target_width, hints->target_height,
+                    &crop_x, &crop_y, &crop_w, &crop_h);
+    if (info) {
+        info->source_width = width;
+        info->source_height = height;
+        info->scale_num = 1;
+        info->scale_denom = 1;
+        info->cropped = cropped;
+    }
+
+    // Interlaced: every pass touches every row, so libpng needs them all
+    size_t rows = passes > 1 ? height : crop_h;
+    if (check_mem_limit(hints, (size_t)width * rows * 3) != 0) {
+        png_destroy_read_struct(&png, &png_info, NULL);
+        return NULL;
+    }
+    if (passes > 1) {
+        img = create_image(width, height);
+        row_pointers = img ? (png_bytep*)job_malloc(sizeof(png_bytep) * height) : NULL;
+        if (!row_pointers) {
+            free_image(img);
+            png_destroy_read_struct(&png, &png_info, NULL);
+            return NULL;
+        }
         for (int y = 0; y < height; y++) {
-            free(row_pointers[y]);
+            row_pointers[y] = image_row(img, y);
         }
-        free(row_pointers);
-        png_destroy_read_struct(&png, &info, NULL);
+        png_read_image(png, row_pointers);
+        job_free(row_pointers);
+        img->data = image_row(img, crop_y);
+    } else {
+        // Only the rows of the crop window are kept, and decoding stops
+        // after its last row
+        img = create_image(width, crop_h);
+        if (!img) {
+            png_destroy_read_struct(&png, &png_info, NULL);
+            return NULL;
+        }
+        // Filters depend on the previous row, so skipped rows still get inflated
+        for (int y = 0; y < crop_y; y++) {
+            png_read_row(png, NULL, NULL);
+        }
+        for (int y = 0; y < crop_h; y++) {
+            png_read_row(png, image_row(img, y), NULL);
+        }
+    }
+    img->data += (size_t)crop_x * 3;
+    img->width = crop_w;
+    img->height = crop_h;
+
+    png_destroy_read_struct(&png, &png_info, NULL);
+
+    return img;
+}
+
+// Row-by-row decoder state
+typedef struct {
+    RowReader base;
+    png_structp png;
+    png_infop info;
+    PngSourceState state;
+    Image *full;    // interlaced images are decoded up front
+    int next_row;
+} PngRowReader;
+
+static int png_row_reader_read(RowReader *reader, uint8_t *rgb) {
+    PngRowReader *r = (PngRowReader*)reader;
+    if (r->next_row >= r->base.height) {
+        return -1;
+    }
+    if (r->full) {
+        memcpy(rgb, image_row(r->full, r->next_row), (size_t)r->base.width * 3);
+        r->next_row++;
+        return 0;
+    }
+    if (setjmp(png_jmpbuf(r->png))) {
+        return -1;
+    }
+    png_read_row(r->png, rgb, NULL);
+    r->next_row++;
+    return 0;
+}
+
+static int png_row_reader_skip(RowReader *reader, int count) {
+    PngRowReader *r = (PngRowReader*)reader;
+    if (r->next_row + count > r->base.height) {
+        return -1;
+    }
+    if (r->full) {
+        r->next_row += count;
+        return 0;
+    }
+    if (setjmp(png_jmpbuf(r->png))) {
+        return -1;
+    }
+    // Filters depend on the previous row, so skipped rows still get inflated
+    for (int i = 0; i < count; i++) {
+        png_read_row(r->png, NULL, NULL);
+    }
+    r->next_row += count;
+    return 0;
+}
+
+static void png_row_reader_close(RowReader *reader) {
+    PngRowReader *r = (PngRowReader*)reader;
+    png_destroy_read_struct(&r->png, &r->info, NULL);
+    free_image(r->full);
+    job_free(r);
+}
+
+// Open a row-by-row PNG decoder
+RowReader* png_open_row_reader(const InputSource *src, const DecodeHints *hints) {
+    PngRowReader *r = (PngRowReader*)job_calloc(1, sizeof(PngRowReader));
+    if (!r) {
         return NULL;
     }
 
-    // Copy to RGB format
-    for (int y = 0; y < height; y++) {
-        png_bytep row = row_pointers[y];
-        for (int x = 0; x < width; x++) {
-            png_bytep px = &(row[x * 4]);
-            int idx = (y * width + x) * 3;
-            img->data[idx + 0] = px[0]; // R
-            img->data[idx + 1] = px[1]; // G
-            img->data[idx + 2] = px[2]; // B
+    r->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!r->png) {
+        job_free(r);
+        return NULL;
+    }
+    r->info = png_create_info_struct(r->png);
+    if (!r->info) {
+        png_destroy_read_struct(&r->png, NULL, NULL);
+        job_free(r);
+        return NULL;
+    }
+
+    if (setjmp(png_jmpbuf(r->png))) {
+        png_row_reader_close(&r->base);
+        return NULL;
+    }
+
+    set_source(r->png, src, &r->state);
+    png_read_info(r->png, r->info);
+
+    r->base.width = png_get_image_width(r->png, r->info);
+    r->base.height = png_get_image_height(r->png, r->info);
+    r->base.read_row = png_row_reader_read;
+    r->base.skip_rows = png_row_reader_skip;
+    r->base.close = png_row_reader_close;
+
+    int passes = setup_transforms(r->png, r->info);
+    if (passes < 0) {
+        png_row_reader_close(&r->base);
+        return NULL;
+    }
+
+    // Interlaced images need every pass before any row is complete
+    if (passes > 1) {
+        png_bytep *rows = NULL;
+        if (check_mem_limit(hints, (size_t)r->base.width * r->base.height * 3) != 0) {
+            png_row_reader_close(&r->base);
+            return NULL;
+        }
+        r->full = create_image(r->base.width, r->base.height);
+        if (r->full) {
+            rows = (png_bytep*)job_malloc(sizeof(png_bytep) * r->base.height);
+        }
+        if (!rows) {
+            job_free(rows);
+            png_row_reader_close(&r->base);
+            return NULL;
+        }
+        for (int y = 0; y < r->base.height; y++) {
+            rows[y] = image_row(r->full, y);
         }
+        png_read_image(r->png, rows);
+        job_free(rows);
     }
+    return &r->base;
+}
 
-    // Clean up
-    for (int y = 0; y < height; y++) {
-        free(row_pointers[y]);
+int png_probe(const InputSource *src, ImageProbe *probe) {
+    PngSourceState state;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        return -1;
+    }
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return -1;
     }
-    free(row_pointers);
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return -1;
+    }
+    set_source(png, src, &state);
+    png_read_info(png, info);
+    probe->source_width = probe->width = png_get_image_width(png, info);
+    probe->source_height = probe->height = png_get_image_height(png, info);
+    probe->whole_image = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+    probe->decoder_bytes = 0;
     png_destroy_read_struct(&png, &info, NULL);
-
-    return img;
+    return 0;
 }
 
 // Read PNG file
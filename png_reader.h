@@ -7,6 +7,18 @@
 // Read PNG from file pointer
 Image* read_png_from_fp(FILE *fp);
 
+// Read PNG from an input source. With hints->crop only the crop window is
+// returned and info->cropped is set.
+Image* read_png_from_source(const InputSource *src, const DecodeHints *hints, DecodeInfo *info);
+
+// Open a row-by-row PNG decoder on an input source. hints may be NULL; only
+// its mem_limit applies.
+RowReader* png_open_row_reader(const InputSource *src, const DecodeHints *hints);
+
+// Read the header of a PNG. A stream source is consumed, so this is meant
+// for inputs that are entirely in memory. Returns 0 on success.
+int png_probe(const InputSource *src, ImageProbe *probe);
+
 // Read PNG file
 Image* read_png(const char *filename);
 
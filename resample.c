@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "resample.h"
+#include "arena.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define RESAMPLE_ONE (1 << RESAMPLE_BITS)
+#define RESAMPLE_ROUND (1 << (RESAMPLE_BITS - 1))
+
+// Compute the taps of every destination pixel along one axis. Area weights
+// are the exact overlap of the destination pixel with each source pixel;
+// bilinear uses a triangle of radius max(scale, 1) source pixels, so large
+// downscales still average every source pixel.
+static int build_taps(int src_size, int dst_size, int filter,
+                      ResampleTaps **taps_out, int16_t **weights_out, int *max_taps_out) {
+    double scale = (double)src_size / dst_size;
+    double support = filter == RESAMPLE_AREA ? 0.5 * scale : (scale > 1.0 ? scale : 1.0);
+    int max_count = 2 * (int)ceil(support) + 3;
+
+    ResampleTaps *taps = (ResampleTaps*)job_malloc(sizeof(ResampleTaps) * dst_size);
+    int16_t *weights = (int16_t*)job_malloc(sizeof(int16_t) * dst_size * max_count);
+    double *w = (double*)job_malloc(sizeof(double) * max_count);
+    int *fixed = (int*)job_malloc(sizeof(int) * max_count);
+    if (!taps || !weights || !w || !fixed) {
+        job_free(taps);
+        job_free(weights);
+        job_free(w);
+        job_free(fixed);
+        return -1;
+    }
+
+    int max_taps = 1;
+    int offset = 0;
+    for (int i = 0; i < dst_size; i++) {
+        double center = (i + 0.5) * scale;
+        int start = (int)floor(center - support);
+        int end = (int)ceil(center + support);
+        if (start < 0) start = 0;
+        if (end > src_size) end = src_size;
+        if (end - start > max_count) end = start + max_count;
+
+        double total = 0;
+        for (int j = start; j < end; j++) {
+            double weight;
+            if (filter == RESAMPLE_AREA) {
+                double lo = i * scale, hi = (i + 1) * scale;
+                weight = (j + 1 < hi ? j + 1 : hi) - (j > lo ? j : lo);
+            } else {
+                double d = fabs(j + 0.5 - center) / (scale > 1.0 ? scale : 1.0);
+                weight = 1.0 - d;
+            }
+            w[j - start] = weight > 0 ? weight : 0;
+            total += w[j - start];
+        }
+
+        int count = end - start;
+        if (total <= 0) {
+            // Cannot happen for these filters, fall back to the nearest pixel
+            int nearest = (int)center < src_size ? (int)center : src_size - 1;
+            start = nearest;
+            count = 1;
+            w[0] = total = 1;
+        }
+
+        // Round to fixed point and give the rounding error to the largest tap
+        int sum = 0, largest = 0;
+        for (int k = 0; k < count; k++) {
+            fixed[k] = (int)lrint(w[k] / total * RESAMPLE_ONE);
+            sum += fixed[k];
+            if (fixed[k] > fixed[largest]) {
+                largest = k;
+            }
+        }
+        fixed[largest] += RESAMPLE_ONE - sum;
+
+        // Drop taps that rounded to zero at either end
+        int first = 0;
+        while (first < count - 1 && fixed[first] == 0) first++;
+        while (count > first + 1 && fixed[count - 1] == 0) count--;
+
+        taps[i].start = start + first;
+        taps[i].count = count - first;
+        taps[i].offset = offset;
+        for (int k = first; k < count; k++) {
+            weights[offset++] = (int16_t)fixed[k];
+        }
+        if (taps[i].count > max_taps) {
+            max_taps = taps[i].count;
+        }
+    }
+
+    job_free(w);
+    job_free(fixed);
+    *taps_out = taps;
+    *weights_out = weights;
+    if (max_taps_out) {
+        *max_taps_out = max_taps;
+    }
+    return 0;
+}
+
+Resampler* resampler_create(int src_width, int src_height, int dst_width, int dst_height, int filter) {
+    Resampler *rs = (Resampler*)job_calloc(1, sizeof(Resampler));
+    if (!rs) {
+        fprintf(stderr, "Error: Memory allocation failed for resampler\n");
+        return NULL;
+    }
+    rs->src_width = src_width;
+    rs->src_height = src_height;
+    rs->dst_width = dst_width;
+    rs->dst_height = dst_height;
+    if (build_taps(src_width, dst_width, filter, &rs->x_taps, &rs->x_weights, NULL) != 0 ||
+        build_taps(src_height, dst_height, filter, &rs->y_taps, &rs->y_weights, &rs->max_y_taps) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed for resampler\n");
+        resampler_free(rs);
+        return NULL;
+    }
+    return rs;
+}
+
+void resampler_free(Resampler *rs) {
+    if (rs) {
+        job_free(rs->x_taps);
+        job_free(rs->x_weights);
+        job_free(rs->y_taps);
+        job_free(rs->y_weights);
+        job_free(rs);
+    }
+}
+
+static inline uint8_t clamp_pixel(int value) {
+    value >>= RESAMPLE_BITS;
+    return value < 0 ? 0 : (value > 255 ? 255 : (uint8_t)value);
+}
+
+// Scalar reference kernels
+
+static void horizontal_scalar(const ResampleTaps *taps, const int16_t *weights,
+                              const uint8_t *src, int src_width, uint8_t *dst, int dst_width) {
+    (void)src_width;
+    for (int x = 0; x < dst_width; x++) {
+        const uint8_t *p = &src[taps[x].start * 3];
+        const int16_t *w = &weights[taps[x].offset];
+        int r = RESAMPLE_ROUND, g = RESAMPLE_ROUND, b = RESAMPLE_ROUND;
+        for (int k = 0; k < taps[x].count; k++) {
+            r += w[k] * p[k * 3 + 0];
+            g += w[k] * p[k * 3 + 1];
+            b += w[k] * p[k * 3 + 2];
+        }
+        dst[x * 3 + 0] = clamp_pixel(r);
+        dst[x * 3 + 1] = clamp_pixel(g);
+        dst[x * 3 + 2] = clamp_pixel(b);
+    }
+}
+
+static void vertical_scalar(const int16_t *weights, int count,
+                            const uint8_t *const *rows, uint8_t *dst, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        int sum = RESAMPLE_ROUND;
+        for (int k = 0; k < count; k++) {
+            sum += weights[k] * rows[k][i];
+        }
+        dst[i] = clamp_pixel(sum);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// The vector kernels interleave two taps as 16-bit pairs so that pmaddwd
+// applies two weights and adds them in one instruction; an odd last tap is
+// paired with zero. Results are identical to the scalar kernels.
+
+// Byte loads: a 3-byte memcpy into a zeroed word stalls on store forwarding,
+// and a 4-byte load could run past the end of the row
+static inline __m128i load_rgb(const uint8_t *p) {
+    return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+}
+
+static inline int32_t weight_pair(int16_t w0, int16_t w1) {
+    return (int32_t)((uint16_t)w0 | ((uint32_t)(uint16_t)w1 << 16));
+}
+
+// Finish bytes [start, bytes) of a vertical pass with the scalar kernel
+static void vertical_tail(const int16_t *weights, int count, const uint8_t *const *rows,
+                          uint8_t *dst, int start, int bytes) {
+    if (start >= bytes) {
+        return;
+    }
+    const uint8_t *tail[count];
+    for (int k = 0; k < count; k++) {
+        tail[k] = rows[k] + start;
+    }
+    vertical_scalar(weights, count, tail, dst + start, bytes - start);
+}
+
+// One destination pixel per iteration, lanes hold r, g, b and padding
+static void horizontal_sse2(const ResampleTaps *taps, const int16_t *weights,
+                            const uint8_t *src, int src_width, uint8_t *dst, int dst_width) {
+    (void)src_width;
+    const __m128i zero = _mm_setzero_si128();
+    for (int x = 0; x < dst_width; x++) {
+        const uint8_t *p = &src[taps[x].start * 3];
+        const int16_t *w = &weights[taps[x].offset];
+        int count = taps[x].count;
+        __m128i acc = _mm_set1_epi32(RESAMPLE_ROUND);
+        int k = 0;
+        for (; k + 1 < count; k += 2) {
+            __m128i px = _mm_unpacklo_epi8(load_rgb(&p[k * 3]), load_rgb(&p[k * 3 + 3]));
+            px = _mm_unpacklo_epi8(px, zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w[k], w[k + 1]))));
+        }
+        if (k < count) {
+            __m128i px = _mm_unpacklo_epi8(_mm_unpacklo_epi8(load_rgb(&p[k * 3]), zero), zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w[k], 0))));
+        }
+        acc = _mm_srai_epi32(acc, RESAMPLE_BITS);
+        acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), zero);
+        uint32_t out = (uint32_t)_mm_cvtsi128_si32(acc);
+        memcpy(&dst[x * 3], &out, 3);
+    }
+}
+
+// 16 bytes per iteration
+static void vertical_sse2(const int16_t *weights, int count,
+                          const uint8_t *const *rows, uint8_t *dst, int bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i acc0 = _mm_set1_epi32(RESAMPLE_ROUND);
+        __m128i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int k = 0; k < count; k += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)&rows[k][i]);
+            __m128i b = zero;
+            int16_t w1 = 0;
+            if (k + 1 < count) {
+                b = _mm_loadu_si128((const __m128i*)&rows[k + 1][i]);
+                w1 = weights[k + 1];
+            }
+            __m128i w = _mm_set1_epi32(weight_pair(weights[k], w1));
+            __m128i lo = _mm_unpacklo_epi8(a, b);
+            __m128i hi = _mm_unpackhi_epi8(a, b);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, RESAMPLE_BITS), _mm_srai_epi32(acc1, RESAMPLE_BITS));
+        __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, RESAMPLE_BITS), _mm_srai_epi32(acc3, RESAMPLE_BITS));
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_packus_epi16(lo, hi));
+    }
+    vertical_tail(weights, count, rows, dst, i, bytes);
+}
+
+// Four taps per iteration: one 16-byte load covers pixels k..k+3, pshufb
+// spreads pixels (k, k+1) into the low lane and (k+2, k+3) into the high
+// lane in the same pair layout as the SSE2 kernel. Taps whose 16-byte load
+// would run past the end of the row go through the two-tap loop.
+__attribute__((target("avx2")))
+static void horizontal_avx2(const ResampleTaps *taps, const int16_t *weights,
+                            const uint8_t *src, int src_width, uint8_t *dst, int dst_width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m256i spread = _mm256_setr_epi8(
+        0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1,
+        6, -1, 9, -1, 7, -1, 10, -1, 8, -1, 11, -1, -1, -1, -1, -1);
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    int safe_end = src_width - 6; // last pixel a 16-byte load may start at
+
+    for (int x = 0; x < dst_width; x++) {
+        const uint8_t *p = &src[taps[x].start * 3];
+        const int16_t *w = &weights[taps[x].offset];
+        int count = taps[x].count;
+        int k = 0;
+        __m256i acc4 = _mm256_setzero_si256();
+        for (; k + 4 <= count && taps[x].start + k <= safe_end; k += 4) {
+            __m256i px = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&p[k * 3]));
+            px = _mm256_shuffle_epi8(px, spread);
+            __m256i wk = _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i*)&w[k]));
+            wk = _mm256_permutevar8x32_epi32(wk, pair_index);
+            acc4 = _mm256_add_epi32(acc4, _mm256_madd_epi16(px, wk));
+        }
+        __m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc4), _mm256_extracti128_si256(acc4, 1));
+        acc = _mm_add_epi32(acc, _mm_set1_epi32(RESAMPLE_ROUND));
+        for (; k + 1 < count; k += 2) {
+            __m128i px = _mm_unpacklo_epi8(load_rgb(&p[k * 3]), load_rgb(&p[k * 3 + 3]));
+            px = _mm_unpacklo_epi8(px, zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w[k], w[k + 1]))));
+        }
+        if (k < count) {
+            __m128i px = _mm_unpacklo_epi8(_mm_unpacklo_epi8(load_rgb(&p[k * 3]), zero), zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w[k], 0))));
+        }
+        acc = _mm_srai_epi32(acc, RESAMPLE_BITS);
+        acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), zero);
+        uint32_t out = (uint32_t)_mm_cvtsi128_si32(acc);
+        memcpy(&dst[x * 3], &out, 3);
+    }
+}
+
+// 32 bytes per iteration. Unpacks and packs both work within 128-bit lanes,
+// so the bytes come back out in their original order.
+__attribute__((target("avx2")))
+static void vertical_avx2(const int16_t *weights, int count,
+                          const uint8_t *const *rows, uint8_t *dst, int bytes) {
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i acc0 = _mm256_set1_epi32(RESAMPLE_ROUND);
+        __m256i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int k = 0; k < count; k += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)&rows[k][i]);
+            __m256i b = zero;
+            int16_t w1 = 0;
+            if (k + 1 < count) {
+                b = _mm256_loadu_si256((const __m256i*)&rows[k + 1][i]);
+                w1 = weights[k + 1];
+            }
+            __m256i w = _mm256_set1_epi32(weight_pair(weights[k], w1));
+            __m256i lo = _mm256_unpacklo_epi8(a, b);
+            __m256i hi = _mm256_unpackhi_epi8(a, b);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+        }
+        __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(acc0, RESAMPLE_BITS),
+                                        _mm256_srai_epi32(acc1, RESAMPLE_BITS));
+        __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(acc2, RESAMPLE_BITS),
+                                        _mm256_srai_epi32(acc3, RESAMPLE_BITS));
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_packus_epi16(lo, hi));
+    }
+    vertical_tail(weights, count, rows, dst, i, bytes);
+}
+
+#endif // HAVE_X86_KERNELS
+
+static HorizontalKernel selected_horizontal = horizontal_scalar;
+static VerticalKernel selected_vertical = vertical_scalar;
+static const char *selected_name = "scalar";
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        selected_horizontal = horizontal_sse2;
+        selected_vertical = vertical_sse2;
+        selected_name = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        selected_horizontal = horizontal_avx2;
+        selected_vertical = vertical_avx2;
+        selected_name = "avx2";
+    }
+#endif
+}
+
+const char* resample_kernel_name(void) {
+    pthread_once(&select_once, select_kernels);
+    return selected_name;
+}
+
+int resample_kernels_get(const char *name, HorizontalKernel *horizontal, VerticalKernel *vertical) {
+    if (strcmp(name, "scalar") == 0) {
+        *horizontal = horizontal_scalar;
+        *vertical = vertical_scalar;
+        return 0;
+    }
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        *horizontal = horizontal_sse2;
+        *vertical = vertical_sse2;
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        *horizontal = horizontal_avx2;
+        *vertical = vertical_avx2;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void resample_row_horizontal(const Resampler *rs, const uint8_t *src, uint8_t *dst) {
+    pthread_once(&select_once, select_kernels);
+    selected_horizontal(rs->x_taps, rs->x_weights, src, rs->src_width, dst, rs->dst_width);
+}
+
+void resample_row_vertical(const Resampler *rs, int y, const uint8_t *const *rows, uint8_t *dst) {
+    pthread_once(&select_once, select_kernels);
+    const ResampleTaps *t = &rs->y_taps[y];
+    selected_vertical(&rs->y_weights[t->offset], t->count, rows, dst, rs->dst_width * 3);
+}
+
+int resample_rows(const Resampler *rs, const Image *src, Image *dst, int y_start, int y_end) {
+    int ring_size = rs->max_y_taps;
+    int row_bytes = rs->dst_width * 3;
+    uint8_t *ring = (uint8_t*)job_malloc((size_t)ring_size * row_bytes);
+    const uint8_t **rows = (const uint8_t**)job_malloc(sizeof(uint8_t*) * ring_size);
+    if (!ring || !rows) {
+        fprintf(stderr, "Error: Memory allocation failed for resample rows\n");
+        job_free(ring);
+        job_free(rows);
+        return -1;
+    }
+
+    // Source rows [first needed, next_row) are held in the ring, each at
+    // slot row % ring_size; the taps only move forward
+    int next_row = 0;
+    for (int y = y_start; y < y_end; y++) {
+        const ResampleTaps *t = &rs->y_taps[y];
+        if (next_row < t->start) {
+            next_row = t->start;
+        }
+        for (; next_row < t->start + t->count; next_row++) {
+            resample_row_horizontal(rs, image_row(src, next_row),
+                                    &ring[(size_t)(next_row % ring_size) * row_bytes]);
+        }
+        for (int k = 0; k < t->count; k++) {
+            rows[k] = &ring[(size_t)((t->start + k) % ring_size) * row_bytes];
+        }
+        resample_row_vertical(rs, y, rows, image_row(dst, y));
+    }
+
+    job_free(ring);
+    job_free(rows);
+    return 0;
+}
+
+Image* resample_image(const Image *src, int dst_width, int dst_height, int filter) {
+    Resampler *rs = resampler_create(src->width, src->height, dst_width, dst_height, filter);
+    if (!rs) {
+        return NULL;
+    }
+    Image *dst = create_image(dst_width, dst_height);
+    if (!dst || resample_rows(rs, src, dst, 0, dst_height) != 0) {
+        free_image(dst);
+        resampler_free(rs);
+        return NULL;
+    }
+    resampler_free(rs);
+    return dst;
+}
@@ -0,0 +1,73 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+#include "image.h"
+
+// Resampling filters (ConvertOptions.resample)
+typedef enum {
+    RESAMPLE_NEAREST = 0, // resize_image, the reference behaviour
+    RESAMPLE_AREA,        // box filter weighted by exact source coverage
+    RESAMPLE_BILINEAR     // triangle filter, widened when downscaling
+} ResampleFilter;
+
+// Coefficients are fixed point with this many fractional bits and sum to
+// exactly 1 << RESAMPLE_BITS for every destination pixel
+#define RESAMPLE_BITS 14
+
+// Filter taps of one destination column or row
+typedef struct {
+    int start;  // first source pixel
+    int count;  // number of source pixels
+    int offset; // index of the first weight in the coefficient array
+} ResampleTaps;
+
+// Precomputed separable filter for one source and destination size.
+// Read-only after creation, so it can be shared between threads.
+typedef struct {
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    ResampleTaps *x_taps; // one per destination column
+    int16_t *x_weights;
+    ResampleTaps *y_taps; // one per destination row
+    int16_t *y_weights;
+    int max_y_taps;       // rows the vertical pass needs at once
+} Resampler;
+
+// Horizontal kernel: filter one RGB row of src_width pixels into dst_width pixels
+typedef void (*HorizontalKernel)(const ResampleTaps *taps, const int16_t *weights,
+                                 const uint8_t *src, int src_width, uint8_t *dst, int dst_width);
+
+// Vertical kernel: weighted sum of count rows, bytes wide
+typedef void (*VerticalKernel)(const int16_t *weights, int count,
+                               const uint8_t *const *rows, uint8_t *dst, int bytes);
+
+// Build the coefficient tables for a ResampleFilter other than RESAMPLE_NEAREST
+Resampler* resampler_create(int src_width, int src_height, int dst_width, int dst_height, int filter);
+
+void resampler_free(Resampler *rs);
+
+// Horizontal pass: one source row (src_width RGB pixels) to dst_width pixels
+void resample_row_horizontal(const Resampler *rs, const uint8_t *src, uint8_t *dst);
+
+// Vertical pass for destination row y. rows holds the y_taps[y].count
+// horizontally filtered rows starting at source row y_taps[y].start.
+void resample_row_vertical(const Resampler *rs, int y, const uint8_t *const *rows, uint8_t *dst);
+
+// Resample destination rows [y_start, y_end) of dst from src, keeping only a
+// ring of max_y_taps horizontally filtered rows. Returns 0 on success.
+int resample_rows(const Resampler *rs, const Image *src, Image *dst, int y_start, int y_end);
+
+// Resample a whole image, NULL on failure
+Image* resample_image(const Image *src, int dst_width, int dst_height, int filter);
+
+// Name of the kernels picked for this CPU
+const char* resample_kernel_name(void);
+
+// Look up the kernels by name ("scalar", "sse2", "avx2"), returns 0 if the
+// CPU supports them
+int resample_kernels_get(const char *name, HorizontalKernel *horizontal, VerticalKernel *vertical);
+
+#endif // RESAMPLE_H
@@ -0,0 +1,623 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "server.h"
+#include "threadpool.h"
+#include "resample.h"
+#include "dither.h"
+
+// Connections without a request in flight are closed after this long
+#define IDLE_TIMEOUT_SEC 30
+
+// A request that stalls halfway is dropped after this long, so a slow
+// client holds a worker, and shutdown waits for it, no longer than that
+#define REQUEST_TIMEOUT_SEC 5
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+// Read exactly n bytes, -1 on error or end of stream
+static int read_full(int fd, void *buf, size_t n) {
+    uint8_t *p = (uint8_t*)buf;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n) {
+    const uint8_t *p = (const uint8_t*)buf;
+    while (n > 0) {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return -1;
+        }
+        p += put;
+        n -= put;
+    }
+    return 0;
+}
+
+// Read a length-prefixed field into a new buffer, NUL-terminated so paths
+// can be used directly. Returns 0 on success.
+static int read_field(int fd, uint32_t max_len, uint8_t **data, uint32_t *len) {
+    uint8_t word[4];
+    *data = NULL;
+    if (read_full(fd, word, 4) != 0) {
+        return -1;
+    }
+    *len = get_u32(word);
+    if (*len > max_len) {
+        return -1;
+    }
+    *data = (uint8_t*)malloc(*len + 1);
+    if (!*data || read_full(fd, *data, *len) != 0) {
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+    (*data)[*len] = '\0';
+    return 0;
+}
+
+static int send_response(int fd, uint32_t status, const void *body, size_t length) {
+    uint8_t header[12];
+    put_u32(header, SERVE_RESPONSE_MAGIC);
+    put_u32(header + 4, status);
+    put_u32(header + 8, (uint32_t)length);
+    if (write_full(fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    return length > 0 ? write_full(fd, body, length) : 0;
+}
+
+static int send_error(int fd, const char *message) {
+    return send_response(fd, 1, message, strlen(message));
+}
+
+// Handle one request. Returns 0 to keep the connection open.
+static int handle_request(int fd, const ConvertOptions *defaults) {
+    uint8_t header[16];
+    if (read_full(fd, header, sizeof(header)) != 0 || get_u32(header) != SERVE_REQUEST_MAGIC) {
+        return -1;
+    }
+    uint32_t flags = get_u32(header + 4);
+    uint32_t palette = get_u32(header + 8);
+    uint32_t resample = get_u32(header + 12);
+
+    uint8_t *input = NULL, *output = NULL;
+    uint32_t input_len, output_len;
+    uint32_t max_input = (flags & SERVE_INPUT_PATH) ? SERVE_MAX_PATH : SERVE_MAX_INPUT;
+    if (read_field(fd, max_input, &input, &input_len) != 0 ||
+        read_field(fd, SERVE_MAX_PATH, &output, &output_len) != 0) {
+        // The stream is out of sync, drop the connection
+        free(input);
+        return -1;
+    }
+
+    if (palette > PALETTE_HISTOGRAM || resample > RESAMPLE_BILINEAR) {
+        free(input);
+        free(output);
+        return send_error(fd, "invalid options");
+    }
+
+    // A request runs on one worker thread; parallelism comes from serving
+    // several connections at once
+    ConvertOptions opts = *defaults;
+    opts.crop_mode = (flags & SERVE_CROP) != 0;
+    opts.scaled_decode = (flags & SERVE_SCALED) != 0;
+    opts.streaming = (flags & SERVE_STREAMING) != 0;
+    opts.rle = (flags & SERVE_RLE) != 0;
+    if (flags & SERVE_FS) {
+        opts.dither = DITHER_FS;
+    } else if (flags & SERVE_ORDERED) {
+        opts.dither = DITHER_ORDERED;
+    } else {
+        opts.dither = DITHER_NONE;
+    }
+    opts.optimize_palette = palette;
+    opts.resample = resample;
+    opts.threads = 0;
+
+    ConvertIO io = {NULL, NULL, 0, NULL, NULL};
+    if (flags & SERVE_INPUT_PATH) {
+        io.input_file = (const char*)input;
+    } else {
+        io.data = input;
+        io.size = input_len;
+    }
+
+    char *bmp = NULL;
+    size_t bmp_size = 0;
+    if (output_len > 0) {
+        io.output_file = (const char*)output;
+    } else {
+        io.out = open_memstream(&bmp, &bmp_size);
+        if (!io.out) {
+            free(input);
+            free(output);
+            return send_error(fd, "out of memory");
+        }
+    }
+
+    int result = convert_io(&io, &opts);
+    if (io.out) {
+        fclose(io.out);
+    }
+
+    int sent;
+    if (result != 0) {
+        sent = send_error(fd, "conversion failed");
+    } else {
+        sent = send_response(fd, 0, bmp, bmp_size);
+    }
+    free(bmp);
+    free(input);
+    free(output);
+    return sent;
+}
+
+typedef struct Server Server;
+
+// An open client connection. Between requests it waits in the epoll set
+// without a worker; each readable request is one pool task.
+typedef struct Connection {
+    int fd;
+    int busy;               // a request is queued or running
+    time_t last_active;     // end of the last request, for the idle timeout
+    Server *server;
+    struct Connection *prev, *next;
+} Connection;
+
+struct Server {
+    int epoll_fd;
+    const ConvertOptions *defaults;
+    pthread_mutex_t lock;   // protects the connection list and busy flags
+    Connection *connections;
+};
+
+static time_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Unlink conn from the list, the caller holds server->lock
+static void unlink_connection(Server *server, Connection *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        server->connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+}
+
+static void close_connection(Connection *conn) {
+    Server *server = conn->server;
+    pthread_mutex_lock(&server->lock);
+    unlink_connection(server, conn);
+    pthread_mutex_unlock(&server->lock);
+    close(conn->fd);
+    free(conn);
+}
+
+// Wait for the next request on conn (one-shot, so only one worker ever
+// reads from a connection), -1 on error
+static int arm_connection(Connection *conn, int op) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    return epoll_ctl(conn->server->epoll_fd, op, conn->fd, &event);
+}
+
+// Pool task: serve the one request that made conn readable, then hand the
+// connection back to the epoll set
+static void serve_request(void *arg) {
+    Connection *conn = (Connection*)arg;
+    Server *server = conn->server;
+    if (stop_requested || handle_request(conn->fd, server->defaults) != 0) {
+        close_connection(conn);
+        return;
+    }
+    pthread_mutex_lock(&server->lock);
+    conn->busy = 0;
+    conn->last_active = now_seconds();
+    pthread_mutex_unlock(&server->lock);
+    if (arm_connection(conn, EPOLL_CTL_MOD) != 0) {
+        close_connection(conn);
+    }
+}
+
+// Close connections that have been idle for IDLE_TIMEOUT_SEC, or every idle
+// one with all set. Runs on the accepting thread, which owns the epoll set.
+static void close_idle_connections(Server *server, int all) {
+    time_t now = now_seconds();
+    pthread_mutex_lock(&server->lock);
+    Connection *conn = server->connections;
+    while (conn) {
+        Connection *next = conn->next;
+        if (!conn->busy && (all || now - conn->last_active >= IDLE_TIMEOUT_SEC)) {
+            unlink_connection(server, conn);
+            epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+            close(conn->fd);
+            free(conn);
+        }
+        conn = next;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void accept_connection(Server *server, int fd) {
+    struct timeval timeout = {REQUEST_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    Connection *conn = (Connection*)calloc(1, sizeof(Connection));
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->server = server;
+    conn->last_active = now_seconds();
+    pthread_mutex_lock(&server->lock);
+    conn->next = server->connections;
+    if (conn->next) {
+        conn->next->prev = conn;
+    }
+    server->connections = conn;
+    pthread_mutex_unlock(&server->lock);
+    if (arm_connection(conn, EPOLL_CTL_ADD) != 0) {
+        close_connection(conn);
+    }
+}
+
+int serve(const char *socket_path, int num_threads, const ConvertOptions *defaults) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // Non-blocking, so a connection that goes away before accept cannot
+    // stall the loop
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Error: Cannot create socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Replace a stale socket left by a previous server, but nothing else
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (live) {
+            fprintf(stderr, "Error: A server is already running on %s\n", socket_path);
+            close(listen_fd);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+    // Only the owner may connect: requests can name files to read and write
+    mode_t old_mask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound != 0 || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts accept
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers inherit the stop signals blocked, so the signals always reach
+    // the accepting thread
+    sigset_t stop_signals, old_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_signals);
+    ThreadPool *pool = pool_create(num_threads);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.defaults = defaults;
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_mutex_init(&server.lock, NULL);
+    if (!pool || server.epoll_fd < 0) {
+        fprintf(stderr, "Error: Cannot create thread pool or epoll set\n");
+        pool_destroy(pool);
+        if (server.epoll_fd >= 0) {
+            close(server.epoll_fd);
+        }
+        pthread_mutex_destroy(&server.lock);
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+    fprintf(stderr, "Serving on %s with %d threads\n", socket_path, num_threads);
+
+    // The accepting thread waits for new connections and for requests on
+    // the open ones; a worker only serves one request at a time, so idle
+    // connections hold no worker
+    int result = 0;
+    int listen_token = 0; // epoll data of listen_fd, told apart by address
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &listen_token;
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+        fprintf(stderr, "Error: Cannot watch %s: %s\n", socket_path, strerror(errno));
+        stop_requested = 1;
+        result = 1;
+    }
+    time_t last_sweep = now_seconds();
+    while (!stop_requested) {
+        struct epoll_event events[64];
+        int count = epoll_wait(server.epoll_fd, events, 64, 1000);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: epoll_wait failed: %s\n", strerror(errno));
+            result = 1;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &listen_token) {
+                int fd = accept(listen_fd, NULL, NULL);
+                if (fd >= 0) {
+                    accept_connection(&server, fd);
+                } else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                    fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+                }
+                continue;
+            }
+            Connection *conn = (Connection*)events[i].data.ptr;
+            pthread_mutex_lock(&server.lock);
+            conn->busy = 1;
+            pthread_mutex_unlock(&server.lock);
+            if (pool_submit(pool, serve_request, conn) != 0) {
+                close_connection(conn);
+            }
+        }
+        if (now_seconds() != last_sweep) {
+            close_idle_connections(&server, 0);
+            last_sweep = now_seconds();
+        }
+    }
+
+    // Stop accepting, let the queued and running requests finish, then close
+    // the connections left waiting
+    close(listen_fd);
+    unlink(socket_path);
+    pool_destroy(pool);
+    close_idle_connections(&server, 1);
+    close(server.epoll_fd);
+    pthread_mutex_destroy(&server.lock);
+    fprintf(stderr, "Server stopped\n");
+    return result;
+}
+
+// Read a whole stream into memory, NULL on failure
+static uint8_t* read_stream(FILE *fp, size_t *size) {
+    size_t capacity = 1 << 16;
+    uint8_t *data = (uint8_t*)malloc(capacity);
+    *size = 0;
+    while (data) {
+        *size += fread(data + *size, 1, capacity - *size, fp);
+        if (*size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        uint8_t *grown = (uint8_t*)realloc(data, capacity);
+        if (!grown) {
+            free(data);
+            return NULL;
+        }
+        data = grown;
+    }
+    if (data && ferror(fp)) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Absolute form of a path for the server, which has its own working directory
+static char* absolute_path(const char *path) {
+    if (path[0] == '/') {
+        return strdup(path);
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return NULL;
+    }
+    size_t len = strlen(cwd) + strlen(path) + 2;
+    char *full = (char*)malloc(len);
+    if (full) {
+        snprintf(full, len, "%s/%s", cwd, path);
+    }
+    return full;
+}
+
+static int send_field(int fd, const void *data, size_t len) {
+    uint8_t word[4];
+    put_u32(word, (uint32_t)len);
+    if (write_full(fd, word, 4) != 0) {
+        return -1;
+    }
+    return len > 0 ? write_full(fd, data, len) : 0;
+}
+
+int client_convert(const char *socket_path, const char *input_file, const char *output_file,
+                   int by_path, const ConvertOptions *opts) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // Request body: the file names, or the input data
+    uint8_t *input = NULL;
+    size_t input_len = 0;
+    char *output_path = NULL;
+    if (by_path) {
+        if (!input_file) {
+            fprintf(stderr, "Error: --by-path needs an input file\n");
+            return 1;
+        }
+        input = (uint8_t*)absolute_path(input_file);
+        output_path = output_file ? absolute_path(output_file) : NULL;
+        if (!input || (output_file && !output_path)) {
+            fprintf(stderr, "Error: Cannot resolve file names\n");
+            free(input);
+            free(output_path);
+            return 1;
+        }
+        input_len = strlen((char*)input);
+    } else {
+        FILE *fp = input_file ? fopen(input_file, "rb") : stdin;
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot open file %s\n", input_file);
+            return 1;
+        }
+        input = read_stream(fp, &input_len);
+        if (input_file) {
+            fclose(fp);
+        }
+        if (!input) {
+            fprintf(stderr, "Error: Cannot read input\n");
+            return 1;
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Cannot connect to %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(input);
+        free(output_path);
+        return 1;
+    }
+
+    uint8_t header[16];
+    put_u32(header, SERVE_REQUEST_MAGIC);
+    put_u32(header + 4, (opts->crop_mode ? SERVE_CROP : 0) |
+                        (opts->scaled_decode ? SERVE_SCALED : 0) |
+                        (opts->streaming ? SERVE_STREAMING : 0) |
+                        (opts->rle ? SERVE_RLE : 0) |
+                        (opts->dither == DITHER_ORDERED ? SERVE_ORDERED : 0) |
+                        (opts->dither == DITHER_FS ? SERVE_FS : 0) |
+                        (by_path ? SERVE_INPUT_PATH : 0));
+    put_u32(header + 8, opts->optimize_palette);
+    put_u32(header + 12, opts->resample);
+    int sent = write_full(fd, header, sizeof(header)) == 0 &&
+               send_field(fd, input, input_len) == 0 &&
+               send_field(fd, output_path, output_path ? strlen(output_path) : 0) == 0;
+    free(input);
+    free(output_path);
+
+    uint8_t reply[12];
+    if (!sent || read_full(fd, reply, sizeof(reply)) != 0 || get_u32(reply) != SERVE_RESPONSE_MAGIC) {
+        fprintf(stderr, "Error: No valid response from %s\n", socket_path);
+        close(fd);
+        return 1;
+    }
+    uint32_t status = get_u32(reply + 4);
+    uint32_t length = get_u32(reply + 8);
+    uint8_t *body = (uint8_t*)malloc(length + 1);
+    if (!body || read_full(fd, body, length) != 0) {
+        fprintf(stderr, "Error: Truncated response from %s\n", socket_path);
+        free(body);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (status != 0) {
+        body[length] = '\0';
+        fprintf(stderr, "Error: Server: %s\n", (char*)body);
+        free(body);
+        return 1;
+    }
+
+    int result = 0;
+    if (length > 0) {
+        FILE *out = output_file ? fopen(output_file, "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "Error: Cannot open output file %s\n", output_file);
+            result = 1;
+        } else {
+            if (fwrite(body, 1, length, out) != length) {
+                result = 1;
+            }
+            if (output_file) {
+                fclose(out);
+            } else {
+                fflush(out);
+            }
+        }
+    }
+    free(body);
+    return result;
+}
@@ -0,0 +1,55 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include "transform.h"
+
+// Daemon mode: one long-lived process serves conversions over a Unix domain
+// socket, so decoders, lookup tables and worker threads stay warm between
+// requests. A connection carries any number of requests, one at a time;
+// each request is served by whichever worker is free, and a connection
+// waiting for its next request holds no worker.
+//
+// Request, all integers little-endian uint32:
+//   magic       SERVE_REQUEST_MAGIC
+//   flags       SERVE_* flags below
+//   palette     PaletteMethod
+//   resample    ResampleFilter
+//   input_len   followed by input_len bytes: the encoded image, or with
+//               SERVE_INPUT_PATH a file name for the server to open
+//   output_len  followed by output_len bytes: a file name for the server to
+//               write, or 0 to get the BMP back in the response
+//
+// Response:
+//   magic       SERVE_RESPONSE_MAGIC
+//   status      0 on success
+//   length      followed by length bytes: the BMP (empty when it was written
+//               to a file), or an error message when status is not 0
+#define SERVE_REQUEST_MAGIC  0x51525449 // "ITRQ"
+#define SERVE_RESPONSE_MAGIC 0x53525449 // "ITRS"
+
+#define SERVE_CROP       1 // -c
+#define SERVE_SCALED     2 // -s
+#define SERVE_STREAMING  4 // -S
+#define SERVE_INPUT_PATH 8 // input bytes are a file name
+#define SERVE_RLE        16 // --rle
+#define SERVE_ORDERED    32 // -d ordered
+#define SERVE_FS         64 // -d fs
+
+// Largest accepted input and path
+#define SERVE_MAX_INPUT (256u << 20)
+#define SERVE_MAX_PATH  4096
+
+// Serve on socket_path with num_threads request workers until SIGINT or
+// SIGTERM. defaults supplies the options a request cannot set (--stats,
+// --cache, -v). Returns 0 after a clean shutdown.
+int serve(const char *socket_path, int num_threads, const ConvertOptions *defaults);
+
+// Send one conversion with the options in opts to a server and write the BMP
+// to output_file (stdout when NULL). input_file NULL sends stdin. With
+// by_path, the server opens the input and creates the output itself.
+// Returns 0 on success.
+int client_convert(const char *socket_path, const char *input_file, const char *output_file,
+                   int by_path, const ConvertOptions *opts);
+
+#endif // SERVER_H
@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+#if STATS_ENABLED
+
+__thread ConvertStats *current_stats;
+
+#if STATS_COUNT_ALLOCS
+
+// Allocation counters (make STATS_ALLOCS=1, glibc only): the allocation
+// functions are interposed for the whole process, so allocations inside
+// libpng and libjpeg count too. Only the thread running a conversion is
+// charged; band workers are not.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static inline void count_alloc(size_t size) {
+    ConvertStats *stats = current_stats;
+    if (stats) {
+        stats->allocs++;
+        stats->alloc_bytes += size;
+    }
+}
+
+void *malloc(size_t size) {
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_alloc(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *p = memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+#endif // STATS_COUNT_ALLOCS
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void stats_begin(ConvertStats *stats, const char *input) {
+    memset(stats, 0, sizeof(*stats));
+    stats->input = input;
+    stats->format = FORMAT_UNKNOWN;
+    stats->start_ms = now_ms();
+    current_stats = stats;
+}
+
+void stats_end(ConvertStats *stats) {
+    current_stats = NULL;
+    stats->total_ms = now_ms() - stats->start_ms;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        stats->process_peak_rss_kb = usage.ru_maxrss;
+    }
+}
+
+// Charge the time since the last stage change to the innermost stage
+static void charge_stage(ConvertStats *stats, double now) {
+    if (stats->depth > 0 && stats->depth <= STATS_MAX_DEPTH) {
+        stats->stage_ms[stats->stack[stats->depth - 1]] += now - stats->stage_start_ms;
+    }
+    stats->stage_start_ms = now;
+}
+
+void stats_stage_begin(StatsStage stage) {
+    ConvertStats *stats = current_stats;
+    if (!stats) {
+        return;
+    }
+    charge_stage(stats, now_ms());
+    if (stats->depth < STATS_MAX_DEPTH) {
+        stats->stack[stats->depth] = stage;
+    }
+    stats->depth++;
+}
+
+void stats_stage_end(void) {
+    ConvertStats *stats = current_stats;
+    if (!stats || stats->depth == 0) {
+        return;
+    }
+    charge_stage(stats, now_ms());
+    stats->depth--;
+}
+
+// Append s as a JSON string, returns the new length
+static size_t json_string(char *buf, size_t size, size_t len, const char *s) {
+    len += snprintf(buf + len, len < size ? size - len : 0, "\"");
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            len += snprintf(buf + len, len < size ? size - len : 0, "\\%c", c);
+        } else if (c < 0x20) {
+            len += snprintf(buf + len, len < size ? size - len : 0, "\\u%04x", c);
+        } else {
+            len += snprintf(buf + len, len < size ? size - len : 0, "%c", c);
+        }
+    }
+    return len + snprintf(buf + len, len < size ? size - len : 0, "\"");
+}
+
+void stats_write_json(const ConvertStats *stats, int result, FILE *out) {
+    static const char *stage_names[NUM_STAGES] = {
+        "decode", "crop", "resize", "palette", "map", "write"
+    };
+    static const char *format_names[] = {"unknown", "png", "jpeg"};
+    static const char *pipeline_names[] = {"whole", "streaming", "bands"};
+    char buf[8192];
+    size_t len = snprintf(buf, sizeof(buf), "{\"input\":");
+    if (stats->input) {
+        len = json_string(buf, sizeof(buf), len, stats->input);
+    } else {
+        len += snprintf(buf + len, len < sizeof(buf) ? sizeof(buf) - len : 0, "null");
+    }
+    if (len < sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        ",\"ok\":%s,\"format\":\"%s\",\"source_width\":%d,\"source_height\":%d",
+                        result == 0 ? "true" : "false", format_names[stats->format],
+                        stats->source_width, stats->source_height);
+    }
+    if (len < sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len, ",\"pipeline\":\"%s\",\"fused\":%s",
+                        pipeline_names[stats->pipeline], stats->fused ? "true" : "false");
+    }
+    for (int i = 0; i < NUM_STAGES && len < sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, ",\"%s_ms\":%.3f", stage_names[i], stats->stage_ms[i]);
+    }
+    if (len < sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        ",\"total_ms\":%.3f,\"bytes_read\":%llu,\"bytes_written\":%llu"
+                        ",\"process_peak_rss_kb\":%ld",
+                        stats->total_ms, stats->bytes_read, stats->bytes_written,
+                        stats->process_peak_rss_kb);
+    }
+    if (len < sizeof(buf)) {
+#if STATS_COUNT_ALLOCS
+        len += snprintf(buf + len, sizeof(buf) - len, ",\"allocs\":%lu,\"alloc_bytes\":%llu",
+                        stats->allocs, stats->alloc_bytes);
+#else
+        len += snprintf(buf + len, sizeof(buf) - len, ",\"allocs\":null,\"alloc_bytes\":null");
+#endif
+    }
+    if (len < sizeof(buf)) {
+        snprintf(buf + len, sizeof(buf) - len,
+                 ",\"arena_peak_bytes\":%llu,\"median_cut_splits\":%d"
+                 ",\"cache_hits\":%d,\"cache_misses\":%d"
+                 ",\"palette_cache_hits\":%d,\"palette_cache_misses\":%d}\n",
+                 stats->arena_peak_bytes, stats->median_cut_splits,
+                 stats->cache_hits, stats->cache_misses,
+                 stats->palette_cache_hits, stats->palette_cache_misses);
+    }
+    fputs(buf, out);
+    fflush(out);
+}
+
+#endif // STATS_ENABLED
@@ -0,0 +1,102 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "image.h"
+
+// Per-image instrumentation behind --stats. Build with "make STATS=0" to
+// compile every hook out; the macros below then expand to nothing.
+#ifndef STATS_ENABLED
+#define STATS_ENABLED 1
+#endif
+
+// "make STATS_ALLOCS=1" also interposes malloc and friends to count the
+// allocations of each conversion (glibc only). Off by default.
+#ifndef STATS_COUNT_ALLOCS
+#define STATS_COUNT_ALLOCS 0
+#endif
+
+// Pipeline stages with their own wall time
+typedef enum {
+    STAGE_DECODE = 0,
+    STAGE_CROP,
+    STAGE_RESIZE,
+    STAGE_PALETTE,
+    STAGE_MAP,
+    STAGE_WRITE,
+    NUM_STAGES
+} StatsStage;
+
+// How the stages of a conversion ran
+typedef enum {
+    PIPELINE_WHOLE = 0, // one stage after another over the whole image
+    PIPELINE_STREAMING, // -S: one pass over the rows, each row's work charged
+                        // to its own stage
+    PIPELINE_BANDS      // -j: resize and map in parallel bands
+} StatsPipeline;
+
+#define STATS_MAX_DEPTH 8
+
+// Measurements of one conversion
+typedef struct {
+    const char *input;           // NULL for stdin
+    ImageFormat format;
+    int source_width;
+    int source_height;
+    double stage_ms[NUM_STAGES]; // exclusive: a nested stage pauses the outer one
+    StatsPipeline pipeline;
+    int fused;                   // resize_ms includes the palette mapping, which
+                                 // ran in the same bands
+    double total_ms;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    long process_peak_rss_kb;    // peak RSS of the whole process so far
+    unsigned long allocs;        // allocation calls on this thread, counted only
+                                 // with STATS_COUNT_ALLOCS
+    unsigned long long alloc_bytes;
+    unsigned long long arena_peak_bytes; // job arena high-water mark
+    int median_cut_splits;
+    int cache_hits;              // --cache results served without decoding
+    int cache_misses;
+    int palette_cache_hits;      // --cache palettes reused
+    int palette_cache_misses;
+    // Stage stack and clock
+    int depth;
+    StatsStage stack[STATS_MAX_DEPTH];
+    double start_ms;
+    double stage_start_ms;
+} ConvertStats;
+
+#if STATS_ENABLED
+
+// Stats of the conversion running on this thread, NULL when none
+extern __thread ConvertStats *current_stats;
+
+// Start collecting into stats on this thread
+void stats_begin(ConvertStats *stats, const char *input);
+
+// Stop collecting and record the total time and peak RSS
+void stats_end(ConvertStats *stats);
+
+void stats_stage_begin(StatsStage stage);
+void stats_stage_end(void);
+
+// Write stats as one JSON line with a single stdio call, so records from
+// concurrent conversions do not interleave
+void stats_write_json(const ConvertStats *stats, int result, FILE *out);
+
+#define STATS_STAGE_BEGIN(stage) stats_stage_begin(stage)
+#define STATS_STAGE_END() stats_stage_end()
+#define STATS_ADD(field, n) do { if (current_stats) current_stats->field += (n); } while (0)
+#define STATS_SET(field, v) do { if (current_stats) current_stats->field = (v); } while (0)
+
+#else
+
+#define STATS_STAGE_BEGIN(stage) ((void)0)
+#define STATS_STAGE_END() ((void)0)
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_SET(field, v) ((void)0)
+
+#endif // STATS_ENABLED
+
+#endif // STATS_H
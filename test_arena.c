@@ -0,0 +1,94 @@
+// Unit test: arena allocations are aligned and disjoint, the high-water mark
+// follows the live bytes, freeing the newest allocation rolls it back, a
+// reset starts over in the same memory, and job_malloc falls back to the
+// heap when no arena is active.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+static int failures;
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+int main(void) {
+    Arena *arena = arena_create(0);
+    if (!arena) {
+        fprintf(stderr, "FAIL: cannot create arena\n");
+        return 1;
+    }
+    Arena *previous = arena_activate(arena);
+    check(previous == NULL, "no arena active before the first activation");
+
+    // Sizes that straddle the alignment, plus ones larger than a chunk
+    static const size_t sizes[] = {1, 63, 64, 65, 1000, 720 * 576 * 3, 3 << 20, 20 << 20};
+    enum { COUNT = sizeof(sizes) / sizeof(sizes[0]) };
+    uint8_t *blocks[COUNT];
+    size_t live = 0;
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = (uint8_t*)job_malloc(sizes[i]);
+        check(blocks[i] != NULL, "allocation succeeds");
+        check(((uintptr_t)blocks[i] & 63) == 0, "allocations are 64-byte aligned");
+        memset(blocks[i], i + 1, sizes[i]);
+        live += sizes[i];
+    }
+    for (int i = 0; i < COUNT; i++) {
+        check(blocks[i][0] == i + 1 && blocks[i][sizes[i] - 1] == i + 1,
+              "allocations do not overlap");
+    }
+    size_t peak = arena_high_water(arena);
+    check(peak >= live && peak < live + COUNT * 64, "high-water mark counts the live bytes");
+
+    // Only the newest allocation is given back
+    job_free(blocks[COUNT - 1]);
+    uint8_t *again = (uint8_t*)job_malloc(sizes[COUNT - 1]);
+    check(again == blocks[COUNT - 1], "freeing the newest allocation rolls it back");
+    job_free(blocks[0]);
+    uint8_t *after = (uint8_t*)job_malloc(1);
+    check(after != blocks[0], "freeing an older allocation keeps it");
+    check(arena_high_water(arena) >= peak, "high-water mark does not drop on free");
+
+    uint8_t *zeroed = (uint8_t*)job_calloc(4096, 1);
+    int all_zero = zeroed != NULL;
+    for (int i = 0; all_zero && i < 4096; i++) {
+        all_zero = zeroed[i] == 0;
+    }
+    check(all_zero, "job_calloc clears reused memory");
+
+    // A reset starts again at the first chunk
+    arena_reset(arena);
+    check(arena_high_water(arena) == 0, "reset clears the high-water mark");
+    uint8_t *first = (uint8_t*)job_malloc(sizes[0]);
+    check(first == blocks[0], "reset reuses the first chunk");
+
+    // Without an active arena the heap is used, and job_free frees it
+    arena_activate(NULL);
+    uint8_t *heap = (uint8_t*)job_malloc(100);
+    check(heap != NULL, "heap fallback succeeds");
+    arena_activate(arena);
+    job_free(heap);
+    check(arena_high_water(arena) == 64, "freeing heap memory leaves the arena alone");
+    arena_activate(previous);
+    arena_destroy(arena);
+
+    // Pooled arenas come back reset
+    Arena *pooled = arena_acquire();
+    check(pooled != NULL, "pool creates an arena");
+    arena_alloc(pooled, 1000);
+    arena_release(pooled);
+    Arena *reused = arena_acquire();
+    check(reused == pooled && arena_high_water(reused) == 0, "pool reuses released arenas");
+    arena_release(reused);
+
+    if (failures) {
+        fprintf(stderr, "%d arena checks failed\n", failures);
+        return 1;
+    }
+    printf("All arena checks passed\n");
+    return 0;
+}
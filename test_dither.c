@@ -0,0 +1,126 @@
+// Unit test: the Floyd-Steinberg wavefront must give exactly the row-by-row
+// result for any number of workers, and both dither modes must reproduce the
+// average level of a flat gray between two palette entries.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dither.h"
+
+static Image* make_image(int width, int height) {
+    Image *img = create_image(width, height);
+    if (!img) {
+        return NULL;
+    }
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = image_row(img, y);
+        for (int x = 0; x < width; x++) {
+            row[x * 3 + 0] = (x * 255) / (width > 1 ? width - 1 : 1);
+            row[x * 3 + 1] = (y * 255) / (height > 1 ? height - 1 : 1);
+            row[x * 3 + 2] = rand() & 0xFF;
+        }
+    }
+    return img;
+}
+
+static int check_wavefront(const PaletteMap *map, ThreadPool *pool, int width, int height) {
+    Image *img = make_image(width, height);
+    IndexedImage *expected = create_indexed_image(width, height, 8);
+    IndexedImage *actual = create_indexed_image(width, height, 8);
+    Ditherer dither;
+    if (!img || !expected || !actual || ditherer_init(&dither, map, DITHER_FS, width) != 0) {
+        return -1;
+    }
+    for (int y = 0; y < height; y++) {
+        dither_row(&dither, image_row(img, y), y, expected->indices + (size_t)y * width);
+    }
+    ditherer_free(&dither);
+
+    int failures = 0;
+    for (int workers = 1; workers <= 5; workers++) {
+        memset(actual->indices, 0xFF, (size_t)width * height);
+        if (dither_fs_image(map, img, actual, pool, workers) != 0 ||
+            memcmp(expected->indices, actual->indices, (size_t)width * height) != 0) {
+            fprintf(stderr, "FAIL: wavefront %dx%d with %d workers\n", width, height, workers);
+            failures++;
+        }
+    }
+    free_image(img);
+    free_indexed_image(expected);
+    free_indexed_image(actual);
+    return failures ? -1 : 0;
+}
+
+// Fraction of white pixels when dithering flat gray to black and white
+static double white_fraction(const PaletteMap *map, DitherMode mode, uint8_t gray) {
+    enum { SIZE = 64 };
+    uint8_t rgb[SIZE * 3];
+    uint8_t indices[SIZE];
+    memset(rgb, gray, sizeof(rgb));
+    Ditherer dither;
+    if (ditherer_init(&dither, map, mode, SIZE) != 0) {
+        return -1.0;
+    }
+    int white = 0;
+    for (int y = 0; y < SIZE; y++) {
+        dither_row(&dither, rgb, y, indices);
+        for (int x = 0; x < SIZE; x++) {
+            white += indices[x];
+        }
+    }
+    ditherer_free(&dither);
+    return (double)white / (SIZE * SIZE);
+}
+
+int main(void) {
+    static const Color palette[NUM_COLORS] = {
+        {0, 0, 0}, {0, 0, 170}, {0, 170, 0}, {0, 170, 170}, {170, 0, 0}, {170, 0, 170},
+        {170, 85, 0}, {170, 170, 170}, {85, 85, 85}, {85, 85, 255}, {85, 255, 85},
+        {85, 255, 255}, {255, 85, 85}, {255, 85, 255}, {255, 255, 85}, {255, 255, 255}
+    };
+    static const Color black_white[2] = {{0, 0, 0}, {255, 255, 255}};
+    static const int sizes[][2] = {{1, 1}, {7, 3}, {2, 40}, {33, 9}, {130, 17}, {720, 576}};
+    int failures = 0;
+    srand(99);
+
+    PaletteMap *map = (PaletteMap*)malloc(sizeof(PaletteMap));
+    ThreadPool *pool = pool_create(4);
+    if (!map || !pool) {
+        return 1;
+    }
+    palette_map_init(map, palette, NUM_COLORS);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        if (check_wavefront(map, pool, sizes[s][0], sizes[s][1]) != 0) {
+            failures++;
+        }
+    }
+
+    // Error diffusion keeps the mean exactly; the 8x8 threshold to within
+    // its level spacing at the palette's contrast
+    palette_map_init(map, black_white, 2);
+    static const uint8_t grays[] = {96, 128, 160};
+    for (size_t g = 0; g < sizeof(grays) / sizeof(grays[0]); g++) {
+        double level = grays[g] / 255.0;
+        double fs = white_fraction(map, DITHER_FS, grays[g]);
+        if (fs < level - 0.02 || fs > level + 0.02) {
+            fprintf(stderr, "FAIL: fs gray %d gives %.3f white\n", grays[g], fs);
+            failures++;
+        }
+        // The threshold spans 64 levels around 128, so only mid gray is
+        // split between black and white
+        double ordered = white_fraction(map, DITHER_ORDERED, grays[g]);
+        double expected = grays[g] == 128 ? 0.5 : grays[g] > 128 ? 1.0 : 0.0;
+        if (ordered < expected - 0.05 || ordered > expected + 0.05) {
+            fprintf(stderr, "FAIL: ordered gray %d gives %.3f white\n", grays[g], ordered);
+            failures++;
+        }
+    }
+
+    pool_destroy(pool);
+    free(map);
+    if (failures) {
+        fprintf(stderr, "%d dither checks failed\n", failures);
+        return 1;
+    }
+    printf("All dither checks passed\n");
+    return 0;
+}
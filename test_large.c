@@ -0,0 +1,109 @@
+// Synthetic large images for the test-large target: writes a width x height
+// PNG or JPEG one row at a time, so images far larger than memory can be
+// generated. The pattern has gradients for the resize and palette stages and
+// an 8x8 checkerboard, and compresses well.
+//
+// Usage: test_large png|jpeg|progressive <width> <height> <file>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+
+static void fill_row(uint8_t *row, int width, int height, int y) {
+    int check_y = (int)((long long)y * 8 / height);
+    for (int x = 0; x < width; x++) {
+        int check_x = (int)((long long)x * 8 / width);
+        row[x * 3 + 0] = (uint8_t)((long long)x * 255 / width);
+        row[x * 3 + 1] = (uint8_t)((long long)y * 255 / height);
+        row[x * 3 + 2] = ((check_x + check_y) & 1) ? 224 : 32;
+    }
+}
+
+static int write_png(FILE *fp, int width, int height, uint8_t *row) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info) {
+        png_destroy_write_struct(&png, NULL);
+        return -1;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return -1;
+    }
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, 1);
+    png_set_filter(png, 0, PNG_FILTER_SUB);
+    png_write_info(png, info);
+    for (int y = 0; y < height; y++) {
+        fill_row(row, width, height, y);
+        png_write_row(png, row);
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    return 0;
+}
+
+static int write_jpeg(FILE *fp, int width, int height, int progressive, uint8_t *row) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 75, TRUE);
+    if (progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
+    jpeg_start_compress(&cinfo, TRUE);
+    for (int y = 0; y < height; y++) {
+        fill_row(row, width, height, y);
+        JSAMPROW rows[1] = {row};
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s png|jpeg|progressive <width> <height> <file>\n", argv[0]);
+        return 1;
+    }
+    int width = atoi(argv[2]);
+    int height = atoi(argv[3]);
+    if (width < 1 || height < 1) {
+        fprintf(stderr, "Error: Invalid size %sx%s\n", argv[2], argv[3]);
+        return 1;
+    }
+    uint8_t *row = (uint8_t*)malloc((size_t)width * 3);
+    FILE *fp = fopen(argv[4], "wb");
+    if (!row || !fp) {
+        fprintf(stderr, "Error: Cannot create %s\n", argv[4]);
+        return 1;
+    }
+    int result;
+    if (strcmp(argv[1], "png") == 0) {
+        result = write_png(fp, width, height, row);
+    } else if (strcmp(argv[1], "jpeg") == 0 || strcmp(argv[1], "progressive") == 0) {
+        result = write_jpeg(fp, width, height, strcmp(argv[1], "progressive") == 0, row);
+    } else {
+        fprintf(stderr, "Error: Unknown format %s\n", argv[1]);
+        result = -1;
+    }
+    free(row);
+    if (fclose(fp) != 0 || result != 0) {
+        fprintf(stderr, "Error: Cannot write %s\n", argv[4]);
+        return 1;
+    }
+    return 0;
+}
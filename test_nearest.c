@@ -0,0 +1,76 @@
+// Unit test: every SIMD nearest-color kernel must match the scalar reference
+// exactly, including tie-breaking, over random pixels and palettes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nearest_kernel.h"
+#include "palette_map.h"
+
+#define TEST_PIXELS 100003  // not a multiple of any vector width
+
+static const char *kernels[] = {"scalar", "sse2", "avx2"};
+
+int main(void) {
+    uint8_t *rgb = (uint8_t*)malloc(TEST_PIXELS * 3);
+    uint8_t *expected = (uint8_t*)malloc(TEST_PIXELS);
+    uint8_t *actual = (uint8_t*)malloc(TEST_PIXELS);
+    if (!rgb || !expected || !actual) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    
+    srand(12345);
+    int failures = 0;
+    for (int round = 0; round < 50; round++) {
+        Color palette[NUM_COLORS];
+        int num_colors = 1 + round % NUM_COLORS;
+        for (int c = 0; c < num_colors; c++) {
+            palette[c].r = rand() & 0xFF;
+            palette[c].g = rand() & 0xFF;
+            palette[c].b = rand() & 0xFF;
+        }
+        // Duplicate entries and equidistant pairs exercise the tie-breaking
+        if (num_colors > 3 && round % 3 == 0) {
+            palette[num_colors - 1] = palette[1];
+        }
+        if (num_colors > 2 && round % 4 == 1) {
+            palette[0].r = palette[0].g = palette[0].b = 100;
+            palette[2].r = palette[2].g = palette[2].b = 110;
+        }
+        
+        for (int i = 0; i < TEST_PIXELS * 3; i++) {
+            rgb[i] = rand() & 0xFF;
+        }
+        // Some pixels exactly halfway between entries 0 and 2
+        for (int i = 0; i < TEST_PIXELS; i += 7) {
+            rgb[i * 3 + 0] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = 105;
+        }
+        
+        for (int i = 0; i < TEST_PIXELS; i++) {
+            expected[i] = nearest_color(palette, num_colors, rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+        }
+        
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            NearestKernel kernel = nearest_kernel_get(kernels[k]);
+            if (!kernel) {
+                continue;
+            }
+            memset(actual, 0xEE, TEST_PIXELS);
+            kernel(palette, num_colors, rgb, actual, TEST_PIXELS);
+            if (memcmp(expected, actual, TEST_PIXELS) != 0) {
+                fprintf(stderr, "FAIL: kernel %s, round %d, %d colors\n", kernels[k], round, num_colors);
+                failures++;
+            }
+        }
+    }
+    
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        printf("%s: %s\n", kernels[k], nearest_kernel_get(kernels[k]) ? "tested" : "not supported");
+    }
+    printf("selected: %s\n", nearest_colors_kernel_name());
+    
+    free(rgb);
+    free(expected);
+    free(actual);
+    return failures > 0 ? 1 : 0;
+}
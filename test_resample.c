@@ -0,0 +1,109 @@
+// Unit test: the coefficient tables must sum to one for every destination
+// pixel, and every SIMD resample kernel must match the scalar reference
+// exactly for down- and upscales of both filters.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resample.h"
+
+static const char *kernels[] = {"scalar", "sse2", "avx2"};
+
+static int check_taps(const ResampleTaps *taps, const int16_t *weights, int dst_size, int src_size) {
+    for (int i = 0; i < dst_size; i++) {
+        int sum = 0;
+        for (int k = 0; k < taps[i].count; k++) {
+            sum += weights[taps[i].offset + k];
+        }
+        if (sum != 1 << RESAMPLE_BITS || taps[i].start < 0 ||
+            taps[i].start + taps[i].count > src_size) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(void) {
+    static const int sizes[][4] = {
+        {6000, 4000, 720, 576}, {1023, 767, 720, 576}, {100, 80, 720, 576},
+        {721, 577, 720, 576}, {37, 5, 13, 3}, {720, 576, 720, 576},
+    };
+    int failures = 0;
+    srand(4321);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int filter = RESAMPLE_AREA; filter <= RESAMPLE_BILINEAR; filter++) {
+            int src_w = sizes[s][0], src_h = sizes[s][1];
+            int dst_w = sizes[s][2], dst_h = sizes[s][3];
+            Resampler *rs = resampler_create(src_w, src_h, dst_w, dst_h, filter);
+            if (!rs) {
+                return 1;
+            }
+            if (check_taps(rs->x_taps, rs->x_weights, dst_w, src_w) != 0 ||
+                check_taps(rs->y_taps, rs->y_weights, dst_h, src_h) != 0) {
+                fprintf(stderr, "FAIL: taps for %dx%d -> %dx%d, filter %d\n", src_w, src_h, dst_w, dst_h, filter);
+                failures++;
+            }
+
+            uint8_t *src = (uint8_t*)malloc(src_w * 3);
+            uint8_t *expected = (uint8_t*)malloc(dst_w * 3);
+            uint8_t *actual = (uint8_t*)malloc(dst_w * 3);
+            int count = rs->max_y_taps;
+            uint8_t **rows = (uint8_t**)malloc(sizeof(uint8_t*) * count);
+            for (int k = 0; k < count; k++) {
+                rows[k] = (uint8_t*)malloc(dst_w * 3);
+                for (int i = 0; i < dst_w * 3; i++) {
+                    rows[k][i] = rand() & 0xFF;
+                }
+            }
+            for (int i = 0; i < src_w * 3; i++) {
+                src[i] = rand() & 0xFF;
+            }
+            // Saturated runs check the rounding at the top of the range
+            memset(src, 0xFF, src_w * 3 / 4);
+
+            HorizontalKernel ref_h, h;
+            VerticalKernel ref_v, v;
+            resample_kernels_get("scalar", &ref_h, &ref_v);
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                if (resample_kernels_get(kernels[k], &h, &v) != 0) {
+                    continue;
+                }
+                ref_h(rs->x_taps, rs->x_weights, src, src_w, expected, dst_w);
+                h(rs->x_taps, rs->x_weights, src, src_w, actual, dst_w);
+                if (memcmp(expected, actual, dst_w * 3) != 0) {
+                    fprintf(stderr, "FAIL: horizontal %s, %d -> %d, filter %d\n", kernels[k], src_w, dst_w, filter);
+                    failures++;
+                }
+                for (int y = 0; y < dst_h; y++) {
+                    const ResampleTaps *t = &rs->y_taps[y];
+                    const int16_t *w = &rs->y_weights[t->offset];
+                    ref_v(w, t->count, (const uint8_t *const *)rows, expected, dst_w * 3);
+                    v(w, t->count, (const uint8_t *const *)rows, actual, dst_w * 3);
+                    if (memcmp(expected, actual, dst_w * 3) != 0) {
+                        fprintf(stderr, "FAIL: vertical %s, row %d, %d -> %d, filter %d\n",
+                                kernels[k], y, src_h, dst_h, filter);
+                        failures++;
+                        break;
+                    }
+                }
+            }
+
+            for (int k = 0; k < count; k++) {
+                free(rows[k]);
+            }
+            free(rows);
+            free(src);
+            free(expected);
+            free(actual);
+            resampler_free(rs);
+        }
+    }
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        HorizontalKernel h;
+        VerticalKernel v;
+        printf("%s: %s\n", kernels[k], resample_kernels_get(kernels[k], &h, &v) == 0 ? "tested" : "not supported");
+    }
+    printf("selected: %s\n", resample_kernel_name());
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+// Unit test: write_bmp_rle4 output must decode back to the exact index plane
+// for 4- and 8-bit images of awkward widths and content, with consistent
+// bfSize, biSizeImage and biCompression header fields.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transform.h"
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int get_index(const IndexedImage *img, int x, int y) {
+    const uint8_t *row = img->indices + (size_t)y * img->stride;
+    if (img->bits == 8) {
+        return row[x];
+    }
+    return (x & 1) ? row[x >> 1] & 0x0F : row[x >> 1] >> 4;
+}
+
+static void set_index(IndexedImage *img, int x, int y, int value) {
+    uint8_t *row = img->indices + (size_t)y * img->stride;
+    if (img->bits == 8) {
+        row[x] = value;
+    } else if (x & 1) {
+        row[x >> 1] = (row[x >> 1] & 0xF0) | value;
+    } else {
+        row[x >> 1] = (row[x >> 1] & 0x0F) | (value << 4);
+    }
+}
+
+// Decode BI_RLE4 data into pixels (width * height, top row first), following
+// the format as a reader would. Returns 0 when the stream is well formed and
+// covers every pixel exactly.
+static int decode_rle4(const uint8_t *data, size_t size, int width, int height, uint8_t *pixels) {
+    size_t pos = 0;
+    int x = 0, y = height - 1;
+    memset(pixels, 0xFF, (size_t)width * height);
+    while (pos + 2 <= size) {
+        int count = data[pos], value = data[pos + 1];
+        pos += 2;
+        if (count > 0) {
+            if (y < 0 || x + count > width) {
+                return -1;
+            }
+            for (int i = 0; i < count; i++) {
+                pixels[(size_t)y * width + x++] = (i & 1) ? value & 0x0F : value >> 4;
+            }
+        } else if (value == 0) {
+            if (x != width) {
+                return -1;
+            }
+            x = 0;
+            y--;
+        } else if (value == 1) {
+            return (x == width && y == 0 && pos == size) ? 0 : -1;
+        } else if (value == 2) {
+            return -1; // delta, never written
+        } else {
+            size_t bytes = ((value + 1) / 2 + 1) & ~(size_t)1;
+            if (y < 0 || x + value > width || pos + bytes > size) {
+                return -1;
+            }
+            for (int i = 0; i < value; i++) {
+                uint8_t byte = data[pos + i / 2];
+                pixels[(size_t)y * width + x++] = (i & 1) ? byte & 0x0F : byte >> 4;
+            }
+            pos += bytes;
+        }
+    }
+    return -1;
+}
+
+static void fill(IndexedImage *img, int pattern) {
+    for (int y = 0; y < img->height; y++) {
+        for (int x = 0; x < img->width; x++) {
+            int value;
+            switch (pattern) {
+                case 0: value = 7; break;                                  // flat
+                case 1: value = rand() & 0x0F; break;                      // noise
+                case 2: value = (x & 1) ? 3 : 12; break;                   // dither
+                case 3: value = (x / 9 + y) % 5 == 0 ? rand() & 0x0F : x / 40 % 16; break;
+                default: value = (x % 7 < 3) ? rand() & 0x0F : (y & 0x0F); break;
+            }
+            set_index(img, x, y, value);
+        }
+    }
+}
+
+static int check(int width, int height, int bits, int pattern) {
+    IndexedImage *img = create_indexed_image(width, height, bits);
+    if (!img) {
+        return -1;
+    }
+    img->num_colors = 16;
+    for (int i = 0; i < 16; i++) {
+        img->palette[i] = (Color){i * 16, 255 - i * 16, i * 5};
+    }
+    fill(img, pattern);
+
+    char *bmp = NULL;
+    size_t bmp_size = 0;
+    FILE *out = open_memstream(&bmp, &bmp_size);
+    size_t data_size = write_bmp_rle4(img, out);
+    fclose(out);
+
+    uint8_t *header = (uint8_t*)bmp;
+    uint32_t offset = bmp_size >= 54 ? get_u32(header + 10) : 0;
+    uint8_t *pixels = (uint8_t*)malloc((size_t)width * height);
+    int ok = data_size > 0 && bmp_size >= 54 && header[0] == 'B' && header[1] == 'M' &&
+             get_u32(header + 2) == bmp_size && get_u32(header + 30) == 2 &&
+             get_u32(header + 34) == data_size && offset + data_size == bmp_size &&
+             (header[28] | (header[29] << 8)) == 4 &&
+             decode_rle4(header + offset, data_size, width, height, pixels) == 0;
+    for (int y = 0; ok && y < height; y++) {
+        for (int x = 0; ok && x < width; x++) {
+            ok = pixels[(size_t)y * width + x] == get_index(img, x, y);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "FAIL: %dx%d, %d bits, pattern %d\n", width, height, bits, pattern);
+    }
+    free(pixels);
+    free(bmp);
+    free_indexed_image(img);
+    return ok ? 0 : -1;
+}
+
+int main(void) {
+    static const int widths[] = {1, 2, 3, 4, 5, 7, 255, 256, 257, 511, 720};
+    int failures = 0;
+    srand(2024);
+
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        for (int bits = 4; bits <= 8; bits += 4) {
+            for (int pattern = 0; pattern < 5; pattern++) {
+                if (check(widths[w], 9, bits, pattern) != 0) {
+                    failures++;
+                }
+            }
+        }
+    }
+    if (check(720, 576, 4, 3) != 0) {
+        failures++;
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d RLE4 round trips failed\n", failures);
+        return 1;
+    }
+    printf("All RLE4 round trips match\n");
+    return 0;
+}
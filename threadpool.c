@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+typedef struct {
+    TaskFunc func;
+    void *arg;
+} Task;
+
+// Per-worker double-ended queue. The owner pushes and pops at the bottom
+// (most recent first, for locality), thieves take from the top (oldest
+// first), so a worker stuck on one large image only loses its backlog.
+typedef struct {
+    pthread_mutex_t lock;
+    Task *tasks;     // ring buffer
+    int capacity;
+    int head;        // index of the top (oldest) task
+    int count;
+} WorkQueue;
+
+struct ThreadPool {
+    int num_threads;
+    pthread_t *threads;
+    WorkQueue *queues;
+    
+    pthread_mutex_t lock;      // protects the fields below
+    pthread_cond_t work_cond;  // signalled when tasks are queued or on shutdown
+    pthread_cond_t done_cond;  // signalled when pending drops to zero
+    int pending;               // queued plus running tasks
+    int queued;                // tasks sitting in queues
+    int next_queue;            // round-robin target for external submits
+    int shutdown;
+};
+
+typedef struct {
+    ThreadPool *pool;
+    int index;
+} WorkerArg;
+
+static __thread int current_worker = -1;
+static __thread ThreadPool *current_pool = NULL;
+
+static int queue_push(WorkQueue *q, Task task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        int new_capacity = q->capacity ? q->capacity * 2 : 64;
+        Task *new_tasks = (Task*)malloc(sizeof(Task) * new_capacity);
+        if (!new_tasks) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for (int i = 0; i < q->count; i++) {
+            new_tasks[i] = q->tasks[(q->head + i) % q->capacity];
+        }
+        free(q->tasks);
+        q->tasks = new_tasks;
+        q->capacity = new_capacity;
+        q->head = 0;
+    }
+    q->tasks[(q->head + q->count) % q->capacity] = task;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Owner side: take the most recently pushed task
+static int queue_pop_bottom(WorkQueue *q, Task *task) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        q->count--;
+        *task = q->tasks[(q->head + q->count) % q->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// Thief side: take the oldest task
+static int queue_steal_top(WorkQueue *q, Task *task) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        *task = q->tasks[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+static int find_task(ThreadPool *pool, int self, Task *task) {
+    if (queue_pop_bottom(&pool->queues[self], task)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->num_threads; i++) {
+        int victim = (self + i) % pool->num_threads;
+        if (queue_steal_top(&pool->queues[victim], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *p) {
+    WorkerArg *warg = (WorkerArg*)p;
+    ThreadPool *pool = warg->pool;
+    int self = warg->index;
+    free(warg);
+    
+    current_worker = self;
+    current_pool = pool;
+    
+    for (;;) {
+        Task task;
+        if (find_task(pool, self, &task)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            
+            task.func(task.arg);
+            
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) {
+                pthread_cond_broadcast(&pool->done_cond);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        int stop = pool->shutdown && pool->queued == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Create a pool of worker threads
+ThreadPool* pool_create(int num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    
+    ThreadPool *pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    pool->queues = (WorkQueue*)calloc(num_threads, sizeof(WorkQueue));
+    if (!pool->threads || !pool->queues) {
+        free(pool->threads);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    
+    pool->num_threads = num_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+    
+    for (int i = 0; i < num_threads; i++) {
+        WorkerArg *warg = (WorkerArg*)malloc(sizeof(WorkerArg));
+        if (warg) {
+            warg->pool = pool;
+            warg->index = i;
+        }
+        if (!warg || pthread_create(&pool->threads[i], NULL, worker_main, warg) != 0) {
+            free(warg);
+            pool->num_threads = i;
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+// Queue a task
+int pool_submit(ThreadPool *pool, TaskFunc func, void *arg) {
+    Task task = {func, arg};
+    int target;
+    
+    pthread_mutex_lock(&pool->lock);
+    if (current_pool == pool) {
+        target = current_worker;
+    } else {
+        target = pool->next_queue;
+        pool->next_queue = (pool->next_queue + 1) % pool->num_threads;
+    }
+    // Counted before the push, so a worker that takes the task at once
+    // never sees the counters without it
+    pool->pending++;
+    pool->queued++;
+    pthread_mutex_unlock(&pool->lock);
+    
+    int result = queue_push(&pool->queues[target], task);
+    
+    pthread_mutex_lock(&pool->lock);
+    if (result != 0) {
+        pool->queued--;
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->done_cond);
+        }
+    } else {
+        pthread_cond_signal(&pool->work_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return result;
+}
+
+// Wait until every submitted task has finished
+void pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Stop the workers and free the pool
+void pool_destroy(ThreadPool *pool) {
+    if (!pool) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
+
+// Number of online CPUs
+int pool_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
@@ -0,0 +1,25 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Task function run on a worker thread
+typedef void (*TaskFunc)(void *arg);
+
+typedef struct ThreadPool ThreadPool;
+
+// Create a pool of num_threads workers, each with its own work-stealing queue
+ThreadPool* pool_create(int num_threads);
+
+// Queue a task. Tasks submitted from a worker go to that worker's queue,
+// others are spread round-robin. Returns 0 on success.
+int pool_submit(ThreadPool *pool, TaskFunc func, void *arg);
+
+// Wait until every submitted task has finished
+void pool_wait(ThreadPool *pool);
+
+// Stop the workers and free the pool (waits for queued tasks first)
+void pool_destroy(ThreadPool *pool);
+
+// Number of online CPUs, at least 1
+int pool_default_threads(void);
+
+#endif // THREADPOOL_H
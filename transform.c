@@ -0,0 +1,1832 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "transform.h"
+#include "threadpool.h"
+#include "resample.h"
+#include "median_cut.h"
+#include "palette_map.h"
+#include "dither.h"
+#include "png_reader.h"
+#include "jpeg_reader.h"
+#include "stats.h"
+#include "cache.h"
+#include "arena.h"
+
+// BMP file structures
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t bfType;
+    uint32_t bfSize;
+    uint16_t bfReserved1;
+    uint16_t bfReserved2;
+    uint32_t bfOffBits;
+} BMPFileHeader;
+
+typedef struct {
+    uint32_t biSize;
+    int32_t biWidth;
+    int32_t biHeight;
+    uint16_t biPlanes;
+    uint16_t biBitCount;
+    uint32_t biCompression;
+    uint32_t biSizeImage;
+    int32_t biXPelsPerMeter;
+    int32_t biYPelsPerMeter;
+    uint32_t biClrUsed;
+    uint32_t biClrImportant;
+} BMPInfoHeader;
+
+typedef struct {
+    uint8_t rgbBlue;
+    uint8_t rgbGreen;
+    uint8_t rgbRed;
+    uint8_t rgbReserved;
+} RGBQuad;
+#pragma pack(pop)
+
+// Monotonic clock in milliseconds, for the stats output
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Detect image format from the first bytes of the input
+static ImageFormat detect_format_bytes(const unsigned char *header, size_t bytes_read) {
+    if (bytes_read < 3) {
+        // Need at least 3 bytes for JPEG signature, 8 for PNG
+        return FORMAT_UNKNOWN;
+    }
+    
+    // Check for PNG signature: 0x89 0x50 0x4E 0x47 0x0D 0x0A 0x1A 0x0A
+    if (bytes_read >= 8 &&
+        header[0] == 0x89 && header[1] == 0x50 && header[2] == 0x4E && header[3] == 0x47 &&
+        header[4] == 0x0D && header[5] == 0x0A && header[6] == 0x1A && header[7] == 0x0A) {
+        return FORMAT_PNG;
+    }
+    
+    // Check for JPEG signature: 0xFF 0xD8 0xFF
+    if (header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
+        return FORMAT_JPEG;
+    }
+    
+    return FORMAT_UNKNOWN;
+}
+
+// Detect image format from magic bytes
+ImageFormat detect_image_format(FILE *fp) {
+    unsigned char header[8];
+    
+    // Read the first 8 bytes for format detection
+    size_t bytes_read = fread(header, 1, 8, fp);
+    if (bytes_read < 3 || ferror(fp)) {
+        // If there's a read error, don't seek back
+        return FORMAT_UNKNOWN;
+    }
+    
+    // Seek back to the beginning
+    fseek(fp, 0, SEEK_SET);
+    
+    return detect_format_bytes(header, bytes_read);
+}
+
+// Decode from an input source once the format is known
+static Image* read_image_from_source(const InputSource *src, ImageFormat format,
+                                     const DecodeHints *hints, DecodeInfo *info) {
+    Image *img = NULL;
+    switch (format) {
+        case FORMAT_PNG:
+            img = read_png_from_source(src, hints, info);
+            break;
+        case FORMAT_JPEG:
+            img = read_jpeg_from_source(src, hints, info);
+            break;
+        default:
+            break;
+    }
+    return img;
+}
+
+// An input opened for decoding: a memory-mapped file, or a stream whose
+// sniffed header bytes are replayed in front of the remaining data
+typedef struct {
+    InputSource src;
+    ImageFormat format;
+    unsigned char header[8];
+    FILE *fp;       // stream opened by open_input, NULL for stdin
+    void *map;
+    size_t map_size;
+} InputFile;
+
+// Read and detect the first 8 bytes of a stream. The consumed bytes are
+// kept in in->header and replayed to the decoder, which then reads the rest
+// of the stream as it arrives; nothing is buffered up front or spooled to disk.
+static int sniff_stream(FILE *fp, InputFile *in) {
+    if (fread(in->header, 1, 8, fp) != 8) {
+        fprintf(stderr, "Error: Failed to read image header\n");
+        return -1;
+    }
+    in->format = detect_format_bytes(in->header, 8);
+    in->src.prefix = in->header;
+    in->src.prefix_size = sizeof(in->header);
+    in->src.fp = fp;
+    STATS_ADD(bytes_read, sizeof(in->header));
+    return 0;
+}
+
+static void close_input(InputFile *in) {
+    if (in->map) {
+        munmap(in->map, in->map_size);
+    }
+    if (in->fp) {
+        fclose(in->fp);
+    }
+}
+
+// Open a file for decoding. Regular files are mapped read-only with
+// sequential readahead and decoded straight from the mapping; anything that
+// cannot be mapped (pipes, devices, empty files) falls back to stdio.
+static int open_input(const char *filename, InputFile *in) {
+    memset(in, 0, sizeof(*in));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file %s\n", filename);
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            in->map = map;
+            in->map_size = st.st_size;
+            in->src.prefix = (const uint8_t*)map;
+            in->src.prefix_size = in->map_size;
+            in->format = detect_format_bytes(in->src.prefix,
+                                             in->map_size < 8 ? in->map_size : 8);
+            STATS_ADD(bytes_read, in->map_size);
+            goto check;
+        }
+    }
+    
+    in->fp = fdopen(fd, "rb");
+    if (!in->fp) {
+        fprintf(stderr, "Error: Cannot open file %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    if (sniff_stream(in->fp, in) != 0) {
+        close_input(in);
+        return -1;
+    }
+    
+check:
+    if (in->format == FORMAT_UNKNOWN) {
+        fprintf(stderr, "Error: Unknown or unsupported image format\n");
+        close_input(in);
+        return -1;
+    }
+    STATS_SET(format, in->format);
+    return 0;
+}
+
+// Set up stdin for decoding
+static int open_stdin_input(InputFile *in) {
+    memset(in, 0, sizeof(*in));
+    if (sniff_stream(stdin, in) != 0) {
+        return -1;
+    }
+    if (in->format == FORMAT_UNKNOWN) {
+        fprintf(stderr, "Error: Unknown or unsupported image format from stdin\n");
+        return -1;
+    }
+    STATS_SET(format, in->format);
+    return 0;
+}
+
+// Set up an in-memory image for decoding
+static int open_buffer_input(const uint8_t *data, size_t size, InputFile *in) {
+    memset(in, 0, sizeof(*in));
+    in->src.prefix = data;
+    in->src.prefix_size = size;
+    in->format = detect_format_bytes(data, size < 8 ? size : 8);
+    if (in->format == FORMAT_UNKNOWN) {
+        fprintf(stderr, "Error: Unknown or unsupported image format\n");
+        return -1;
+    }
+    STATS_ADD(bytes_read, size);
+    STATS_SET(format, in->format);
+    return 0;
+}
+
+// Open the input of a conversion: a file, a buffer or stdin
+static int open_convert_input(const ConvertIO *io, InputFile *in) {
+    if (io->input_file) {
+        return open_input(io->input_file, in);
+    }
+    if (io->data) {
+        return open_buffer_input(io->data, io->size, in);
+    }
+    return open_stdin_input(in);
+}
+
+// Read image with automatic format detection
+Image* read_image_auto(const char *filename, const DecodeHints *hints, DecodeInfo *info) {
+    InputFile in;
+    if (open_input(filename, &in) != 0) {
+        return NULL;
+    }
+    Image *img = read_image_from_source(&in.src, in.format, hints, info);
+    close_input(&in);
+    return img;
+}
+
+// Read image from stdin with automatic format detection
+Image* read_image_from_stdin(const DecodeHints *hints, DecodeInfo *info) {
+    InputFile in;
+    if (open_stdin_input(&in) != 0) {
+        return NULL;
+    }
+    return read_image_from_source(&in.src, in.format, hints, info);
+}
+
+// Open a row-by-row decoder once the format is known
+static RowReader* open_row_reader(const InputSource *src, ImageFormat format,
+                                  const DecodeHints *hints, DecodeInfo *info) {
+    RowReader *reader = NULL;
+    switch (format) {
+        case FORMAT_PNG:
+            reader = png_open_row_reader(src, hints);
+            if (reader && info) {
+                info->source_width = reader->width;
+                info->source_height = reader->height;
+                info->scale_num = info->scale_denom = 1;
+            }
+            break;
+        case FORMAT_JPEG:
+            reader = jpeg_open_row_reader(src, hints, info);
+            break;
+        default:
+            break;
+    }
+    return reader;
+}
+
+// Nearest neighbor resize of destination rows [y_start, y_end) into dst
+static void resize_rows(Image *src, Image *dst, int y_start, int y_end) {
+    int new_width = dst->width;
+    float x_ratio = (float)src->width / new_width;
+    float y_ratio = (float)src->height / dst->height;
+
+    for (int y = y_start; y < y_end; y++) {
+        const uint8_t *src_row = image_row(src, (int)(y * y_ratio));
+        uint8_t *dst_row = image_row(dst, y);
+        for (int x = 0; x < new_width; x++) {
+            int src_idx = (int)(x * x_ratio) * 3;
+            
+            dst_row[x * 3 + 0] = src_row[src_idx + 0];
+            dst_row[x * 3 + 1] = src_row[src_idx + 1];
+            dst_row[x * 3 + 2] = src_row[src_idx + 2];
+        }
+    }
+}
+
+// Resize image using simple nearest neighbor interpolation
+Image* resize_image(Image *src, int new_width, int new_height) {
+    Image *dst = create_image(new_width, new_height);
+    if (!dst) {
+        return NULL;
+    }
+
+    resize_rows(src, dst, 0, new_height);
+
+    return dst;
+}
+
+// Crop image to match target aspect ratio (crop on long side only). The
+// result is a view into src, no pixels are copied.
+Image* crop_to_aspect_ratio(Image *src, int target_width, int target_height) {
+    int new_width, new_height, crop_x, crop_y;
+    if (!crop_window(src->width, src->height, target_width, target_height,
+                     &crop_x, &crop_y, &new_width, &new_height)) {
+        return NULL;
+    }
+    return image_view(src, crop_x, crop_y, new_width, new_height);
+}
+
+// Structure for median-cut color box
+typedef struct {
+    int r_min, r_max;
+    int g_min, g_max;
+    int b_min, b_max;
+    Color *colors;
+    size_t count;
+} ColorBox;
+
+// Find the range of each color channel in a box
+void find_box_range(ColorBox *box) {
+    box->r_min = box->g_min = box->b_min = 255;
+    box->r_max = box->g_max = box->b_max = 0;
+    
+    for (size_t i = 0; i < box->count; i++) {
+        if (box->colors[i].r < box->r_min) box->r_min = box->colors[i].r;
+        if (box->colors[i].r > box->r_max) box->r_max = box->colors[i].r;
+        if (box->colors[i].g < box->g_min) box->g_min = box->colors[i].g;
+        if (box->colors[i].g > box->g_max) box->g_max = box->colors[i].g;
+        if (box->colors[i].b < box->b_min) box->b_min = box->colors[i].b;
+        if (box->colors[i].b > box->b_max) box->b_max = box->colors[i].b;
+    }
+}
+
+// Stable counting sort of a box by one channel (0 = r, 1 = g, 2 = b).
+// Equal keys keep their relative order, so the median split is the same on
+// every platform and the reference outputs are reproduced. -m exact still
+// sorts the per-pixel array; only -m hist runs on the histogram.
+static void sort_box_by_channel(ColorBox *box, int channel, Color *scratch) {
+    size_t offsets[256] = {0};
+    const uint8_t *keys = &box->colors[0].r + channel;
+    
+    for (size_t i = 0; i < box->count; i++) {
+        offsets[keys[i * sizeof(Color)]]++;
+    }
+    size_t pos = 0;
+    for (int v = 0; v < 256; v++) {
+        size_t n = offsets[v];
+        offsets[v] = pos;
+        pos += n;
+    }
+    for (size_t i = 0; i < box->count; i++) {
+        scratch[offsets[keys[i * sizeof(Color)]]++] = box->colors[i];
+    }
+    memcpy(box->colors, scratch, sizeof(Color) * box->count);
+}
+
+// Calculate average color of a box
+Color box_average(ColorBox *box) {
+    unsigned long long r_sum = 0, g_sum = 0, b_sum = 0;
+    for (size_t i = 0; i < box->count; i++) {
+        r_sum += box->colors[i].r;
+        g_sum += box->colors[i].g;
+        b_sum += box->colors[i].b;
+    }
+    Color avg;
+    avg.r = (uint8_t)(r_sum / box->count);
+    avg.g = (uint8_t)(g_sum / box->count);
+    avg.b = (uint8_t)(b_sum / box->count);
+    return avg;
+}
+
+// Generate optimized palette using median-cut algorithm
+void generate_optimized_palette(Image *img, Color *palette, int num_colors) {
+    size_t pixel_count = (size_t)img->width * img->height;
+    
+    // Initialize palette to black as fallback in case of early return
+    for (int i = 0; i < num_colors; i++) {
+        palette[i].r = palette[i].g = palette[i].b = 0;
+    }
+    
+    // Create array of all colors in image
+    Color *all_colors = (Color*)job_malloc(sizeof(Color) * pixel_count);
+    if (!all_colors) {
+        fprintf(stderr, "Error: Memory allocation failed for color array\n");
+        return;
+    }
+    
+    for (int y = 0; y < img->height; y++) {
+        const uint8_t *row = image_row(img, y);
+        Color *out = &all_colors[(size_t)y * img->width];
+        for (int x = 0; x < img->width; x++) {
+            out[x].r = row[x * 3 + 0];
+            out[x].g = row[x * 3 + 1];
+            out[x].b = row[x * 3 + 2];
+        }
+    }
+    
+    // Create initial box containing all colors
+    ColorBox *boxes = (ColorBox*)job_malloc(sizeof(ColorBox) * num_colors);
+    Color *scratch = (Color*)job_malloc(sizeof(Color) * pixel_count);
+    if (!boxes || !scratch) {
+        fprintf(stderr, "Error: Memory allocation failed for color boxes\n");
+        job_free(boxes);
+        job_free(scratch);
+        job_free(all_colors);
+        return;
+    }
+    
+    boxes[0].colors = all_colors;
+    boxes[0].count = pixel_count;
+    find_box_range(&boxes[0]);
+    int num_boxes = 1;
+    
+    // Split boxes until we have enough
+    while (num_boxes < num_colors) {
+        // Find box with largest range to split
+        int best_box = -1;
+        int best_range = 0;
+        
+        for (int i = 0; i < num_boxes; i++) {
+            if (boxes[i].count < 2) continue; // Can't split a box with fewer than 2 colors
+            
+            int r_range = boxes[i].r_max - boxes[i].r_min;
+            int g_range = boxes[i].g_max - boxes[i].g_min;
+            int b_range = boxes[i].b_max - boxes[i].b_min;
+            int max_range = r_range > g_range ? r_range : g_range;
+            max_range = max_range > b_range ? max_range : b_range;
+            
+            if (max_range > best_range) {
+                best_range = max_range;
+                best_box = i;
+            }
+        }
+        
+        if (best_box == -1) break; // No more boxes can be split
+        
+        // Determine which channel to split on
+        int r_range = boxes[best_box].r_max - boxes[best_box].r_min;
+        int g_range = boxes[best_box].g_max - boxes[best_box].g_min;
+        int b_range = boxes[best_box].b_max - boxes[best_box].b_min;
+        
+        if (r_range >= g_range && r_range >= b_range) {
+            sort_box_by_channel(&boxes[best_box], 0, scratch);
+        } else if (g_range >= r_range && g_range >= b_range) {
+            sort_box_by_channel(&boxes[best_box], 1, scratch);
+        } else {
+            sort_box_by_channel(&boxes[best_box], 2, scratch);
+        }
+        
+        // Split at median
+        size_t median = boxes[best_box].count / 2;
+        
+        // Create new box from second half
+        boxes[num_boxes].colors = boxes[best_box].colors + median;
+        boxes[num_boxes].count = boxes[best_box].count - median;
+        find_box_range(&boxes[num_boxes]);
+        
+        // Shrink original box to first half
+        boxes[best_box].count = median;
+        find_box_range(&boxes[best_box]);
+        
+        num_boxes++;
+    }
+    STATS_ADD(median_cut_splits, num_boxes - 1);
+    
+    // Calculate average color for each box
+    for (int i = 0; i < num_boxes; i++) {
+        palette[i] = box_average(&boxes[i]);
+    }
+    
+    // If we have fewer boxes than colors needed, fill remaining with black
+    for (int i = num_boxes; i < num_colors; i++) {
+        palette[i].r = palette[i].g = palette[i].b = 0;
+    }
+    
+    job_free(boxes);
+    job_free(scratch);
+    job_free(all_colors);
+}
+
+// Generate a palette with the given method
+void generate_palette(Image *img, Color *palette, int num_colors, int method) {
+    if (method == PALETTE_HISTOGRAM) {
+        ColorHistogram *hist = histogram_create(HISTOGRAM_BITS);
+        if (!hist) {
+            fprintf(stderr, "Error: Memory allocation failed for color histogram\n");
+            memset(palette, 0, sizeof(Color) * num_colors);
+            return;
+        }
+        for (int y = 0; y < img->height; y++) {
+            histogram_add_pixels(hist, image_row(img, y), img->width);
+        }
+        median_cut_histogram(hist, palette, num_colors);
+        histogram_free(hist);
+    } else {
+        generate_optimized_palette(img, palette, num_colors);
+    }
+}
+
+// Palette files use the JASC-PAL text format: a "JASC-PAL" line, the version
+// "0100", the number of colors, then one "r g b" line per color
+int save_palette(const char *filename, const Color *palette, int num_colors) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot create palette file %s\n", filename);
+        return -1;
+    }
+    fprintf(fp, "JASC-PAL\n0100\n%d\n", num_colors);
+    for (int i = 0; i < num_colors; i++) {
+        fprintf(fp, "%d %d %d\n", palette[i].r, palette[i].g, palette[i].b);
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error: Cannot write palette file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int load_palette(const char *filename, Color *palette, int num_colors) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open palette file %s\n", filename);
+        return -1;
+    }
+    char magic[16];
+    int version, count;
+    int ok = fscanf(fp, "%15s %d %d", magic, &version, &count) == 3 &&
+             strcmp(magic, "JASC-PAL") == 0 && count >= 1 && count <= num_colors;
+    for (int i = 0; ok && i < count; i++) {
+        int r, g, b;
+        ok = fscanf(fp, "%d %d %d", &r, &g, &b) == 3 &&
+             r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255;
+        palette[i].r = r;
+        palette[i].g = g;
+        palette[i].b = b;
+    }
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "Error: Invalid palette file %s (expected JASC-PAL with 1 to %d colors)\n",
+                filename, num_colors);
+        return -1;
+    }
+    // Repeat the last color; the lowest index wins ties, so repeats never map
+    for (int i = count; i < num_colors; i++) {
+        palette[i] = palette[count - 1];
+    }
+    return 0;
+}
+
+// Standard 16-color palette (similar to VGA palette)
+static const Color vga_palette[16] = {
+    {0, 0, 0},       // Black
+    {0, 0, 170},     // Blue
+    {0, 170, 0},     // Green
+    {0, 170, 170},   // Cyan
+    {170, 0, 0},     // Red
+    {170, 0, 170},   // Magenta
+    {170, 85, 0},    // Brown
+    {170, 170, 170}, // Light Gray
+    {85, 85, 85},    // Dark Gray
+    {85, 85, 255},   // Light Blue
+    {85, 255, 85},   // Light Green
+    {85, 255, 255},  // Light Cyan
+    {255, 85, 85},   // Light Red
+    {255, 85, 255},  // Light Magenta
+    {255, 255, 85},  // Yellow
+    {255, 255, 255}  // White
+};
+
+// Inverse colormap of the VGA palette, built once per process
+static PaletteMap vga_map;
+static pthread_once_t vga_map_once = PTHREAD_ONCE_INIT;
+
+static void build_vga_map(void) {
+    palette_map_init(&vga_map, vga_palette, 16);
+}
+
+// Inverse colormap for a palette: the shared VGA table, or one built into
+// storage for an optimized palette
+static const PaletteMap* get_palette_map(const Color *palette, int num_colors,
+                                         int optimize_palette, PaletteMap *storage) {
+    if (!optimize_palette) {
+        pthread_once(&vga_map_once, build_vga_map);
+        return &vga_map;
+    }
+    palette_map_init(storage, palette, num_colors);
+    return storage;
+}
+
+// Set up a palette that is known before the image is seen: fixed_palette
+// when given, otherwise VGA unless a palette is generated. Returns its
+// inverse colormap, or NULL when the palette is generated from the image.
+static const PaletteMap* preset_palette(const Color *fixed_palette, int optimize_palette,
+                                        Color *palette, int num_colors, PaletteMap *storage) {
+    if (fixed_palette) {
+        memcpy(palette, fixed_palette, sizeof(Color) * num_colors);
+        palette_map_init(storage, palette, num_colors);
+        return storage;
+    }
+    if (!optimize_palette) {
+        memcpy(palette, vga_palette, sizeof(Color) * 16);
+        return get_palette_map(palette, num_colors, optimize_palette, storage);
+    }
+    return NULL;
+}
+
+// Size in bytes of one 4bpp BMP row, padded to a 4-byte boundary
+static int bmp_row_size(int width) {
+    return ((width * 4 + 31) / 32) * 4; // 4 bits per pixel
+}
+
+IndexedImage* create_indexed_image(int width, int height, int bits) {
+    IndexedImage *img = (IndexedImage*)job_calloc(1, sizeof(IndexedImage));
+    if (!img) {
+        fprintf(stderr, "Error: Memory allocation failed for indexed image\n");
+        return NULL;
+    }
+    img->width = width;
+    img->height = height;
+    img->bits = bits;
+    img->stride = bits == 4 ? bmp_row_size(width) : width;
+    img->indices = (uint8_t*)job_calloc(img->stride, height);
+    if (!img->indices) {
+        fprintf(stderr, "Error: Memory allocation failed for color indices\n");
+        job_free(img);
+        return NULL;
+    }
+    return img;
+}
+
+void free_indexed_image(IndexedImage *img) {
+    if (img) {
+        job_free(img->indices);
+        job_free(img);
+    }
+}
+
+// Pack one row of palette indices into 4bpp (high nibble first)
+void pack_row_4bpp(const uint8_t *indices, int width, uint8_t *row_buffer, int row_size) {
+    memset(row_buffer, 0, row_size);
+    for (int x = 0; x < width; x++) {
+        uint8_t color_idx = indices[x];
+        
+        int byte_idx = x / 2;
+        if (x % 2 == 0) {
+            row_buffer[byte_idx] |= (color_idx << 4);
+        } else {
+            row_buffer[byte_idx] |= color_idx;
+        }
+    }
+}
+
+// Map RGB row y to palette indices with the ditherer and pack it into 4bpp
+static void map_pack_row(const uint8_t *rgb, int y, Ditherer *dither,
+                         uint8_t *indices, uint8_t *row_buffer, int row_size) {
+    dither_row(dither, rgb, y, indices);
+    pack_row_4bpp(indices, dither->width, row_buffer, row_size);
+}
+
+// Bump when a change alters the output, so stale cache entries stop matching
+#define CACHE_VERSION 1
+
+// Integer hash for the sample positions (lowbias32)
+static uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+Image* sample_pixels(Image *img, int num_samples) {
+    // Grid cells roughly square in the image, about num_samples of them
+    int cols = (int)(sqrt((double)num_samples * img->width / img->height) + 0.5);
+    cols = cols < 1 ? 1 : cols > img->width ? img->width : cols;
+    int rows = (num_samples + cols - 1) / cols;
+    rows = rows < 1 ? 1 : rows > img->height ? img->height : rows;
+    
+    Image *sample = create_image(cols * rows, 1);
+    if (!sample) {
+        return NULL;
+    }
+    uint8_t *out = sample->data;
+    for (int r = 0; r < rows; r++) {
+        int y0 = (int)((long long)r * img->height / rows);
+        int y1 = (int)((long long)(r + 1) * img->height / rows);
+        for (int c = 0; c < cols; c++) {
+            int x0 = (int)((long long)c * img->width / cols);
+            int x1 = (int)((long long)(c + 1) * img->width / cols);
+            uint32_t h = hash32((uint32_t)(r * cols + c));
+            int x = x0 + (int)((h & 0xFFFF) % (uint32_t)(x1 - x0));
+            int y = y0 + (int)((h >> 16) % (uint32_t)(y1 - y0));
+            memcpy(out, image_row(img, y) + x * 3, 3);
+            out += 3;
+        }
+    }
+    return sample;
+}
+
+double palette_error(Image *img, const Color *palette, int num_colors) {
+    double total = 0.0;
+    for (int y = 0; y < img->height; y++) {
+        const uint8_t *row = image_row(img, y);
+        uint64_t row_total = 0;
+        for (int x = 0; x < img->width; x++) {
+            const uint8_t *px = &row[x * 3];
+            const Color *c = &palette[nearest_color(palette, num_colors, px[0], px[1], px[2])];
+            int dr = px[0] - c->r;
+            int dg = px[1] - c->g;
+            int db = px[2] - c->b;
+            row_total += dr * dr + dg * dg + db * db;
+        }
+        total += row_total;
+    }
+    return img->width > 0 && img->height > 0 ? total / ((double)img->width * img->height) : 0.0;
+}
+
+// Palette from a stratified sample of the pixels. With verbose, the palette
+// from every pixel is generated as well and both errors are reported.
+static void generate_sampled_palette(Image *img, Color *palette, int num_colors, int method,
+                                     int num_samples, int verbose) {
+    double start = now_ms();
+    Image *sample = sample_pixels(img, num_samples);
+    if (!sample) {
+        generate_palette(img, palette, num_colors, method);
+        return;
+    }
+    generate_palette(sample, palette, num_colors, method);
+    double sample_ms = now_ms() - start;
+    
+    if (verbose) {
+        Color full[MAX_INDEXED_COLORS];
+        start = now_ms();
+        generate_palette(img, full, num_colors, method);
+        double full_ms = now_ms() - start;
+        double sample_mse = palette_error(img, palette, num_colors);
+        double full_mse = palette_error(img, full, num_colors);
+        fprintf(stderr, "palette from %d of %zu pixels: MSE %.2f, full palette MSE %.2f (%+.1f%%), "
+                "%.1f ms instead of %.1f ms\n",
+                sample->width, (size_t)img->width * img->height, sample_mse, full_mse,
+                full_mse > 0 ? (sample_mse - full_mse) * 100.0 / full_mse : 0.0,
+                sample_ms, full_ms);
+    }
+    free_image(sample);
+}
+
+// Generate the palette of an image with the method of opts: from a pixel
+// sample with palette_samples, and through the palette cache, keyed by the
+// pixels the palette is generated from, with a cache
+static void generate_image_palette(Image *img, Color *palette, int num_colors,
+                                   const ConvertOptions *opts) {
+    int method = opts->optimize_palette;
+    int samples = opts->palette_samples;
+    if ((size_t)samples >= (size_t)img->width * img->height) {
+        samples = 0; // the sample would be the whole image
+    }
+    ResultCache *cache = opts->cache;
+    CacheKey key;
+    // Only the contiguous target-size images are hashed
+    int cacheable = cache && img->stride == img->width * 3;
+    if (cacheable) {
+        int salt[5] = {CACHE_VERSION, num_colors, method, img->width, samples};
+        cache_key(img->data, (size_t)img->stride * img->height, salt, sizeof(salt), &key);
+        if (cache_get_palette(cache, &key, palette, num_colors) == 0) {
+            STATS_ADD(palette_cache_hits, 1);
+            return;
+        }
+        STATS_ADD(palette_cache_misses, 1);
+    }
+    if (samples > 0) {
+        generate_sampled_palette(img, palette, num_colors, method, samples, opts->verbose);
+    } else {
+        generate_palette(img, palette, num_colors, method);
+    }
+    if (cacheable) {
+        cache_put_palette(cache, &key, palette, num_colors);
+    }
+}
+
+// quantize_colors with the palette options of opts
+static IndexedImage* quantize_with(Image *img, int num_colors, const ConvertOptions *opts) {
+    int optimize_palette = opts->optimize_palette;
+    IndexedImage *out = create_indexed_image(img->width, img->height, 4);
+    if (!out) {
+        fprintf(stderr, "Error: Memory allocation failed for quantization\n");
+        return NULL;
+    }
+    
+    PaletteMap storage;
+    const PaletteMap *map = preset_palette(opts->palette, optimize_palette,
+                                           out->palette, num_colors, &storage);
+    if (!map) {
+        // Generate optimized palette from image colors
+        STATS_STAGE_BEGIN(STAGE_PALETTE);
+        generate_image_palette(img, out->palette, num_colors, opts);
+        STATS_STAGE_END();
+        map = get_palette_map(out->palette, num_colors, optimize_palette, &storage);
+    }
+    out->num_colors = num_colors;
+    
+    // Map each pixel to nearest color in palette
+    STATS_STAGE_BEGIN(STAGE_MAP);
+    if (opts->dither == DITHER_FS) {
+        // Same result as row by row, with several rows in flight; the
+        // wavefront keeps its own index rows and error buffers
+        if (dither_fs_image(map, img, out, NULL, 1) != 0) {
+            free_indexed_image(out);
+            out = NULL;
+        }
+    } else {
+        Ditherer dither;
+        uint8_t *indices = (uint8_t*)job_malloc(img->width);
+        if (!indices || ditherer_init(&dither, map, opts->dither, img->width) != 0) {
+            fprintf(stderr, "Error: Memory allocation failed for quantization\n");
+            free_indexed_image(out);
+            out = NULL;
+        } else {
+            for (int y = 0; y < img->height; y++) {
+                map_pack_row(image_row(img, y), y, &dither,
+                             indices, out->indices + y * out->stride, out->stride);
+            }
+            ditherer_free(&dither);
+        }
+        job_free(indices);
+    }
+    STATS_STAGE_END();
+    return out;
+}
+
+IndexedImage* quantize_colors(Image *img, int num_colors, int optimize_palette) {
+    ConvertOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.optimize_palette = optimize_palette;
+    return quantize_with(img, num_colors, &opts);
+}
+
+// biCompression values
+#define BI_RGB 0
+#define BI_RLE4 2
+
+// Write the BMP file header, info header and palette
+static void write_bmp_header(int width, int height, const Color *palette, int num_colors,
+                             int compression, uint32_t pixel_data_size, FILE *out) {
+    BMPFileHeader file_header;
+    file_header.bfType = 0x4D42; // "BM"
+    file_header.bfSize = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 
+                         sizeof(RGBQuad) * num_colors + pixel_data_size;
+    file_header.bfReserved1 = 0;
+    file_header.bfReserved2 = 0;
+    file_header.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 
+                            sizeof(RGBQuad) * num_colors;
+    STATS_ADD(bytes_written, file_header.bfSize);
+    
+    BMPInfoHeader info_header;
+    info_header.biSize = sizeof(BMPInfoHeader);
+    info_header.biWidth = width;
+    info_header.biHeight = height;
+    info_header.biPlanes = 1;
+    info_header.biBitCount = 4; // 4 bits per pixel for 16 colors
+    info_header.biCompression = compression;
+    info_header.biSizeImage = pixel_data_size;
+    info_header.biXPelsPerMeter = 0;
+    info_header.biYPelsPerMeter = 0;
+    info_header.biClrUsed = num_colors;
+    info_header.biClrImportant = num_colors;
+    
+    // Write headers
+    fwrite(&file_header, sizeof(BMPFileHeader), 1, out);
+    fwrite(&info_header, sizeof(BMPInfoHeader), 1, out);
+    
+    // Write palette
+    for (int i = 0; i < num_colors; i++) {
+        RGBQuad quad;
+        quad.rgbBlue = palette[i].b;
+        quad.rgbGreen = palette[i].g;
+        quad.rgbRed = palette[i].r;
+        quad.rgbReserved = 0;
+        fwrite(&quad, sizeof(RGBQuad), 1, out);
+    }
+}
+
+// Write BMP to file pointer
+void write_bmp(const IndexedImage *img, FILE *out) {
+    int row_size = bmp_row_size(img->width);
+    write_bmp_header(img->width, img->height, img->palette, img->num_colors,
+                     BI_RGB, row_size * img->height, out);
+    
+    // 4-bit rows already have the BMP layout
+    if (img->bits == 4 && img->stride == row_size) {
+        for (int y = img->height - 1; y >= 0; y--) {
+            fwrite(img->indices + y * img->stride, row_size, 1, out);
+        }
+        return;
+    }
+    
+    // Write pixel data (bottom to top, 4 bits per pixel, padded)
+    uint8_t *row_buffer = (uint8_t*)job_calloc(row_size, 1);
+    if (!row_buffer) {
+        fprintf(stderr, "Error: Memory allocation failed for row buffer\n");
+        return;
+    }
+    for (int y = img->height - 1; y >= 0; y--) {
+        const uint8_t *row = img->indices + y * img->stride;
+        if (img->bits == 4) {
+            memset(row_buffer, 0, row_size);
+            memcpy(row_buffer, row, (img->width + 1) / 2);
+        } else {
+            pack_row_4bpp(row, img->width, row_buffer, row_size);
+        }
+        fwrite(row_buffer, row_size, 1, out);
+    }
+    
+    job_free(row_buffer);
+}
+
+// Shortest alternating run worth an encoded run inside literal pixels
+#define RLE4_MIN_RUN 4
+
+// Length of the run at x that an RLE4 encoded run can represent: pixels
+// alternating between px[x] and px[x + 1] (a single color when both match)
+static int rle4_run_length(const uint8_t *px, int x, int width) {
+    int n = 2;
+    int limit = width - x < 255 ? width - x : 255;
+    if (limit < 2) {
+        return limit;
+    }
+    while (n < limit && px[x + n] == px[x + (n & 1)]) {
+        n++;
+    }
+    return n;
+}
+
+static int rle4_run_starts(const uint8_t *px, int x, int width) {
+    return x + RLE4_MIN_RUN <= width && px[x + 2] == px[x] && px[x + 3] == px[x + 1];
+}
+
+// Encode one row of 8-bit indices as BI_RLE4 and end it with an end-of-line,
+// or with end-of-bitmap for the last row. Returns the number of bytes
+// written to out, which must hold width + width / 128 * 2 + 8 bytes.
+static size_t rle4_encode_row(const uint8_t *px, int width, int last, uint8_t *out) {
+    size_t n = 0;
+    int x = 0;
+    while (x < width) {
+        // Literal pixels up to the next run worth encoding
+        int start = x;
+        while (x < width && x - start < 255 && !rle4_run_starts(px, x, width)) {
+            x++;
+        }
+        int literal = x - start;
+        if (literal >= 3) {
+            // Absolute mode: 0, count, packed pixels padded to a 16-bit boundary
+            out[n++] = 0;
+            out[n++] = (uint8_t)literal;
+            for (int i = 0; i < literal; i += 2) {
+                uint8_t lo = i + 1 < literal ? px[start + i + 1] : 0;
+                out[n++] = (uint8_t)(px[start + i] << 4 | lo);
+            }
+            if (((literal + 1) / 2) & 1) {
+                out[n++] = 0;
+            }
+        } else if (literal > 0) {
+            // Counts below 3 are escapes in absolute mode, so use a short run
+            out[n++] = (uint8_t)literal;
+            out[n++] = (uint8_t)(px[start] << 4 | (literal == 2 ? px[start + 1] : 0));
+        }
+        if (x < width && rle4_run_starts(px, x, width)) {
+            int run = rle4_run_length(px, x, width);
+            out[n++] = (uint8_t)run;
+            out[n++] = (uint8_t)(px[x] << 4 | px[x + 1]);
+            x += run;
+        }
+    }
+    out[n++] = 0;
+    out[n++] = last ? 1 : 0;
+    return n;
+}
+
+// Encode all rows bottom to top, writing them to out unless it is NULL.
+// Returns the encoded size.
+static size_t rle4_encode(const IndexedImage *img, uint8_t *px, uint8_t *buffer, FILE *out) {
+    size_t total = 0;
+    for (int y = img->height - 1; y >= 0; y--) {
+        const uint8_t *row = img->indices + y * img->stride;
+        if (img->bits == 4) {
+            for (int x = 0; x < img->width; x++) {
+                px[x] = x & 1 ? row[x / 2] & 0x0F : row[x / 2] >> 4;
+            }
+        } else {
+            memcpy(px, row, img->width);
+        }
+        size_t n = rle4_encode_row(px, img->width, y == 0, buffer);
+        if (out) {
+            fwrite(buffer, n, 1, out);
+        }
+        total += n;
+    }
+    return total;
+}
+
+size_t write_bmp_rle4(const IndexedImage *img, FILE *out) {
+    uint8_t *px = (uint8_t*)job_malloc(img->width);
+    uint8_t *buffer = (uint8_t*)job_malloc(img->width + img->width / 128 * 2 + 8);
+    if (!px || !buffer) {
+        fprintf(stderr, "Error: Memory allocation failed for RLE4 encoding\n");
+        job_free(px);
+        job_free(buffer);
+        return 0;
+    }
+    // The headers need the compressed size: encode once to measure, then
+    // again to write, one row at a time
+    size_t size = rle4_encode(img, px, buffer, NULL);
+    write_bmp_header(img->width, img->height, img->palette, img->num_colors,
+                     BI_RLE4, (uint32_t)size, out);
+    rle4_encode(img, px, buffer, out);
+    job_free(px);
+    job_free(buffer);
+    return size;
+}
+
+// Skip skip source rows and read the next one into row (NULL: only skip).
+// Inside the fused streaming pass this is the time charged to decoding.
+static int stream_read_row(RowReader *reader, int skip, uint8_t *row) {
+    STATS_STAGE_BEGIN(STAGE_DECODE);
+    int result = (skip > 0 ? reader->skip_rows(reader, skip) : 0) != 0 ||
+                 (row && reader->read_row(reader, row) != 0) ? -1 : 0;
+    STATS_STAGE_END();
+    return result;
+}
+
+// Produce destination row y with the resampler, reading source rows from the
+// reader as the vertical taps advance. Horizontally filtered rows are kept in
+// ring at slot row % max_y_taps, as in resample_rows.
+static int stream_resample_row(RowReader *reader, const Resampler *rs, int y,
+                               int crop_x, int crop_y, int *next_row, uint8_t *src_row,
+                               uint8_t *ring, const uint8_t **rows, uint8_t *rgb) {
+    const ResampleTaps *t = &rs->y_taps[y];
+    int row_bytes = rs->dst_width * 3;
+    int r = *next_row - crop_y; // in crop window coordinates
+    if (r < t->start) {
+        if (stream_read_row(reader, t->start - r, NULL) != 0) {
+            return -1;
+        }
+        r = t->start;
+    }
+    for (; r < t->start + t->count; r++) {
+        if (stream_read_row(reader, 0, src_row) != 0) {
+            return -1;
+        }
+        resample_row_horizontal(rs, &src_row[crop_x * 3], &ring[(r % rs->max_y_taps) * row_bytes]);
+    }
+    *next_row = crop_y + r;
+    
+    for (int k = 0; k < t->count; k++) {
+        rows[k] = &ring[((t->start + k) % rs->max_y_taps) * row_bytes];
+    }
+    resample_row_vertical(rs, y, rows, rgb);
+    return 0;
+}
+
+// Streaming conversion: pull source rows one at a time, drop rows outside the
+// crop window and resize, map and pack each kept row straight into the 4bpp
+// output. Without palette optimization only a few rows are held besides the
+// output; with it, the reduced target-size RGB image is kept for the median
+// cut and a second mapping pass. Produces exactly the same pixels as
+// crop_to_aspect_ratio + resize_image + quantize_colors.
+// Returns the 4-bit indexed image, or NULL on failure.
+static IndexedImage* stream_convert(RowReader *reader, int target_width, int target_height,
+                                    int num_colors, const ConvertOptions *opts) {
+    int optimize_palette = opts->optimize_palette;
+    int resample = opts->resample;
+    // Only a generated palette needs the reduced image and a second pass
+    int generate = optimize_palette && !opts->palette;
+    int crop_x = 0, crop_y = 0;
+    int crop_width = reader->width, crop_height = reader->height;
+    if (opts->crop_mode) {
+        crop_window(reader->width, reader->height, target_width, target_height,
+                            &crop_x, &crop_y, &crop_width, &crop_height);
+    }
+    
+    IndexedImage *packed = create_indexed_image(target_width, target_height, 4);
+    uint8_t *src_row = (uint8_t*)job_malloc((size_t)reader->width * 3);
+    uint8_t *dst_row = (uint8_t*)job_malloc(target_width * 3);
+    uint8_t *indices = (uint8_t*)job_malloc(target_width);
+    int *x_map = (int*)job_malloc(sizeof(int) * target_width);
+    Resampler *rs = NULL;
+    uint8_t *ring = NULL;
+    const uint8_t **ring_rows = NULL;
+    if (resample != RESAMPLE_NEAREST) {
+        rs = resampler_create(crop_width, crop_height, target_width, target_height, resample);
+        if (rs) {
+            ring = (uint8_t*)job_malloc(rs->max_y_taps * target_width * 3);
+            ring_rows = (const uint8_t**)job_malloc(sizeof(uint8_t*) * rs->max_y_taps);
+        }
+    }
+    Image *resized = NULL;
+    if (generate) {
+        resized = create_image(target_width, target_height);
+    }
+    Ditherer dither;
+    memset(&dither, 0, sizeof(dither));
+    if (!packed || !src_row || !dst_row || !indices || !x_map ||
+        (resample != RESAMPLE_NEAREST && (!rs || !ring || !ring_rows)) ||
+        (generate && !resized)) {
+        fprintf(stderr, "Error: Memory allocation failed for streaming buffers\n");
+        free_indexed_image(packed);
+        packed = NULL;
+        goto done;
+    }
+    int row_size = packed->stride;
+    Color *palette = packed->palette;
+    packed->num_colors = num_colors;
+    
+    // Same sampling positions as resize_image
+    float x_ratio = (float)crop_width / target_width;
+    float y_ratio = (float)crop_height / target_height;
+    for (int x = 0; x < target_width; x++) {
+        x_map[x] = crop_x + (int)(x * x_ratio);
+    }
+    
+    PaletteMap storage;
+    const PaletteMap *map = preset_palette(opts->palette, optimize_palette,
+                                           palette, num_colors, &storage);
+    if (map && ditherer_init(&dither, map, opts->dither, target_width) != 0) {
+        free_indexed_image(packed);
+        packed = NULL;
+        goto done;
+    }
+    
+    int next_row = 0; // next source row the reader will return
+    if (reader->skip_rows(reader, crop_y) != 0) {
+        goto fail;
+    }
+    next_row = crop_y;
+    
+    // Rows are read under the decode stage and mapped under the map stage,
+    // the rest of the pass is resizing
+    STATS_STAGE_BEGIN(STAGE_RESIZE);
+    int last_src_y = -1;
+    for (int y = 0; y < target_height; y++) {
+        uint8_t *out_row = packed->indices + y * row_size;
+        uint8_t *rgb = generate ? image_row(resized, y) : dst_row;
+        
+        if (rs) {
+            if (stream_resample_row(reader, rs, y, crop_x, crop_y, &next_row,
+                                    src_row, ring, ring_rows, rgb) != 0) {
+                goto row_fail;
+            }
+        } else {
+            int src_y = crop_y + (int)(y * y_ratio);
+            if (src_y == last_src_y) {
+                // Upscaling: repeat the previous destination row. A dithered
+                // row depends on y, so only the RGB row can be reused.
+                if (generate) {
+                    memcpy(rgb, rgb - target_width * 3, target_width * 3);
+                } else if (opts->dither == DITHER_NONE) {
+                    memcpy(out_row, out_row - row_size, row_size);
+                } else {
+                    STATS_STAGE_BEGIN(STAGE_MAP);
+                    map_pack_row(rgb, y, &dither, indices, out_row, row_size);
+                    STATS_STAGE_END();
+                }
+                continue;
+            }
+            
+            if (stream_read_row(reader, src_y - next_row, src_row) != 0) {
+                goto row_fail;
+            }
+            next_row = src_y + 1;
+            last_src_y = src_y;
+            
+            for (int x = 0; x < target_width; x++) {
+                const uint8_t *px = &src_row[x_map[x] * 3];
+                rgb[x * 3 + 0] = px[0];
+                rgb[x * 3 + 1] = px[1];
+                rgb[x * 3 + 2] = px[2];
+            }
+        }
+        
+        if (!generate) {
+            STATS_STAGE_BEGIN(STAGE_MAP);
+            map_pack_row(rgb, y, &dither, indices, out_row, row_size);
+            STATS_STAGE_END();
+        }
+    }
+    STATS_STAGE_END();
+    
+    if (generate) {
+        // Second pass over the reduced image only, never over the source
+        STATS_STAGE_BEGIN(STAGE_PALETTE);
+        generate_image_palette(resized, palette, num_colors, opts);
+        STATS_STAGE_END();
+        STATS_STAGE_BEGIN(STAGE_MAP);
+        map = get_palette_map(palette, num_colors, optimize_palette, &storage);
+        if (ditherer_init(&dither, map, opts->dither, target_width) != 0) {
+            STATS_STAGE_END();
+            free_indexed_image(packed);
+            packed = NULL;
+            goto done;
+        }
+        for (int y = 0; y < target_height; y++) {
+            map_pack_row(image_row(resized, y), y, &dither,
+                         indices, packed->indices + y * row_size, row_size);
+        }
+        STATS_STAGE_END();
+    }
+    goto done;
+    
+row_fail:
+    STATS_STAGE_END();
+fail:
+    fprintf(stderr, "Error: Failed to decode image row\n");
+    free_indexed_image(packed);
+    packed = NULL;
+done:
+    ditherer_free(&dither);
+    job_free(src_row);
+    job_free(dst_row);
+    job_free(indices);
+    job_free(x_map);
+    job_free(ring);
+    job_free(ring_rows);
+    resampler_free(rs);
+    free_image(resized);
+    return packed;
+}
+
+// Print the decode-scale stats line. When the image was decoded at a reduced
+// scale from a file, decode it again at full size to measure the time saved.
+static void print_decode_stats(const char *input_file, Image *img,
+                               DecodeInfo *info, double decode_ms, size_t mem_limit) {
+    fprintf(stderr, "%s: decode scale %d/%d: %dx%d -> %dx%d, %.1f ms",
+            input_file ? input_file : "stdin", info->scale_num, info->scale_denom,
+            info->source_width, info->source_height,
+            img->width, img->height, decode_ms);
+    if (info->scans) {
+        fprintf(stderr, ", stopped after %d scans", info->scans);
+    }
+    
+    // The comparison decode is full size, so it is skipped under --mem-limit
+    if (info->scale_num < info->scale_denom && input_file && !mem_limit) {
+        double full_start = now_ms();
+        Image *full = read_image_auto(input_file, NULL, NULL);
+        double full_ms = now_ms() - full_start;
+        if (full) {
+            fprintf(stderr, " (full decode %.1f ms, saved %.1f ms)", full_ms, full_ms - decode_ms);
+            free_image(full);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+// Write packed as an uncompressed BMP or, with opts->rle, an RLE4 BMP
+static void write_packed(const IndexedImage *packed, const ConvertOptions *opts,
+                         const ConvertIO *io, FILE *out) {
+    if (!opts->rle) {
+        write_bmp(packed, out);
+        return;
+    }
+    size_t size = write_bmp_rle4(packed, out);
+    if (opts->verbose && size > 0) {
+        size_t raw = (size_t)bmp_row_size(packed->width) * packed->height;
+        fprintf(stderr, "%s: RLE4 pixel data %zu bytes, %.2fx smaller than uncompressed %zu bytes\n",
+                io->input_file ? io->input_file : "stdin", size, (double)raw / size, raw);
+    }
+}
+
+// Write the BMP to io->output_file, io->out or stdout: packed, or when
+// packed is NULL the finished file in bmp. The output file is only created
+// once the conversion succeeded. Returns 0 on success.
+static int write_output(const IndexedImage *packed, const ConvertOptions *opts,
+                        const uint8_t *bmp, size_t bmp_size, const ConvertIO *io) {
+    STATS_STAGE_BEGIN(STAGE_WRITE);
+    FILE *out = io->out ? io->out : stdout;
+    if (io->output_file) {
+        out = fopen(io->output_file, "wb");
+        if (!out) {
+            STATS_STAGE_END();
+            fprintf(stderr, "Error: Cannot open output file %s\n", io->output_file);
+            return 1;
+        }
+    }
+    
+    int result = 0;
+    if (packed) {
+        write_packed(packed, opts, io, out);
+    } else {
+        result = fwrite(bmp, 1, bmp_size, out) == bmp_size ? 0 : 1;
+    }
+    
+    if (io->output_file) {
+        result = fclose(out) == 0 ? result : 1;
+    } else {
+        result = fflush(out) == 0 ? result : 1;
+    }
+    STATS_STAGE_END();
+    return result;
+}
+
+// Serialize the BMP, store it in the cache under key and write it out
+static int write_cached_output(const IndexedImage *packed, const ConvertOptions *opts,
+                               const CacheKey *key, const ConvertIO *io) {
+    char *bmp = NULL;
+    size_t bmp_size = 0;
+    FILE *mem = open_memstream(&bmp, &bmp_size);
+    if (!mem) {
+        return write_output(packed, opts, NULL, 0, io);
+    }
+    STATS_STAGE_BEGIN(STAGE_WRITE);
+    write_packed(packed, opts, io, mem);
+    int ok = fclose(mem) == 0;
+    if (ok) {
+        cache_put_result(opts->cache, key, bmp, bmp_size);
+    }
+    STATS_STAGE_END();
+    int result = ok ? write_output(NULL, opts, (const uint8_t*)bmp, bmp_size, io) : 1;
+    free(bmp);
+    return result;
+}
+
+// Streaming counterpart of the main pipeline. Closes in.
+static IndexedImage* convert_streaming(InputFile *in, const ConvertIO *io, const DecodeHints *hints,
+                                       DecodeInfo *info, const ConvertOptions *opts) {
+    // Decoding, cropping, resizing and mapping are fused into one pass over
+    // the rows; stream_convert charges each row's work to its own stage
+    double start = now_ms();
+    STATS_STAGE_BEGIN(STAGE_DECODE);
+    RowReader *reader = open_row_reader(&in->src, in->format, hints, info);
+    if (!reader) {
+        STATS_STAGE_END();
+        fprintf(stderr, "Error: Failed to read image file\n");
+        close_input(in);
+        return NULL;
+    }
+    STATS_SET(source_width, info->source_width);
+    STATS_SET(source_height, info->source_height);
+    STATS_SET(pipeline, PIPELINE_STREAMING);
+    
+    IndexedImage *packed = stream_convert(reader, TARGET_WIDTH, TARGET_HEIGHT, NUM_COLORS, opts);
+    STATS_STAGE_END();
+    if (opts->verbose) {
+        fprintf(stderr, "%s: streaming decode scale %d/%d: %dx%d -> %dx%d, %.1f ms",
+                io->input_file ? io->input_file : "stdin", info->scale_num, info->scale_denom,
+                info->source_width, info->source_height,
+                reader->width, reader->height, now_ms() - start);
+        if (info->scans) {
+            fprintf(stderr, ", stopped after %d scans", info->scans);
+        }
+        fprintf(stderr, "\n");
+    }
+    reader->close(reader);
+    close_input(in);
+    return packed;
+}
+
+// One horizontal band of the destination image
+typedef struct {
+    Image *src;            // resize source, NULL when already resized
+    const Resampler *rs;   // filter for src, NULL for nearest neighbor
+    Image *dst;            // target-size RGB image
+    const PaletteMap *map; // NULL to only resize
+    DitherMode dither;     // DITHER_FS is not split into bands
+    IndexedImage *packed;  // 4-bit output rows
+    int y_start;
+    int y_end;
+    int ok;
+} BandJob;
+
+static void run_band(void *arg) {
+    BandJob *band = (BandJob*)arg;
+    if (band->src) {
+        if (band->rs) {
+            if (resample_rows(band->rs, band->src, band->dst, band->y_start, band->y_end) != 0) {
+                band->ok = 0;
+                return;
+            }
+        } else {
+            resize_rows(band->src, band->dst, band->y_start, band->y_end);
+        }
+    }
+    if (band->map) {
+        int width = band->dst->width;
+        int row_size = band->packed->stride;
+        uint8_t *indices = (uint8_t*)job_malloc(width);
+        Ditherer dither;
+        if (!indices || ditherer_init(&dither, band->map, band->dither, width) != 0) {
+            job_free(indices);
+            band->ok = 0;
+            return;
+        }
+        for (int y = band->y_start; y < band->y_end; y++) {
+            map_pack_row(image_row(band->dst, y), y, &dither,
+                         indices, band->packed->indices + y * row_size, row_size);
+        }
+        ditherer_free(&dither);
+        job_free(indices);
+    }
+    band->ok = 1;
+}
+
+// Run one phase over all bands on the pool. Returns 0 if every band succeeded.
+static int run_bands(ThreadPool *pool, BandJob *bands, int num_bands) {
+    for (int i = 0; i < num_bands; i++) {
+        bands[i].ok = 0;
+        if (pool_submit(pool, run_band, &bands[i]) != 0) {
+            run_band(&bands[i]);
+        }
+    }
+    pool_wait(pool);
+    for (int i = 0; i < num_bands; i++) {
+        if (!bands[i].ok) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Band-parallel resize, palette mapping and 4bpp packing. The destination is
+// split into horizontal bands that are processed on separate threads; only
+// the median cut (with optimize_palette) runs on one thread between the
+// resize and mapping phases. Floyd-Steinberg error crosses band boundaries,
+// so it maps the whole image as a wavefront on the same threads instead.
+// Output is identical to the single-threaded path.
+// Returns the 4-bit indexed image, or NULL on failure.
+static IndexedImage* convert_bands(Image *source, int num_colors, const ConvertOptions *opts) {
+    int optimize_palette = opts->optimize_palette;
+    int resample = opts->resample;
+    int num_threads = opts->threads;
+    int width = TARGET_WIDTH;
+    int height = TARGET_HEIGHT;
+    int num_bands = num_threads < height ? num_threads : height;
+    
+    Image *resized = create_image(width, height);
+    IndexedImage *packed = create_indexed_image(width, height, 4);
+    BandJob *bands = (BandJob*)job_calloc(num_bands, sizeof(BandJob));
+    ThreadPool *pool = pool_create(num_threads);
+    Resampler *rs = NULL;
+    if (resample != RESAMPLE_NEAREST) {
+        rs = resampler_create(source->width, source->height, width, height, resample);
+    }
+    if (!resized || !packed || !bands || !pool || (resample != RESAMPLE_NEAREST && !rs)) {
+        fprintf(stderr, "Error: Cannot set up parallel conversion\n");
+        goto fail;
+    }
+    
+    Color *palette = packed->palette;
+    packed->num_colors = num_colors;
+    PaletteMap storage;
+    const PaletteMap *map = preset_palette(opts->palette, optimize_palette,
+                                           palette, num_colors, &storage);
+    int generate = map == NULL;
+    int wavefront = opts->dither == DITHER_FS;
+    // The first phase maps too unless a palette is generated in between or
+    // the mapping runs as a wavefront
+    STATS_SET(pipeline, PIPELINE_BANDS);
+    STATS_SET(fused, !generate && !wavefront);
+    for (int i = 0; i < num_bands; i++) {
+        bands[i].src = source;
+        bands[i].rs = rs;
+        bands[i].dst = resized;
+        bands[i].map = wavefront ? NULL : map;
+        bands[i].dither = opts->dither;
+        bands[i].packed = packed;
+        bands[i].y_start = height * i / num_bands;
+        bands[i].y_end = height * (i + 1) / num_bands;
+    }
+    
+    // With a fixed palette, resize and mapping run in a single phase
+    if (run_bands(pool, bands, num_bands) != 0) {
+        goto fail;
+    }
+    
+    if (generate) {
+        STATS_STAGE_BEGIN(STAGE_PALETTE);
+        generate_image_palette(resized, palette, num_colors, opts);
+        STATS_STAGE_END();
+        map = get_palette_map(palette, num_colors, optimize_palette, &storage);
+        for (int i = 0; i < num_bands; i++) {
+            bands[i].src = NULL;
+            bands[i].map = map;
+        }
+        if (!wavefront) {
+            STATS_STAGE_BEGIN(STAGE_MAP);
+            int result = run_bands(pool, bands, num_bands);
+            STATS_STAGE_END();
+            if (result != 0) {
+                goto fail;
+            }
+        }
+    }
+    if (wavefront) {
+        STATS_STAGE_BEGIN(STAGE_MAP);
+        int result = dither_fs_image(map, resized, packed, pool, num_threads);
+        STATS_STAGE_END();
+        if (result != 0) {
+            goto fail;
+        }
+    }
+    
+    pool_destroy(pool);
+    resampler_free(rs);
+    job_free(bands);
+    free_image(resized);
+    return packed;
+    
+fail:
+    pool_destroy(pool);
+    resampler_free(rs);
+    job_free(bands);
+    free_image(resized);
+    free_indexed_image(packed);
+    return NULL;
+}
+
+// Cache key of a conversion: the encoded input plus every option that
+// changes the output (not streaming or threads, which produce the same BMP)
+static void result_key(const InputFile *in, const ConvertOptions *opts, CacheKey *key) {
+    struct {
+        int options[14];
+        Color palette[NUM_COLORS];
+    } salt;
+    memset(&salt, 0, sizeof(salt));
+    int options[14] = {CACHE_VERSION, TARGET_WIDTH, TARGET_HEIGHT, NUM_COLORS, opts->crop_mode,
+                       opts->optimize_palette, opts->scaled_decode, opts->resample,
+                       opts->palette != NULL, opts->palette_samples, opts->rle, opts->dither,
+                       opts->progressive_coefs, opts->progressive_bits};
+    memcpy(salt.options, options, sizeof(options));
+    if (opts->palette) {
+        memcpy(salt.palette, opts->palette, sizeof(salt.palette));
+    }
+    cache_key(in->src.prefix, in->src.prefix_size, &salt, sizeof(salt), key);
+}
+
+// Resize to the target size with the filter of opts
+static Image* resize_to_target(Image *source, const ConvertOptions *opts) {
+    if (opts->resample != RESAMPLE_NEAREST) {
+        return resample_image(source, TARGET_WIDTH, TARGET_HEIGHT, opts->resample);
+    }
+    return resize_image(source, TARGET_WIDTH, TARGET_HEIGHT);
+}
+
+Image* read_resized_image(const char *input_file, const ConvertOptions *opts) {
+    DecodeHints hints = {TARGET_WIDTH, TARGET_HEIGHT, opts->crop_mode, opts->scaled_decode,
+                         opts->mem_limit, opts->progressive_coefs, opts->progressive_bits};
+    DecodeInfo info = {0, 0, 1, 1, 0, 0};
+    Image *img = read_image_auto(input_file, &hints, &info);
+    if (!img) {
+        fprintf(stderr, "Error: Failed to read image file %s\n", input_file);
+        return NULL;
+    }
+    Image *cropped = NULL;
+    if (opts->crop_mode && !info.cropped) {
+        cropped = crop_to_aspect_ratio(img, TARGET_WIDTH, TARGET_HEIGHT);
+    }
+    Image *resized = resize_to_target(cropped ? cropped : img, opts);
+    free_image(cropped);
+    free_image(img);
+    if (!resized) {
+        fprintf(stderr, "Error: Failed to resize image\n");
+    }
+    return resized;
+}
+
+// Decode, crop, resize and quantize. Closes in.
+static IndexedImage* convert_decoded(InputFile *in, const ConvertIO *io, const DecodeHints *hints,
+                                     DecodeInfo *info, const ConvertOptions *opts) {
+    // Read image (auto-detects format)
+    double decode_start = now_ms();
+    STATS_STAGE_BEGIN(STAGE_DECODE);
+    Image *img = read_image_from_source(&in->src, in->format, hints, info);
+    close_input(in);
+    STATS_STAGE_END();
+    double decode_ms = now_ms() - decode_start;
+    
+    if (!img) {
+        fprintf(stderr, "Error: Failed to read image file %s\n",
+                io->input_file ? io->input_file : io->data ? "from memory" : "from stdin");
+        return NULL;
+    }
+    STATS_SET(source_width, info->source_width);
+    STATS_SET(source_height, info->source_height);
+    
+    if (opts->verbose) {
+        print_decode_stats(io->input_file, img, info, decode_ms, opts->mem_limit);
+    }
+    
+    // Optionally crop to target aspect ratio, unless the reader already did
+    Image *source = img;
+    Image *cropped = NULL;
+    if (opts->crop_mode && !info->cropped) {
+        STATS_STAGE_BEGIN(STAGE_CROP);
+        cropped = crop_to_aspect_ratio(img, TARGET_WIDTH, TARGET_HEIGHT);
+        STATS_STAGE_END();
+        if (cropped) {
+            source = cropped;
+        }
+        // If cropped is NULL, aspect ratios already match, use original
+    }
+    
+    IndexedImage *packed;
+    
+    if (opts->threads > 1) {
+        // Resize, map and pack in parallel bands
+        STATS_STAGE_BEGIN(STAGE_RESIZE);
+        packed = convert_bands(source, NUM_COLORS, opts);
+        STATS_STAGE_END();
+        free_image(cropped);
+        free_image(img);
+    } else {
+        // Resize to 720x576
+        Image *resized;
+        STATS_STAGE_BEGIN(STAGE_RESIZE);
+        resized = resize_to_target(source, opts);
+        STATS_STAGE_END();
+        free_image(cropped);
+        free_image(img);
+        
+        if (!resized) {
+            fprintf(stderr, "Error: Failed to resize image\n");
+            return NULL;
+        }
+        
+        // Quantize to 16 colors, the RGB image is no longer needed afterwards
+        packed = quantize_with(resized, NUM_COLORS, opts);
+        free_image(resized);
+    }
+    return packed;
+}
+
+// Rows of the source a streaming conversion holds at once, including the
+// decoder's row groups
+#define STREAM_ROWS 32
+
+// Memory of the target-size stages: the resized image, the median cut's
+// copy of its colors and sort scratch, and the packed output
+#define TARGET_BYTES ((size_t)TARGET_WIDTH * TARGET_HEIGHT * 3 * 4)
+
+// Peak memory of converting the probed image with opts: the decoder's own
+// image-sized buffers, the decoded image (the crop window's rows with -c, a
+// few rows when streaming) and the target-size stages
+static size_t estimate_memory(const ImageProbe *probe, const ConvertOptions *opts) {
+    size_t row_bytes = (size_t)probe->width * 3;
+    int rows = probe->height;
+    if (!probe->whole_image) {
+        if (opts->streaming) {
+            rows = probe->height < STREAM_ROWS ? probe->height : STREAM_ROWS;
+        } else if (opts->crop_mode) {
+            int x, y, width;
+            crop_window(probe->width, probe->height, TARGET_WIDTH, TARGET_HEIGHT,
+                        &x, &y, &width, &rows);
+        }
+    }
+    return probe->decoder_bytes + row_bytes * rows + TARGET_BYTES;
+}
+
+static int probe_input(const InputFile *in, const DecodeHints *hints, ImageProbe *probe) {
+    switch (in->format) {
+        case FORMAT_PNG:
+            return png_probe(&in->src, probe);
+        case FORMAT_JPEG:
+            return jpeg_probe(&in->src, hints, probe);
+        default:
+            return -1;
+    }
+}
+
+// Fit a conversion into opts->mem_limit. The requested pipeline is kept if
+// its estimate fits, else the streaming pipeline (same output) is used, and
+// for JPEG then a streaming decode at a reduced DCT scale. Streamed input
+// cannot be probed without consuming it, so it is always converted streaming
+// and the readers enforce the limit. Updates opts and hints; returns 0, or
+// -1 with an error printed when no pipeline fits.
+static int plan_memory(const InputFile *in, const ConvertIO *io, ConvertOptions *opts,
+                       DecodeHints *hints) {
+    if (!opts->mem_limit) {
+        return 0;
+    }
+    const char *name = io->input_file ? io->input_file : io->data ? "input" : "stdin";
+    if (in->src.fp) {
+        if (opts->verbose && !opts->streaming) {
+            fprintf(stderr, "%s: streamed to stay within --mem-limit %zu MB\n",
+                    name, opts->mem_limit >> 20);
+        }
+        opts->streaming = 1;
+        return 0;
+    }
+    size_t need = 0;
+    for (int step = 0; step < 3; step++) {
+        if (step == 1) {
+            if (opts->streaming) {
+                continue;
+            }
+            opts->streaming = 1;
+        } else if (step == 2) {
+            if (in->format != FORMAT_JPEG || opts->scaled_decode) {
+                break;
+            }
+            opts->scaled_decode = hints->scale = 1;
+        }
+        ImageProbe probe;
+        if (probe_input(in, hints, &probe) != 0) {
+            return 0; // the decode reports the broken header
+        }
+        need = estimate_memory(&probe, opts);
+        if (need <= opts->mem_limit) {
+            if (opts->verbose) {
+                fprintf(stderr, "%s: %dx%d %s needs about %zu MB of --mem-limit %zu MB\n",
+                        name, probe.source_width, probe.source_height,
+                        !opts->streaming ? "decoded whole" :
+                        probe.width < probe.source_width ? "streamed at a reduced scale" : "streamed",
+                        (need + (1 << 20) - 1) >> 20, opts->mem_limit >> 20);
+            }
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: %s needs about %zu MB, more than --mem-limit %zu MB\n",
+            name, (need + (1 << 20) - 1) >> 20, opts->mem_limit >> 20);
+    return -1;
+}
+
+// Convert one image to BMP
+static int convert_one(const ConvertIO *io, const ConvertOptions *requested) {
+    // Readers may decode only the crop window; a reduced decode changes the
+    // output, so it is only allowed when requested or needed for --mem-limit
+    DecodeHints hints = {TARGET_WIDTH, TARGET_HEIGHT, requested->crop_mode,
+                         requested->scaled_decode, requested->mem_limit,
+                         requested->progressive_coefs, requested->progressive_bits};
+    DecodeInfo info = {0, 0, 1, 1, 0, 0};
+    ConvertOptions planned = *requested;
+    const ConvertOptions *opts = &planned;
+    
+    InputFile in;
+    STATS_STAGE_BEGIN(STAGE_DECODE);
+    int opened = open_convert_input(io, &in);
+    if (opened == 0 && plan_memory(&in, io, &planned, &hints) != 0) {
+        close_input(&in);
+        opened = -1;
+    }
+    STATS_STAGE_END();
+    if (opened != 0) {
+        return 1;
+    }
+    
+    // Inputs that are entirely in memory (mapped files and buffers) are looked
+    // up by content; streamed input is only seen once and is not cached
+    CacheKey key;
+    int cached = opts->cache && !in.src.fp;
+    if (cached) {
+        size_t size;
+        result_key(&in, opts, &key);
+        uint8_t *bmp = cache_get_result(opts->cache, &key, &size);
+        if (bmp) {
+            STATS_ADD(cache_hits, 1);
+            STATS_ADD(bytes_written, size);
+            close_input(&in);
+            int result = write_output(NULL, opts, bmp, size, io);
+            free(bmp);
+            return result;
+        }
+        STATS_ADD(cache_misses, 1);
+    }
+    
+    IndexedImage *packed = opts->streaming ? convert_streaming(&in, io, &hints, &info, opts)
+                                           : convert_decoded(&in, io, &hints, &info, opts);
+    if (!packed) {
+        return 1;
+    }
+    
+    int result = cached ? write_cached_output(packed, opts, &key, io)
+                        : write_output(packed, opts, NULL, 0, io);
+    free_indexed_image(packed);
+    
+    return result;
+}
+
+// Convert one image with its buffers in a pooled arena, reporting the
+// arena's high-water mark with -v and in the --stats record
+static int convert_in_arena(const ConvertIO *io, const ConvertOptions *opts) {
+    Arena *arena = arena_acquire();
+    Arena *previous = arena_activate(arena);
+    int result = convert_one(io, opts);
+    if (arena) {
+        size_t peak = arena_high_water(arena);
+        STATS_SET(arena_peak_bytes, peak);
+        if (opts->verbose) {
+            fprintf(stderr, "%s: arena peak %.1f KB\n",
+                    io->input_file ? io->input_file : "stdin", peak / 1024.0);
+        }
+    }
+    arena_activate(previous);
+    arena_release(arena);
+    return result;
+}
+
+// Convert one image, writing its --stats record when requested
+int convert_io(const ConvertIO *io, const ConvertOptions *opts) {
+#if STATS_ENABLED
+    if (opts->stats_out) {
+        ConvertStats stats;
+        stats_begin(&stats, io->input_file);
+        int result = convert_in_arena(io, opts);
+        stats_end(&stats);
+        stats_write_json(&stats, result, opts->stats_out);
+        return result;
+    }
+#endif
+    return convert_in_arena(io, opts);
+}
+
+int convert_image(const char *input_file, const char *output_file, const ConvertOptions *opts) {
+    ConvertIO io = {input_file, NULL, 0, output_file, NULL};
+    return convert_io(&io, opts);
+}
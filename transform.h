@@ -0,0 +1,124 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stdio.h>
+#include "image.h"
+
+#define TARGET_WIDTH 720
+#define TARGET_HEIGHT 576
+#define NUM_COLORS 16
+
+// Palette methods (ConvertOptions.optimize_palette)
+typedef enum {
+    PALETTE_VGA = 0,       // fixed 16-color VGA palette
+    PALETTE_MEDIAN_CUT,    // exact median cut over every pixel
+    PALETTE_HISTOGRAM      // approximate median cut over a color histogram
+} PaletteMethod;
+
+// Options for one conversion
+typedef struct {
+    int crop_mode;        // crop to the target aspect ratio before resizing
+    int optimize_palette; // a PaletteMethod, PALETTE_VGA for the fixed palette
+    int scaled_decode;    // let the JPEG decoder downscale (changes output)
+    int streaming;        // row-by-row pipeline
+    int verbose;          // print decode statistics to stderr
+    int threads;          // band-parallel threads for one image (0 or 1: serial)
+    int resample;         // a ResampleFilter, RESAMPLE_NEAREST for resize_image
+    FILE *stats_out;      // one JSON stats record per image (--stats), or NULL
+    struct ResultCache *cache; // result and palette cache (--cache), or NULL
+    const Color *palette; // NUM_COLORS colors used for every image instead of
+                          // VGA or a generated palette, or NULL
+    int palette_samples;  // generate the palette from this many sampled pixels
+                          // (0: from every pixel)
+    int rle;              // write BI_RLE4 compressed BMPs
+    int dither;           // DitherMode used when mapping to the palette
+    size_t mem_limit;     // memory budget of one conversion in bytes (0: none);
+                          // picks streaming or a scaled decode to stay within it
+    int progressive_coefs; // stop decoding a progressive JPEG once the first
+    int progressive_bits;  // progressive_coefs coefficients are known to within
+                           // progressive_bits low bits (0: decode every scan)
+} ConvertOptions;
+
+// Detect image format from magic bytes
+ImageFormat detect_image_format(FILE *fp);
+
+// Read image with automatic format detection (hints and info may be NULL)
+Image* read_image_auto(const char *filename, const DecodeHints *hints, DecodeInfo *info);
+
+// Read image from stdin with automatic format detection
+Image* read_image_from_stdin(const DecodeHints *hints, DecodeInfo *info);
+
+// Resize image using simple nearest neighbor interpolation
+Image* resize_image(Image *src, int new_width, int new_height);
+
+// Crop image to match target aspect ratio, NULL if the aspect already matches.
+// Returns a view into src, which must stay alive while the view is used.
+Image* crop_to_aspect_ratio(Image *src, int target_width, int target_height);
+
+// Generate optimized palette using median-cut algorithm
+void generate_optimized_palette(Image *img, Color *palette, int num_colors);
+
+// Generate a palette with a PaletteMethod other than PALETTE_VGA
+void generate_palette(Image *img, Color *palette, int num_colors, int method);
+
+// Deterministic stratified sample of about num_samples pixels of img: the
+// image is divided into a grid of that many cells and each cell contributes
+// one pixel at a hashed position inside it. Returns a one-row image, or NULL
+// on allocation failure.
+Image* sample_pixels(Image *img, int num_samples);
+
+// Mean squared RGB distance of the pixels of img to their nearest palette color
+double palette_error(Image *img, const Color *palette, int num_colors);
+
+// Write a palette file, returns 0 on success
+int save_palette(const char *filename, const Color *palette, int num_colors);
+
+// Read a palette file of 1 to num_colors colors; missing entries repeat the
+// last color. Returns 0 on success.
+int load_palette(const char *filename, Color *palette, int num_colors);
+
+// Color quantization to 16-color VGA palette or optimized palette
+// (optimize_palette is a PaletteMethod). Returns a 4-bit indexed image that
+// carries its palette; img is left unchanged.
+IndexedImage* quantize_colors(Image *img, int num_colors, int optimize_palette);
+
+// Pack width 4-bit palette indices into a BMP row of row_size bytes
+// (two pixels per byte, high nibble first, padding zeroed)
+void pack_row_4bpp(const uint8_t *indices, int width, uint8_t *row_buffer, int row_size);
+
+// Write a 4-bit BMP to file pointer
+void write_bmp(const IndexedImage *img, FILE *out);
+
+// Write a 4-bit BMP with BI_RLE4 compressed pixel data. Rows are encoded one
+// at a time, without holding the compressed image. Returns the size of the
+// compressed pixel data, 0 on failure.
+size_t write_bmp_rle4(const IndexedImage *img, FILE *out);
+
+// Allocate an indexed image with 8 or 4 bits per index (indices zeroed)
+IndexedImage* create_indexed_image(int width, int height, int bits);
+
+void free_indexed_image(IndexedImage *img);
+
+// Convert one image to a 720x576 16-color BMP. A NULL input_file reads
+// stdin, a NULL output_file writes stdout. Returns 0 on success.
+// Safe to call from several threads at once for different files.
+int convert_image(const char *input_file, const char *output_file, const ConvertOptions *opts);
+
+// Decode, crop and resize an image file as a conversion with opts would,
+// returning the target-size RGB image the palette is generated from
+Image* read_resized_image(const char *input_file, const ConvertOptions *opts);
+
+// Input and output of one conversion
+typedef struct {
+    const char *input_file;  // file to read, or NULL
+    const uint8_t *data;     // encoded image in memory when input_file is NULL
+    size_t size;             // (both NULL: read stdin)
+    const char *output_file; // file to create, or NULL
+    FILE *out;               // stream to write when output_file is NULL
+                             // (both NULL: write stdout)
+} ConvertIO;
+
+// convert_image with the input and output given by io
+int convert_io(const ConvertIO *io, const ConvertOptions *opts);
+
+#endif // TRANSFORM_H